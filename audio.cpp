@@ -21,12 +21,18 @@
 #include <semaphore.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <sys/time.h>
 #include <alsa/asoundlib.h>
 #include <utils.h>
+#include <resolver.h>
 #include <urtp.h>
 #include <timer.h>
 #include <log.h>
@@ -56,9 +62,22 @@
 // necessary in order to terminate it in an orderly fashion.
 #define AUDIO_SEND_DATA_RUN_ANYWAY_TIME_S 2
 
-// The maximum length of an audio server URL (including
-// terminator).
-#define AUDIO_MAX_LEN_SERVER_URL 128
+// How long to wait for the IP address of the audio server
+// when it has not been looked up before; the main loop comes
+// back to try again if the lookup takes longer.
+#define AUDIO_DNS_LOOKUP_WAIT_MS 2000
+
+// The size of the buffer that timing datagrams are received
+// into: room for a few in case they bunch up.
+#define AUDIO_TIMING_RECEIVE_BUFFER_SIZE (AUDIO_TIMING_DATAGRAM_LENGTH * 8)
+
+// The longest the encode task waits for a period of audio
+// when using mmap access.
+#define AUDIO_PCM_WAIT_MS 1000
+
+// The interval at which the server status task checks that
+// timing datagrams are arriving.
+#define AUDIO_TIMING_CHECK_INTERVAL_MS 1000
 
 // The default audio setup data.
 #define AUDIO_DEFAULT_FIXED_GAIN -1
@@ -68,6 +87,80 @@
 // up in the buffers, resulting in non real-timeness
 #define AUDIO_TCP_BUFFER_SIZE 25000
 
+// The maximum number of URTP datagrams to send in one go
+// when catching up.  There's no point in offering more than
+// will fit in the TCP buffer, so a batch is cut off at
+// AUDIO_TCP_BUFFER_SIZE bytes, but the datagrams may be as
+// small as a header (SILENCE) so allow for that many, up
+// to the number that the datagram store can hold.
+#if AUDIO_TCP_BUFFER_SIZE / URTP_HEADER_SIZE < MAX_NUM_DATAGRAMS
+# define AUDIO_MAX_DATAGRAMS_PER_SEND (AUDIO_TCP_BUFFER_SIZE / URTP_HEADER_SIZE)
+#else
+# define AUDIO_MAX_DATAGRAMS_PER_SEND MAX_NUM_DATAGRAMS
+#endif
+
+// What the reactor is woken up by: the PCM device may have
+// several poll descriptors, tagged from AUDIO_REACTOR_TAG_PCM
+// upwards.
+#define AUDIO_REACTOR_TAG_STOP   0
+#define AUDIO_REACTOR_TAG_TIMER  1
+#define AUDIO_REACTOR_TAG_SOCKET 2
+#define AUDIO_REACTOR_TAG_PCM    3
+
+// The most PCM device poll descriptors the reactor can handle.
+#define AUDIO_REACTOR_MAX_PCM_POLL_FDS 4
+
+// The most URTP blocks that a capture profile may read in one go.
+#define AUDIO_PCM_MAX_BLOCKS_PER_READ 4
+
+// The most URTP streams, one per channel of the PCM device.
+#define AUDIO_MAX_NUM_STREAMS 2
+
+// Rate control: step the audio coding down if more than this
+// many datagrams are queued for sending...
+#define AUDIO_RATE_QUEUE_HIGH_DATAGRAMS (1000 / BLOCK_DURATION_MS)
+
+// ...or the round trip delay is more than this.
+#define AUDIO_RATE_ROUNDTRIP_HIGH_MS 1000
+
+// Rate control: the link is good while fewer than this many
+// datagrams are queued for sending...
+#define AUDIO_RATE_QUEUE_LOW_DATAGRAMS (200 / BLOCK_DURATION_MS)
+
+// ...and the round trip delay is less than this.
+#define AUDIO_RATE_ROUNDTRIP_LOW_MS 300
+
+// Rate control: how long the link has to be good before the
+// audio coding is stepped up again.
+#define AUDIO_RATE_STEP_UP_GOOD_S 10
+
+// Rate control: how long to give a new audio coding to drain
+// the queue before stepping down again, unless the datagram
+// store overflows.
+#define AUDIO_RATE_HOLD_S 3
+
+/* ----------------------------------------------------------------
+ * TYPES
+ * -------------------------------------------------------------- */
+
+// A capture layout that the PCM device might offer.
+typedef struct {
+    unsigned int channels;
+    snd_pcm_format_t pcmFormat;
+    Urtp::RawAudioFormat rawAudioFormat;
+    int frameSize;
+    const char *pName;
+} PcmLayout;
+
+// A capture profile: the ALSA period and buffer sizes to ask
+// for and the number of URTP blocks to read in one go.
+typedef struct {
+    snd_pcm_uframes_t periodFrames;
+    snd_pcm_uframes_t bufferFrames;
+    unsigned int blocksPerRead;
+    const char *pName;
+} PcmProfile;
+
 /* ----------------------------------------------------------------
  * CALLBACK FUNCTION PROTOTYPES
  * -------------------------------------------------------------- */
@@ -87,7 +180,75 @@ static const char *gpAlsaPcmDeviceName = NULL;
 static const char *gpAudioServerUrl = NULL;
 
 // For monitoring progress.
-static size_t gSecondTicker;
+static size_t gSecondTicker = 0;
+
+// True if the reactor is to be used instead of separate
+// encode, send and server status tasks.
+static bool gUseReactor = false;
+
+// True if audio is to be encoded straight out of the PCM
+// device's buffer rather than being read into gRawAudio.
+static bool gUseMmap = false;
+
+// True if each URTP datagram is to be sent as a UDP packet
+// rather than streamed over TCP.
+static bool gUseUdp = false;
+
+// The age in milliseconds beyond which a URTP datagram is
+// dropped rather than sent, 0 to send everything.
+static int gMaxLatencyMs = 0;
+
+// True if the PCM device is to be asked for mono or packed
+// samples, rather than the stereo 32-bit samples which all
+// the I2S drivers we've met support.
+static bool gUseMono = false;
+
+// The capture layouts to try when gUseMono is set, most compact
+// first; the last entry is what is used otherwise.
+static const PcmLayout gPcmLayouts[] = {{1, SND_PCM_FORMAT_S24_3LE, Urtp::RAW_AUDIO_MONO_S24_3LE, 3, "mono S24_3LE"},
+                                        {1, SND_PCM_FORMAT_S32_LE, Urtp::RAW_AUDIO_MONO_S32_LE, 4, "mono S32_LE"},
+                                        {2, SND_PCM_FORMAT_S24_3LE, Urtp::RAW_AUDIO_STEREO_S24_3LE, 6, "stereo S24_3LE"},
+                                        {2, SND_PCM_FORMAT_S32_LE, Urtp::RAW_AUDIO_STEREO_S32_LE, 8, "stereo S32_LE"}};
+
+// The URTP audio codings that rate control steps between,
+// highest rate first; LPC_RESIDUAL_6_BIT is used in place of
+// UNICAM_COMPRESSED_6_BIT as it sounds better at much the same rate.
+static const Urtp::AudioCoding gRateLadder[] = {Urtp::PCM_SIGNED_16_BIT,
+                                                Urtp::UNICAM_COMPRESSED_8_BIT,
+                                                Urtp::UNICAM_RICE_8_BIT,
+                                                Urtp::LPC_RESIDUAL_6_BIT,
+                                                Urtp::UNICAM_COMPRESSED_4_BIT};
+
+// True if rate control is on.
+static bool gUseRateControl = false;
+
+// Rate control state: where we are on gRateLadder, how many
+// seconds the link has been good for, how long until we may
+// step down again and the last value of
+// gNumAudioDatagramsSendTookTooLong that we saw.
+static int gRateStep = 0;
+static int gRateGoodSeconds = 0;
+static int gRateHoldSeconds = 0;
+static unsigned long gRateLastSendTookTooLong = 0;
+
+// Set when the datagram store overflows, cleared
+// by rate control.
+static volatile bool gRateOverflow = false;
+
+// The last round trip delay measured.
+static volatile int gRoundTripDelayMs = 0;
+
+// The capture profiles, indexed by AudioPcmProfile.
+static const PcmProfile gPcmProfiles[] = {{SAMPLES_PER_BLOCK, SAMPLES_PER_BLOCK * 4, 1, "default"},
+                                          {SAMPLES_PER_BLOCK * AUDIO_PCM_MAX_BLOCKS_PER_READ,
+                                           SAMPLES_PER_BLOCK * AUDIO_PCM_MAX_BLOCKS_PER_READ * 4,
+                                           AUDIO_PCM_MAX_BLOCKS_PER_READ, "low-power"}};
+
+// The capture profile in use.
+static const PcmProfile *gpPcmProfile = &gPcmProfiles[AUDIO_PCM_PROFILE_DEFAULT];
+
+// The capture layout in use.
+static const PcmLayout *gpPcmLayout = &gPcmLayouts[sizeof(gPcmLayouts) / sizeof(gPcmLayouts[0]) - 1];
 
 // ALSA handle for the PCM input device.
 static snd_pcm_t *gpPcmHandle = NULL;
@@ -95,19 +256,30 @@ static snd_pcm_t *gpPcmHandle = NULL;
 // ALSA parameters for the PCM input device.
 static snd_pcm_hw_params_t *gpPcmHwParams = NULL;
 
-// ALSA frame size.
+// The number of frames read, and encoded, in one go: a whole
+// number of URTP blocks.
 static snd_pcm_uframes_t gPcmFrames = SAMPLES_PER_BLOCK;
 
-// Audio buffer, enough for one block of stereo audio,
-// where each sample takes up 64 bits (32 bits for L channel
-// and 32 bits for R channel).
-static uint32_t gRawAudio[SAMPLES_PER_BLOCK * 2];
+// Audio buffer, enough for the most blocks of stereo audio
+// that we read in one go, where each sample takes up 64 bits
+// (32 bits for L channel and 32 bits for R channel); the
+// more compact layouts use less of it.
+static uint32_t gRawAudio[SAMPLES_PER_BLOCK * 2 * AUDIO_PCM_MAX_BLOCKS_PER_READ];
 
-// Datagram storage for URTP.
-static char gDatagramStorage[URTP_DATAGRAM_STORE_SIZE];
+// When there is more than one stream, each channel of a
+// block of audio, taken out of gRawAudio (or the PCM device's
+// buffer) ready for encoding; big enough for 32-bit samples.
+static uint32_t gChannelAudio[AUDIO_MAX_NUM_STREAMS][SAMPLES_PER_BLOCK];
+
+// Datagram storage for URTP, for each stream; this is
+// sized for the audio codings and options in use, by
+// Urtp::getDatagramStoreSize(), and only allocated for
+// the streams in use.
+static char *gpDatagramStorage[AUDIO_MAX_NUM_STREAMS] = {NULL};
 
 // The address of the audio server.
-static struct sockaddr_in *gpAudioServerAddress = NULL;
+static struct sockaddr_storage gAudioServerAddress;
+static socklen_t gAudioServerAddressLength = 0;
 
 // Task to read and encode audio data.
 static std::thread *gpEncodeTask = NULL;
@@ -118,6 +290,15 @@ static std::thread *gpSendTask = NULL;
 // Task to check on the audio streaming server status.
 static std::thread *gpServerStatusTask = NULL;
 
+// Task which does all of the above when the reactor is in use.
+static std::thread *gpReactorTask = NULL;
+
+// What the reactor waits on, its timer for the once a second
+// tick and the event that tells it to stop.
+static int gReactorEpollFd = -1;
+static int gReactorTimerFd = -1;
+static int gReactorStopFd = -1;
+
 // Semaphore to communicate data transfer between tasks.
 static sem_t gUrtpDatagramReady;
 
@@ -130,18 +311,44 @@ static sem_t gStopSendTask;
 // Semaphore to stop the server status task.
 static sem_t gStopServerStatusTask;
 
-// The URTP codec.
-static Urtp *gpUrtp = NULL;
+// The URTP codec for each stream; stream x carries
+// channel x of the PCM device with stream ID x.
+static Urtp *gpUrtp[AUDIO_MAX_NUM_STREAMS] = {NULL};
+
+// The number of streams in use.
+static int gNumStreams = 1;
+
+// The stream that is being sent: the send moves on to the
+// next stream only once it has no partly sent datagram.
+static int gSendStream = 0;
 
 // The audio send socket.
 static int gStreamingSocket = -1;
 
-// Flag to indicate that the TCP connection is up.
+// Flag to indicate that the TCP connection is up (or, with
+// UDP, that the socket is bound to the server's address).
 static volatile bool gTcpConnected = false;
 
 // Flag to indicate that the audio comms channel is up.
 static volatile bool gAudioCommsConnected = false;
 
+// How far into the first URTP datagram waiting to be sent
+// on gSendStream the last send got.
+static int gPartialDatagramBytesSent = 0;
+
+// When the current run of send failures began.
+static struct timeval gBadStart;
+static bool gBadStarted = false;
+
+// Buffer for timing datagrams as they arrive.
+static unsigned char gTimingBuffer[AUDIO_TIMING_RECEIVE_BUFFER_SIZE];
+static int gTimingBufferLength = 0;
+
+// Count of usable timing datagrams received in this check
+// interval and of check intervals without one.
+static int gNumUsableTimingDatagrams = 0;
+static int gNoValidTimingDatagramCount = 0;
+
 // Pointer to watchdog handler.
 static void(*gpWatchdogHandler)(void) = NULL;
 
@@ -151,9 +358,12 @@ static void(*gpNowStreamingHandler)(void) = NULL;
 // Keep track of stats.
 static unsigned long gNumAudioSendFailures = 0;
 static unsigned long gNumAudioBytesSent = 0;
+static unsigned long gNumFecBytesSent = 0;
+static unsigned int gNumFecSkippedLast = 0;
 static unsigned long gAverageAudioDatagramSendDuration = 0;
 static unsigned long gNumAudioDatagrams = 0;
 static unsigned long gNumAudioDatagramsSendTookTooLong = 0;
+static unsigned long gNumAudioDatagramsStale = 0;
 static unsigned long gWorstCaseAudioDatagramSendDuration = 0;
 
 // For testing.
@@ -177,13 +387,80 @@ static void datagramReadyCb(const char *pDatagram)
 // Callback for when the audio datagram list starts to overflow.
 static void datagramOverflowStartCb()
 {
-    // TODO
+    // Rate control should have caught this, step down now
+    gRateOverflow = true;
 }
 
 // Callback for when the audio datagram list stops overflowing.
 static void datagramOverflowStopCb(int numOverflows)
 {
-    // TODO
+    // Nothing to do, rate control will step back up
+    // once the link has recovered
+}
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS: RATE CONTROL
+ * -------------------------------------------------------------- */
+
+// Set the audio coding to a step on gRateLadder.
+static void setRateStep(int step)
+{
+    if (step < gRateStep) {
+        LOG(EVENT_AUDIO_CODING_STEP_UP, gRateLadder[step]);
+    } else {
+        LOG(EVENT_AUDIO_CODING_STEP_DOWN, gRateLadder[step]);
+    }
+    printf("Audio coding now %s.\n", Urtp::getAudioCodingName(gRateLadder[step]));
+    gRateStep = step;
+    for (int x = 0; x < gNumStreams; x++) {
+        gpUrtp[x]->setAudioCoding(gRateLadder[step]);
+    }
+}
+
+// Called once a second: step the audio coding down when the
+// link to the server is struggling, so that overwriting
+// the oldest datagram is a last resort, and back up once
+// it has been good for a while.  All streams share the link
+// so they are stepped together, on the longest queue.
+static void rateControl()
+{
+    int numDatagramsQueued = 0;
+    int roundTripDelayMs = gRoundTripDelayMs;
+    bool overflow = gRateOverflow;
+    bool slowSends = (gNumAudioDatagramsSendTookTooLong != gRateLastSendTookTooLong);
+
+    for (int x = 0; x < gNumStreams; x++) {
+        if (gpUrtp[x]->getUrtpDatagramsAvailable() > numDatagramsQueued) {
+            numDatagramsQueued = gpUrtp[x]->getUrtpDatagramsAvailable();
+        }
+    }
+    gRateOverflow = false;
+    gRateLastSendTookTooLong = gNumAudioDatagramsSendTookTooLong;
+    if (gRateHoldSeconds > 0) {
+        gRateHoldSeconds--;
+    }
+
+    if (overflow ||
+        (numDatagramsQueued > AUDIO_RATE_QUEUE_HIGH_DATAGRAMS) ||
+        (roundTripDelayMs > AUDIO_RATE_ROUNDTRIP_HIGH_MS)) {
+        gRateGoodSeconds = 0;
+        if ((overflow || (gRateHoldSeconds == 0)) &&
+            (gRateStep < (int) (sizeof(gRateLadder) / sizeof(gRateLadder[0])) - 1)) {
+            setRateStep(gRateStep + 1);
+            gRateHoldSeconds = AUDIO_RATE_HOLD_S;
+        }
+    } else if (!slowSends &&
+               (numDatagramsQueued < AUDIO_RATE_QUEUE_LOW_DATAGRAMS) &&
+               (roundTripDelayMs < AUDIO_RATE_ROUNDTRIP_LOW_MS)) {
+        gRateGoodSeconds++;
+        if ((gRateGoodSeconds >= AUDIO_RATE_STEP_UP_GOOD_S) && (gRateStep > 0)) {
+            setRateStep(gRateStep - 1);
+            gRateGoodSeconds = 0;
+            gRateHoldSeconds = AUDIO_RATE_HOLD_S;
+        }
+    } else {
+        gRateGoodSeconds = 0;
+    }
 }
 
 /* ----------------------------------------------------------------
@@ -193,14 +470,47 @@ static void datagramOverflowStopCb(int numOverflows)
 // Monitor on a 1 second tick.
 static void audioMonitor(size_t timerId, void *pUserData)
 {
-    // Monitor throughput
+    unsigned int numFecSkipped = 0;
+
+    // Monitor throughput and how much parity for forward error
+    // correction has been sent on top of the rest
     if (gNumAudioBytesSent > 0) {
         LOG(EVENT_THROUGHPUT_BITS_S, gNumAudioBytesSent << 3);
+        if (gNumFecBytesSent > 0) {
+            LOG(EVENT_FEC_THROUGHPUT_BITS_S, gNumFecBytesSent << 3);
+            if (gNumAudioBytesSent > gNumFecBytesSent) {
+                LOG(EVENT_FEC_OVERHEAD_PERCENT, gNumFecBytesSent * 100 / (gNumAudioBytesSent - gNumFecBytesSent));
+            }
+        }
         gNumAudioBytesSent = 0;
-        if (gpUrtp != NULL) {
-            LOG(EVENT_NUM_DATAGRAMS_QUEUED, gpUrtp->getUrtpDatagramsAvailable());
+        gNumFecBytesSent = 0;
+        for (int x = 0; x < gNumStreams; x++) {
+            if (gpUrtp[x] != NULL) {
+                LOG(EVENT_NUM_DATAGRAMS_QUEUED, gpUrtp[x]->getUrtpDatagramsAvailable());
+            }
+        }
+    }
+
+    // Monitor parity that there was no room for
+    for (int x = 0; x < gNumStreams; x++) {
+        if (gpUrtp[x] != NULL) {
+            numFecSkipped += gpUrtp[x]->getNumFecSkipped();
         }
     }
+    if (numFecSkipped != gNumFecSkippedLast) {
+        LOG(EVENT_FEC_PARITY_SKIPPED, numFecSkipped - gNumFecSkippedLast);
+        gNumFecSkippedLast = numFecSkipped;
+    }
+
+    // Monitor audio dropped for being too late
+    if (gNumAudioDatagramsStale > 0) {
+        LOG(EVENT_DATAGRAMS_STALE_DROPPED, gNumAudioDatagramsStale);
+        gNumAudioDatagramsStale = 0;
+    }
+
+    if (gUseRateControl && (gpUrtp[0] != NULL)) {
+        rateControl();
+    }
 }
 
 // Start the audio streaming connection.
@@ -208,8 +518,7 @@ static void audioMonitor(size_t timerId, void *pUserData)
 // Note: here be multiple return statements.
 static bool startAudioStreamingConnection()
 {
-    char *pBuf = new char[AUDIO_MAX_LEN_SERVER_URL];
-    struct hostent *pHostEntries = NULL;
+    char addressString[RESOLVER_ADDRESS_STRING_LENGTH];
     int port;
     int setOption;
     struct timeval tv = {0};
@@ -219,39 +528,26 @@ static bool startAudioStreamingConnection()
 
     LOG(EVENT_AUDIO_STREAMING_CONNECTION_START, 0);
     printf("Resolving IP address of the audio streaming server...\n");
-    if (gpAudioServerAddress == NULL) {
-        gpAudioServerAddress = new struct sockaddr_in;
-        memset(gpAudioServerAddress, 0, sizeof(*gpAudioServerAddress));
-        getAddressFromUrl(gpAudioServerUrl, pBuf, AUDIO_MAX_LEN_SERVER_URL);
-        printf("[Looking for audio server URL \"%s\"...]\n", pBuf);
-        LOG(EVENT_DNS_LOOKUP, 0);
-        pHostEntries = gethostbyname(pBuf);
-        if (pHostEntries != NULL) {
-            // Copy the network address to sockaddr_in structure
-            memcpy(&(gpAudioServerAddress->sin_addr), pHostEntries->h_addr_list[0], pHostEntries->h_length) ;
-            gpAudioServerAddress->sin_family = AF_INET;
-            printf("[Found it at IP address %s]\n", inet_ntoa(gpAudioServerAddress->sin_addr));
-            if (getPortFromUrl(gpAudioServerUrl, &port)) {
-                gpAudioServerAddress->sin_port = htons(port);
-                printf("[Audio server port is %d]\n", port);
-            } else {
-                printf("[WARNING: no port number was specified in the audio server URL (\"%s\")]\n",
-                       gpAudioServerUrl);
-            }
-        } else {
-            LOG(EVENT_DNS_LOOKUP_FAILURE, h_errno);
-            LOG(EVENT_AUDIO_STREAMING_CONNECTION_START_FAILURE, 1);
-            printf("Error, couldn't resolve IP address of audio streaming server.\n");
-            return false;
-        }
+    // Once the address is known this doesn't wait, even if the
+    // address is being looked up again in the background
+    if (!resolveUrl(gpAudioServerUrl, &gAudioServerAddress, &gAudioServerAddressLength, AUDIO_DNS_LOOKUP_WAIT_MS)) {
+        LOG(EVENT_AUDIO_STREAMING_CONNECTION_START_FAILURE, 1);
+        printf("Error, couldn't resolve IP address of audio streaming server (yet).\n");
+        return false;
+    }
+    printf("[Audio server is at IP address %s]\n",
+           getAddressString(&gAudioServerAddress, gAudioServerAddressLength, addressString));
+    if (!getPortFromUrl(gpAudioServerUrl, &port)) {
+        printf("[WARNING: no port number was specified in the audio server URL (\"%s\")]\n",
+               gpAudioServerUrl);
     }
 
-    printf("Opening TCP socket to server for audio comms...\n");
-    LOG(EVENT_SOCKET_OPENING, 0);
-    gStreamingSocket = socket(AF_INET, SOCK_STREAM, 0);
+    printf("Opening %s socket to server for audio comms...\n", gUseUdp ? "UDP" : "TCP");
+    LOG(EVENT_SOCKET_OPENING, gUseUdp);
+    gStreamingSocket = socket(gAudioServerAddress.ss_family, gUseUdp ? SOCK_DGRAM : SOCK_STREAM, 0);
     if (gStreamingSocket < 0) {
         LOG(EVENT_SOCKET_OPENING_FAILURE, errno);
-        printf("Could not open TCP socket to audio streaming server (%s).\n", strerror(errno));
+        printf("Could not open socket to audio streaming server (%s).\n", strerror(errno));
         return false;
     }
     LOG(EVENT_SOCKET_OPENED, gStreamingSocket);
@@ -270,14 +566,16 @@ static bool startAudioStreamingConnection()
         printf("Could not set timeout in TCP socket options (%s).\n", strerror(errno));
         return false;
     }
-    printf("Setting TCP_NODELAY in TCP socket options...\n");
-    // Set TCP_NODELAY (1) in level IPPROTO_TCP (6) to 1
-    setOption = 1;
-    x = setsockopt(gStreamingSocket, IPPROTO_TCP, TCP_NODELAY, (void *) &setOption, sizeof(setOption));
-    if (x < 0) {
-        LOG(EVENT_SOCKET_CONFIGURATION_FAILURE, errno);
-        printf("Could not set TCP_NODELAY in socket options (%s).\n", strerror(errno));
-        return false;
+    if (!gUseUdp) {
+        printf("Setting TCP_NODELAY in TCP socket options...\n");
+        // Set TCP_NODELAY (1) in level IPPROTO_TCP (6) to 1
+        setOption = 1;
+        x = setsockopt(gStreamingSocket, IPPROTO_TCP, TCP_NODELAY, (void *) &setOption, sizeof(setOption));
+        if (x < 0) {
+            LOG(EVENT_SOCKET_CONFIGURATION_FAILURE, errno);
+            printf("Could not set TCP_NODELAY in socket options (%s).\n", strerror(errno));
+            return false;
+        }
     }
     printf("Setting SO_SNDBUF in TCP socket options...\n");
     // Set SO_SNDBUF (0x1001) in level SOL_SOCKET (0xffff) to AUDIO_TCP_BUFFER_SIZE
@@ -291,14 +589,22 @@ static bool startAudioStreamingConnection()
     LOG(EVENT_SOCKET_CONFIGURED, 0);
     
     LOG(EVENT_SOCKET_CONNECTING, 0);
-    printf("Connecting TCP...\n");
-    x = connect(gStreamingSocket, (struct sockaddr *) gpAudioServerAddress, sizeof(struct sockaddr));
+    // For UDP this just sets where datagrams go to and
+    // which datagrams are received
+    printf("Connecting %s...\n", gUseUdp ? "UDP" : "TCP");
+    x = connect(gStreamingSocket, (struct sockaddr *) &gAudioServerAddress, gAudioServerAddressLength);
     if ((x < 0) && (errno != EINPROGRESS)) {  // Socket will return EINPROGRESS if it is non-blocking
         LOG(EVENT_SOCKET_CONNECT_FAILURE, errno);
-        printf("Could not connect TCP socket (%s).\n", strerror(errno));
+        printf("Could not connect socket (%s).\n", strerror(errno));
         return false;
     }
     gTcpConnected = true;
+    gPartialDatagramBytesSent = 0;
+    gSendStream = 0;
+    gBadStarted = false;
+    gTimingBufferLength = 0;
+    gNumUsableTimingDatagrams = 0;
+    gNoValidTimingDatagramCount = 0;
     LOG(EVENT_SOCKET_CONNECTED, 0);
 
     return true;
@@ -317,80 +623,459 @@ static void stopAudioStreamingConnection()
     gAudioCommsConnected = false;
 }
 
-// Read and encode audio from the PCM device.
-static void encodeAudioData()
+// Encode a block of audio.
+static void encodeAudio(const void *pRawAudio)
+{
+    const char *pBlock = (const char *) pRawAudio;
+    int sampleSize = gpPcmLayout->frameSize / gpPcmLayout->channels;
+    Urtp::RawAudioFormat channelFormat = Urtp::RAW_AUDIO_MONO_S24_3LE;
+
+    if (sampleSize == 4) {
+        channelFormat = Urtp::RAW_AUDIO_MONO_S32_LE;
+    }
+
+    // There may be several URTP blocks in one read
+    for (unsigned int x = 0; x < gPcmFrames / SAMPLES_PER_BLOCK; x++) {
+        if (gNumStreams == 1) {
+            if (gpUrtp[0] != NULL) {
+                gpUrtp[0]->codeAudioBlock(pBlock, gpPcmLayout->rawAudioFormat);
+            }
+        } else {
+            // De-interleave the block, once, and give each
+            // channel to the encoder for its stream
+            for (int y = 0; y < gNumStreams; y++) {
+                for (unsigned int z = 0; z < SAMPLES_PER_BLOCK; z++) {
+                    memcpy((char *) gChannelAudio[y] + (z * sampleSize),
+                           pBlock + (z * gpPcmLayout->frameSize) + (y * sampleSize), sampleSize);
+                }
+                if (gpUrtp[y] != NULL) {
+                    gpUrtp[y]->codeAudioBlock(gChannelAudio[y], channelFormat);
+                }
+            }
+        }
+        pBlock += SAMPLES_PER_BLOCK * gpPcmLayout->frameSize;
+    }
+#ifdef AUDIO_TEST_OUTPUT_FILENAME
+    if (gpAudioOutputFile != NULL) {
+        fwrite(pRawAudio, gPcmFrames * gpPcmLayout->frameSize, 1, gpAudioOutputFile);
+    }
+#endif
+}
+
+// Deal with an error from the PCM device.
+static void handlePcmError(int error)
+{
+    if (error == -EPIPE) {
+        LOG(EVENT_PCM_OVERRUN, error);
+        snd_pcm_prepare(gpPcmHandle);
+        // Neither a non-blocking read nor mmap access will
+        // restart capture, do it here
+        snd_pcm_start(gpPcmHandle);
+    } else if (error == -EAGAIN) {
+        // Non-blocking and there's nothing there yet
+    } else if (error < 0) {
+        LOG(EVENT_PCM_ERROR, error);
+    }
+}
+
+// Encode one period of audio straight out of the PCM device's
+// mmap()ed buffer.  Only if the period wraps around the end of
+// the buffer is it copied, to put it back together.
+// Returns true if a block of audio was encoded.
+static bool mmapAndEncodeAudio()
 {
+    bool encoded = false;
+    const snd_pcm_channel_area_t *pAreas;
+    snd_pcm_uframes_t offset;
+    snd_pcm_uframes_t frames;
+    snd_pcm_uframes_t framesCopied = 0;
+    snd_pcm_sframes_t retValue;
+    const char *pRawAudio;
+
+    retValue = snd_pcm_avail_update(gpPcmHandle);
+    if ((retValue >= 0) && (retValue < (snd_pcm_sframes_t) gPcmFrames) && !gUseReactor) {
+        // Nothing will block for us, so wait here
+        retValue = snd_pcm_wait(gpPcmHandle, AUDIO_PCM_WAIT_MS);
+        if (retValue >= 0) {
+            retValue = snd_pcm_avail_update(gpPcmHandle);
+        }
+    }
+
+    if (retValue < 0) {
+        handlePcmError(retValue);
+    } else if (retValue >= (snd_pcm_sframes_t) gPcmFrames) {
+        while ((framesCopied < gPcmFrames) && (retValue >= 0)) {
+            frames = gPcmFrames - framesCopied;
+            retValue = snd_pcm_mmap_begin(gpPcmHandle, &pAreas, &offset, &frames);
+            if ((retValue >= 0) && (frames == 0)) {
+                retValue = -EAGAIN;
+            }
+            if (retValue >= 0) {
+                pRawAudio = (const char *) pAreas[0].addr +
+                            ((pAreas[0].first + (offset * pAreas[0].step)) / 8);
+                if ((framesCopied == 0) && (frames == gPcmFrames)) {
+                    // The usual case: encode it where it is
+                    encodeAudio(pRawAudio);
+                    encoded = true;
+                } else {
+                    memcpy((char *) gRawAudio + (framesCopied * gpPcmLayout->frameSize), pRawAudio,
+                           frames * gpPcmLayout->frameSize);
+                }
+                framesCopied += frames;
+                retValue = snd_pcm_mmap_commit(gpPcmHandle, offset, frames);
+                if ((retValue >= 0) && (retValue != (snd_pcm_sframes_t) frames)) {
+                    retValue = -EPIPE;
+                }
+            }
+        }
+        if (retValue < 0) {
+            handlePcmError(retValue);
+        } else if (!encoded) {
+            encodeAudio(gRawAudio);
+            encoded = true;
+        }
+    }
+
+    return encoded;
+}
+
+// Read one period of audio from the PCM device and encode it.
+// Returns true if a block of audio was encoded.
+static bool readAndEncodeAudio()
+{
+    bool encoded = false;
     int retValue;
 
-    while (sem_trywait(&gStopEncodeTask) != 0) {
+    if (gUseMmap) {
+        encoded = mmapAndEncodeAudio();
+    } else {
         // Get a buffer full of audio data
         retValue = snd_pcm_readi(gpPcmHandle, gRawAudio, gPcmFrames);
-        if (retValue == -EPIPE) {
-            LOG(EVENT_PCM_OVERRUN, retValue);
-            snd_pcm_prepare(gpPcmHandle);
-        } else if (retValue < 0) {
-            LOG(EVENT_PCM_ERROR, retValue);
+        if (retValue < 0) {
+            handlePcmError(retValue);
         } else if (retValue != (int) gPcmFrames) {
             LOG(EVENT_PCM_UNDERRUN, retValue);
         } else {
-            // Encode the data
-        if (gpUrtp != NULL) {
-            gpUrtp->codeAudioBlock(gRawAudio);
-        }
-#ifdef AUDIO_TEST_OUTPUT_FILENAME
-            if (gpAudioOutputFile != NULL) {
-                fwrite(gRawAudio, sizeof(gRawAudio), 1, gpAudioOutputFile);
-            }
-#endif
+            encodeAudio(gRawAudio);
+            encoded = true;
         }
     }
+
+    return encoded;
+}
+
+// The body of the encode task: read and encode audio from
+// the PCM device.
+static void encodeAudioData()
+{
+    while (sem_trywait(&gStopEncodeTask) != 0) {
+        readAndEncodeAudio();
+    }
 }
 
-// Send a buffer of data over a TCP socket
-static int tcpSend(const char *pData, int size)
+// Move an array of buffers on by a number of bytes, updating
+// the first buffer and the number of buffers as required.
+static void advanceIovec(struct iovec **ppIov, int *pNumIov, int size)
 {
-    int x = 0;
+    while ((*pNumIov > 0) && (size >= (int) (*ppIov)->iov_len)) {
+        size -= (*ppIov)->iov_len;
+        (*ppIov)++;
+        (*pNumIov)--;
+    }
+    if ((*pNumIov > 0) && (size > 0)) {
+        (*ppIov)->iov_base = (char *) (*ppIov)->iov_base + size;
+        (*ppIov)->iov_len -= size;
+    }
+}
+
+// Send an array of buffers over a TCP socket in as few
+// calls as possible, waiting in poll() for room in the socket
+// rather than spinning, for up to timeoutMs.
+// Returns the number of bytes sent; pError is set to 0 if all
+// were sent, ETIMEDOUT if time ran out, EAGAIN if the socket
+// was full and timeoutMs was 0, else the errno of the failure.
+static int tcpSend(const struct iovec *pIov, int numIov, int timeoutMs, int *pError)
+{
+    int x;
     int count = 0;
-    struct timeval start;
+    int size = 0;
+    int error = 0;
+    socklen_t errorLength;
+    struct iovec iov[AUDIO_MAX_DATAGRAMS_PER_SEND];
+    struct iovec *pIovNext = iov;
+    struct msghdr msg;
+    struct pollfd pollFd;
+    struct timespec now;
+    long long int deadlineMs;
+
+    if (numIov > (int) (sizeof(iov) / sizeof(iov[0]))) {
+        numIov = sizeof(iov) / sizeof(iov[0]);
+    }
+
+    // Take a copy that can be moved on as the data goes
+    for (int y = 0; y < numIov; y++) {
+        iov[y] = *(pIov + y);
+        size += iov[y].iov_len;
+    }
+    memset(&msg, 0, sizeof(msg));
+    pollFd.fd = gStreamingSocket;
+    pollFd.events = POLLOUT;
 
     if (gTcpConnected) {
-        gettimeofday(&start, NULL); 
-        while ((count < size) && (((unsigned long) timeDifference(&start, NULL) / 1000) < AUDIO_TCP_SEND_TIMEOUT_MS)) {
-            x = send(gStreamingSocket, pData + count, size - count, MSG_NOSIGNAL); //  MSG_NOSIGNAL prevents send from throwing exceptions like EPIPE
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        deadlineMs = (long long int) now.tv_sec * 1000 + now.tv_nsec / 1000000 + timeoutMs;
+        while ((count < size) && (error == 0)) {
+            msg.msg_iov = pIovNext;
+            msg.msg_iovlen = numIov;
+            x = sendmsg(gStreamingSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT); //  MSG_NOSIGNAL prevents send from throwing exceptions like EPIPE
             if (x > 0) {
                 count += x;
+                advanceIovec(&pIovNext, &numIov, x);
+            } else if ((x < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+                // The socket is full: sleep until there is room or we run out of time
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                x = (int) (deadlineMs - ((long long int) now.tv_sec * 1000 + now.tv_nsec / 1000000));
+                if (timeoutMs == 0) {
+                    // Caller will wait for room itself
+                    error = EAGAIN;
+                } else if (x > 0) {
+                    x = poll(&pollFd, 1, x);
+                    if ((x < 0) && (errno != EINTR)) {
+                        error = errno;
+                    } else if ((x > 0) && (pollFd.revents & (POLLERR | POLLHUP))) {
+                        // Find out what went wrong with the socket
+                        errorLength = sizeof(error);
+                        if ((getsockopt(gStreamingSocket, SOL_SOCKET, SO_ERROR, &error, &errorLength) < 0) ||
+                            (error == 0)) {
+                            error = EPIPE;
+                        }
+                    }
+                } else {
+                    error = ETIMEDOUT;
+                    LOG(EVENT_TCP_SEND_TIMEOUT, size - count);
+                }
+            } else if ((x < 0) && (errno != EINTR)) {
+                error = errno;
             }
         }
+    } else {
+        error = ENOTCONN;
+    }
 
-        if (count < size) {
-            LOG(EVENT_TCP_SEND_TIMEOUT, size - count);
-        }
+    *pError = error;
+
+    return count;
+}
+
+// Send an array of URTP datagrams over a UDP socket, one
+// datagram per packet, in a single call.  There is no waiting
+// for room: UDP doesn't hold up what comes after on a loss, so
+// anything the socket can't take now stays queued for the next
+// go and, if the queue overflows, the server will see the gap
+// in the sequence numbers.
+// Returns the number of bytes sent; pError is set to 0 if all
+// were sent, EAGAIN if the socket was full, else the errno of
+// the failure.
+static int udpSend(const struct iovec *pIov, int numIov, int *pError)
+{
+    int x;
+    int count = 0;
+    int error = 0;
+    struct mmsghdr msgs[AUDIO_MAX_DATAGRAMS_PER_SEND];
+
+    if (numIov > (int) (sizeof(msgs) / sizeof(msgs[0]))) {
+        numIov = sizeof(msgs) / sizeof(msgs[0]);
+    }
+
+    memset(msgs, 0, sizeof(msgs));
+    for (int y = 0; y < numIov; y++) {
+        msgs[y].msg_hdr.msg_iov = (struct iovec *) (pIov + y);
+        msgs[y].msg_hdr.msg_iovlen = 1;
+    }
 
+    if (gTcpConnected) {
+        x = sendmmsg(gStreamingSocket, msgs, numIov, MSG_NOSIGNAL | MSG_DONTWAIT);
         if (x < 0) {
-            count = errno;
+            x = 0;
+            if (errno == EWOULDBLOCK) {
+                error = EAGAIN;
+            } else {
+                error = errno;
+            }
+        } else if (x < numIov) {
+            error = EAGAIN;
         }
+        for (int y = 0; y < x; y++) {
+            count += msgs[y].msg_len;
+        }
+    } else {
+        error = ENOTCONN;
     }
 
+    *pError = error;
+
     return count;
 }
 
-// The send function that forms the body of the send task.
-// This task runs whenever there is an audio datagram ready
-// to send.
-static void sendAudioData()
+// Send all of the URTP datagrams that are ready on one
+// stream, allowing timeoutMs for each batch to go (0 to not
+// wait at all).  Returns 0 if everything that was ready has
+// gone, EAGAIN if the socket filled up and timeoutMs was 0,
+// else the errno of the failure.
+static int sendStreamUrtpDatagrams(Urtp *pUrtp, int timeoutMs)
 {
-    const char *pUrtpDatagram = NULL;
+    struct iovec urtpDatagrams[AUDIO_MAX_DATAGRAMS_PER_SEND];
+    int numDatagrams;
+    int numDatagramsSent;
+    int error = 0;
     struct timeval start;
     struct timeval end;
-    struct timeval badStart;
-    bool badStarted = false;
-    struct timespec runAnywayTime;
     unsigned long durationMs;
     int retValue;
-    bool okToDelete = false;
+    int partialDatagramBytesSent;
+    const char *pDatagram;
+
+    // Skip, in one go, whatever has waited so long that the
+    // listener would rather not hear it, so that the delay
+    // stays bounded after the link recovers; not while part
+    // of a datagram has been sent though, as the rest of it
+    // must follow to keep a TCP stream in sync
+    if ((gMaxLatencyMs > 0) && (pUrtp != NULL) && (gPartialDatagramBytesSent == 0)) {
+        gNumAudioDatagramsStale += pUrtp->dropStaleUrtpDatagrams(getUSeconds() - ((long long int) gMaxLatencyMs * 1000));
+    }
+
+    // Send everything that is ready in one go so that a backlog
+    // (e.g. after the radio link has stalled) goes in one call;
+    // if there's an error, give up until next time rather than
+    // hammering the socket
+    while (gTcpConnected && (pUrtp != NULL) && (error == 0) &&
+           ((numDatagrams = pUrtp->getUrtpDatagrams(urtpDatagrams, AUDIO_MAX_DATAGRAMS_PER_SEND,
+                                                      AUDIO_TCP_BUFFER_SIZE)) > 0)) {
+        // If the first datagram was only partly sent last
+        // time, carry on from where we left off so as not
+        // to break up the stream
+        partialDatagramBytesSent = gPartialDatagramBytesSent;
+        urtpDatagrams[0].iov_base = (char *) urtpDatagrams[0].iov_base + partialDatagramBytesSent;
+        urtpDatagrams[0].iov_len -= partialDatagramBytesSent;
+        gettimeofday(&start, NULL);
+        // Send the datagrams
+        //LOG(EVENT_SEND_START, numDatagrams);
+        if (gUseUdp) {
+            retValue = udpSend(urtpDatagrams, numDatagrams, &error);
+        } else {
+            retValue = tcpSend(urtpDatagrams, numDatagrams, timeoutMs, &error);
+        }
+        gNumAudioBytesSent += retValue;
+
+        // Work out how many datagrams went completely,
+        // counting the bytes of parity among them
+        numDatagramsSent = 0;
+        for (int x = 0; (x < numDatagrams) && (retValue >= (int) urtpDatagrams[x].iov_len); x++) {
+            retValue -= urtpDatagrams[x].iov_len;
+            numDatagramsSent++;
+            pDatagram = (const char *) urtpDatagrams[x].iov_base;
+            if (x == 0) {
+                pDatagram -= partialDatagramBytesSent;
+            }
+            if ((*(pDatagram + 1) & 0x0F) == Urtp::PARITY) {
+                gNumFecBytesSent += Urtp::getDatagramSize(pDatagram);
+            }
+        }
+        // ...and how far we got into the next one
+        if (numDatagramsSent > 0) {
+            gPartialDatagramBytesSent = retValue;
+        } else {
+            gPartialDatagramBytesSent += retValue;
+        }
+
+        if (error == EAGAIN) {
+            // Just full, not a failure: the caller will
+            // come back when there is room
+        } else if (error != 0) {
+            if (!gBadStarted) {
+                gBadStarted = true;
+                gettimeofday(&gBadStart, NULL);
+            }
+            LOG(EVENT_SEND_FAILURE, error);
+            gNumAudioSendFailures++;
+        } else {
+            gBadStarted = false;
+            //  If we really are streaming then call the callback having sent something
+            if (gAudioCommsConnected && (gpNowStreamingHandler != NULL)) {
+                gpNowStreamingHandler();
+            }
+        }
+        //LOG(EVENT_SEND_STOP, numDatagramsSent);
+
+        if (gBadStarted) {
+            // If the connection has gone, set a flag that will be picked up outside this function and
+            // cause us to shut down cleanly
+            gettimeofday(&end, NULL);
+            durationMs = (unsigned long) timeDifference(&gBadStart, &end) / 1000;
+            if (durationMs > AUDIO_MAX_DURATION_SOCKET_ERRORS_MS) {
+                LOG(EVENT_SOCKET_ERRORS_FOR_TOO_LONG, durationMs);
+            }
+            if ((error == ENOTCONN) ||
+                (error == ECONNRESET) ||
+                (error == ENOBUFS) ||
+                (error == EPIPE)) {
+                LOG(EVENT_SOCKET_BAD, error);
+            }
+        }
+        gettimeofday(&end, NULL);
+        durationMs = (unsigned long) timeDifference(&start, &end) / 1000;
+        gAverageAudioDatagramSendDuration += durationMs;
+        gNumAudioDatagrams += numDatagramsSent;
+
+        // A backlog is allowed a block's worth of time per datagram
+        if (durationMs > (unsigned long) (BLOCK_DURATION_MS * numDatagrams)) {
+            gNumAudioDatagramsSendTookTooLong++;
+        } else {
+            //LOG(EVENT_SEND_DURATION, duration);
+        }
+        if (durationMs > gWorstCaseAudioDatagramSendDuration) {
+            gWorstCaseAudioDatagramSendDuration = durationMs;
+            LOG(EVENT_NEW_PEAK_SEND_DURATION, durationMs);
+        }
+
+        pUrtp->setUrtpDatagramsAsRead(numDatagramsSent);
+
+        // Make sure the watchdog is fed
+        if (gpWatchdogHandler != NULL) {
+            gpWatchdogHandler();
+        }
+    }
+
+    return error;
+}
+
+// Send all of the URTP datagrams that are ready on all
+// streams, as sendStreamUrtpDatagrams() does for one.  The
+// streams share the one socket, so a partly sent datagram
+// must be finished before anything from another stream can go.
+static int sendUrtpDatagrams(int timeoutMs)
+{
+    int error = 0;
+
+    for (int x = 0; (x < gNumStreams) && (error == 0); x++) {
+        error = sendStreamUrtpDatagrams(gpUrtp[gSendStream], timeoutMs);
+        if ((error == 0) && (gPartialDatagramBytesSent == 0)) {
+            gSendStream++;
+            if (gSendStream >= gNumStreams) {
+                gSendStream = 0;
+            }
+        }
+    }
+
+    return error;
+}
 
-    runAnywayTime.tv_sec = AUDIO_SEND_DATA_RUN_ANYWAY_TIME_S;
-    runAnywayTime.tv_nsec = 0;
+// The send function that forms the body of the send task.
+// This task runs whenever there is an audio datagram ready
+// to send.
+static void sendAudioData()
+{
+    struct timespec runAnywayTime;
 
     while (sem_trywait(&gStopSendTask) != 0) {
         // Always try to send if the socket is connected so that
@@ -399,71 +1084,11 @@ static void sendAudioData()
         // task will set gAudioCommsConnected to true or false
         if (gTcpConnected) {
             // Wait for at least one datagram to be ready to send
+            // (sem_timedwait() takes an absolute time)
+            clock_gettime(CLOCK_REALTIME, &runAnywayTime);
+            runAnywayTime.tv_sec += AUDIO_SEND_DATA_RUN_ANYWAY_TIME_S;
             sem_timedwait(&gUrtpDatagramReady, &runAnywayTime);
-            while (gTcpConnected && (gpUrtp != NULL) && (pUrtpDatagram = gpUrtp->getUrtpDatagram()) != NULL) {
-                okToDelete = false;
-                gettimeofday(&start, NULL);
-                // Send the datagram
-                //LOG(EVENT_SEND_START, (int) pUrtpDatagram);
-                retValue = tcpSend(pUrtpDatagram, URTP_DATAGRAM_SIZE);
-
-                if (retValue != URTP_DATAGRAM_SIZE) {
-                    if (!badStarted) {
-                        badStarted = true;
-                        gettimeofday(&badStart, NULL);
-                    }
-                    LOG(EVENT_SEND_FAILURE, retValue);
-                    gNumAudioSendFailures++;
-                } else {
-                    badStarted = false;
-                    gNumAudioBytesSent += retValue;
-                    okToDelete = true;
-                    //  If we really are streaming then call the callback having sent something
-                    if (gAudioCommsConnected && (gpNowStreamingHandler != NULL)) {
-                        gpNowStreamingHandler();
-                    }
-                }
-                //LOG(EVENT_SEND_STOP, (int) pUrtpDatagram);
-
-                if (badStarted) {
-                    // If the connection has gone, set a flag that will be picked up outside this function and
-                    // cause us to shut down cleanly
-                    gettimeofday(&end, NULL);
-                    durationMs = (unsigned long) timeDifference(&badStart, &end) / 1000;
-                    if (durationMs > AUDIO_MAX_DURATION_SOCKET_ERRORS_MS) {
-                        LOG(EVENT_SOCKET_ERRORS_FOR_TOO_LONG, durationMs);
-                    }
-                    if ((retValue == ENOTCONN) ||
-                        (retValue == ECONNRESET) ||
-                        (retValue == ENOBUFS) ||
-                        (retValue == EPIPE)) {
-                        LOG(EVENT_SOCKET_BAD, retValue);
-                    }
-                }
-                gettimeofday(&end, NULL);
-                durationMs = (unsigned long) timeDifference(&start, &end) / 1000;
-                gAverageAudioDatagramSendDuration += durationMs;
-                gNumAudioDatagrams++;
-
-                if (durationMs > BLOCK_DURATION_MS) {
-                    gNumAudioDatagramsSendTookTooLong++;
-                } else {
-                    //LOG(EVENT_SEND_DURATION, duration);
-                }
-                if (durationMs > gWorstCaseAudioDatagramSendDuration) {
-                    gWorstCaseAudioDatagramSendDuration = durationMs;
-                    LOG(EVENT_NEW_PEAK_SEND_DURATION, durationMs);
-                }
-
-                if (okToDelete) {
-                    gpUrtp->setUrtpDatagramAsRead(pUrtpDatagram);
-                }
-
-                // Make sure the watchdog is fed
-                if (gpWatchdogHandler != NULL) {
-                    gpWatchdogHandler();
-                }
-            } // while() wait on URTP datagram
+            sendUrtpDatagrams(AUDIO_TCP_SEND_TIMEOUT_MS);
         } else { // if() audio comms is connected
             // Make sure the watchdog is fed
             if (gpWatchdogHandler != NULL) {
@@ -474,101 +1099,398 @@ static void sendAudioData()
     } // while() wait on gStopSendTask semaphore
 }
 
+// Handle a timing datagram that has arrived from the
+// audio streaming server at time receiveTime, returning
+// true if it was usable.
+static bool handleTimingDatagram(const unsigned char *pTimingDatagram,
+                                 long long int receiveTime)
+{
+    bool usable = false;
+    long long unsigned int datagramSendTime = 0;
+    // All streams are coded from the same blocks of audio and so
+    // have the same sequence numbers; stream 0 will do
+    uint16_t lastUrtpSequenceNumber = (uint16_t) gpUrtp[0]->getUrtpSequenceNumber();
+    uint16_t sequenceNumber;
+
+    // Is the sequence number in the right range?
+    sequenceNumber = (((uint16_t) *(pTimingDatagram + 1)) << 8) + *(pTimingDatagram + 2);
+    LOG(EVENT_TIMING_DATAGRAM_RECEIVED, sequenceNumber);
+    if (sequenceNumber > lastUrtpSequenceNumber - (AUDIO_TIMING_DATAGRAM_AGE_S * 1000 / BLOCK_DURATION_MS)) {
+        // Yup, it's a usable timing datagram
+        usable = true;
+        if (!gAudioCommsConnected) {
+            LOG(EVENT_AUDIO_SERVER_CONNECTED, lastUrtpSequenceNumber);
+            printf("Now connected to audio streaming server.\n");
+            gAudioCommsConnected = true;
+        }
+        // Get the send time of the audio datagram
+        for (int x = 3; x < AUDIO_TIMING_DATAGRAM_LENGTH; x++) {
+            datagramSendTime = (datagramSendTime << 8) + *(pTimingDatagram + x);
+        }
+        LOG(EVENT_ROUNDTRIP_DELAY_MICROSECONDS, (int)((long long unsigned int) receiveTime - datagramSendTime));
+        gRoundTripDelayMs = (int) (((long long unsigned int) receiveTime - datagramSendTime) / 1000);
+    } else {
+        // If we're receiving very old timings then it is better to close the link
+        // and re-establish to flush out any delay
+        LOG(EVENT_TIMING_DATAGRAM_TIMEOUT, lastUrtpSequenceNumber);
+        gAudioCommsConnected = false;
+    }
+
+    return usable;
+}
+
+// Pull out and handle all of the complete timing datagrams
+// in a buffer, discarding anything that isn't in sync and
+// shuffling any partial timing datagram down to the start.
+// Returns the number of usable timing datagrams found.
+static int parseTimingDatagrams(unsigned char *pBuffer, int *pLength,
+                                long long int receiveTime)
+{
+    int numUsable = 0;
+    int x = 0;
+
+    while (x < *pLength) {
+        if (*(pBuffer + x) != SYNC_BYTE) {
+            // Out of sync, hunt for the next sync byte
+            x++;
+        } else if (*pLength - x >= AUDIO_TIMING_DATAGRAM_LENGTH) {
+            if (handleTimingDatagram(pBuffer + x, receiveTime)) {
+                numUsable++;
+            }
+            x += AUDIO_TIMING_DATAGRAM_LENGTH;
+        } else {
+            // Partial timing datagram, wait for the rest
+            break;
+        }
+    }
+
+    *pLength -= x;
+    memmove(pBuffer, pBuffer + x, *pLength);
+
+    return numUsable;
+}
+
+// Take everything that has arrived on the streaming socket
+// and handle the timing datagrams in it.  Returns false if
+// the far end has closed the connection, in which case the
+// socket will stay readable so don't wait on it.
+static bool receiveTimingDatagrams()
+{
+    bool open = true;
+    long long int timestamp = getUSeconds();
+    int x;
+
+    do {
+        //LOG(EVENT_RECEIVE_START, 0);
+        x = recv(gStreamingSocket, gTimingBuffer + gTimingBufferLength,
+                 sizeof(gTimingBuffer) - gTimingBufferLength, 0);
+        if (x > 0) {
+            //LOG(EVENT_RECEIVE_STOP, x);
+            gTimingBufferLength += x;
+            gNumUsableTimingDatagrams += parseTimingDatagrams(gTimingBuffer, &gTimingBufferLength, timestamp);
+            if (gUseUdp) {
+                // Each timing datagram arrives whole, so
+                // anything left over is junk
+                gTimingBufferLength = 0;
+            }
+        } else if ((x < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+            LOG(EVENT_RECEIVE_FAILURE, errno);
+        } else if ((x == 0) && !gUseUdp) {
+            // Orderly shutdown from the far end (for UDP
+            // this is just an empty datagram)
+            LOG(EVENT_RECEIVE_FAILURE, 0);
+            open = false;
+        }
+    } while ((x > 0) || ((x == 0) && gUseUdp));
+
+    return open;
+}
+
+// Check that the audio streaming server is still there,
+// called once every AUDIO_TIMING_CHECK_INTERVAL_MS.
+static void checkTimingDatagramsArrived()
+{
+    if (gNumUsableTimingDatagrams > 0) {
+        gNoValidTimingDatagramCount = 0;
+    } else {
+        gNoValidTimingDatagramCount++;
+        LOG(EVENT_NO_TIMING_DATAGRAM_RECEIVED, gNoValidTimingDatagramCount);
+        if (gNoValidTimingDatagramCount > AUDIO_TIMING_DATAGRAM_WAIT_S) {
+            LOG(EVENT_TIMING_DATAGRAM_TIMEOUT, gpUrtp[0]->getUrtpSequenceNumber());
+            gAudioCommsConnected = false;
+            gNoValidTimingDatagramCount = 0;
+        }
+    }
+    gNumUsableTimingDatagrams = 0;
+}
+
 // Check the status of the audio streaming server
 // This task should be run in the background.  It will
 // check that we get a timing datagram within the expected
-// interval
+// interval, sleeping in epoll_wait() until something arrives
+// on the streaming socket.
 static void checkServerStatus()
 {
-    char timingDatagram[AUDIO_TIMING_DATAGRAM_LENGTH];
-    char *pBuffer;
+    int epollFd;
+    int socketInEpoll = -1;
+    struct epoll_event event;
     long long int timestamp;
-    long long unsigned int datagramSendTime;
-    uint16_t lastUrtpSequenceNumber;
-    uint16_t sequenceNumber;
+    long long int checkTime = getUSeconds();
     int x;
-    int noValidTimingDatagramCount = 0;
-    struct timeval start;
+
+    epollFd = epoll_create1(0);
+    if (epollFd < 0) {
+        LOG(EVENT_RECEIVE_FAILURE, errno);
+    }
 
     while (sem_trywait(&gStopServerStatusTask) != 0) {
-        if (gTcpConnected && (gpUrtp != NULL)) {
-            lastUrtpSequenceNumber = (uint16_t) gpUrtp->getUrtpSequenceNumber();
-            // Wait for up to 1 second for a timing datagram (of the right length) on the non-blocking socket
-            gettimeofday(&start, NULL);
-            for (pBuffer = timingDatagram; (pBuffer < timingDatagram + sizeof(timingDatagram)) && (timeDifference(&start, NULL) < 1000000);) {
-                //LOG(EVENT_RECEIVE_START, 0);
-                x = recv(gStreamingSocket, pBuffer, 1, 0);
-                if (x > 0) {
-                    //LOG(EVENT_RECEIVE_STOP, x); 
-                    if (*pBuffer == SYNC_BYTE) {
-                        for (pBuffer += 1; (pBuffer < timingDatagram + sizeof(timingDatagram)) && (timeDifference(&start, NULL) < 1000000);) {
-                            //LOG(EVENT_RECEIVE_START, 0);
-                            x = recv(gStreamingSocket, pBuffer, timingDatagram + sizeof(timingDatagram) - pBuffer, 0);
-                            if (x > 0) {
-                                pBuffer += x;
-                                //LOG(EVENT_RECEIVE_STOP, x);
-                            } else {
-                                if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
-                                    LOG(EVENT_RECEIVE_FAILURE, errno);
-                                } else {
-                                    //LOG(EVENT_RECEIVE_STOP, 0);
-                                }
-                            }
-                            if (pBuffer < timingDatagram + sizeof(timingDatagram)) {
-                                usleep(100000); // Sleep only if we've not got the lot
-                            }
+        if (gTcpConnected && (gpUrtp[0] != NULL) && (epollFd >= 0)) {
+            if (socketInEpoll != gStreamingSocket) {
+                // Wake up on anything arriving on the streaming socket
+                if (socketInEpoll >= 0) {
+                    epoll_ctl(epollFd, EPOLL_CTL_DEL, socketInEpoll, NULL);
+                }
+                memset(&event, 0, sizeof(event));
+                event.events = EPOLLIN;
+                event.data.fd = gStreamingSocket;
+                socketInEpoll = -1;
+                if (epoll_ctl(epollFd, EPOLL_CTL_ADD, gStreamingSocket, &event) == 0) {
+                    socketInEpoll = gStreamingSocket;
+                }
+            }
+
+            // Wait for up to the check interval for something to arrive
+            x = epoll_wait(epollFd, &event, 1, AUDIO_TIMING_CHECK_INTERVAL_MS);
+            if (x > 0) {
+                if (!receiveTimingDatagrams()) {
+                    // Don't spin on a closed socket
+                    usleep(AUDIO_TIMING_CHECK_INTERVAL_MS * 1000);
+                }
+            } else if ((x < 0) && (errno != EINTR)) {
+                LOG(EVENT_RECEIVE_FAILURE, errno);
+                usleep(AUDIO_TIMING_CHECK_INTERVAL_MS * 1000);
+            }
+
+            // Once per check interval, see if the server is still there
+            timestamp = getUSeconds();
+            if (timestamp - checkTime >= AUDIO_TIMING_CHECK_INTERVAL_MS * 1000) {
+                checkTime = timestamp;
+                checkTimingDatagramsArrived();
+            }
+        } else {
+            usleep(100000);
+        }
+    }
+
+    if (epollFd >= 0) {
+        close(epollFd);
+    }
+}
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS: REACTOR
+ * -------------------------------------------------------------- */
+
+// Add a file descriptor to the reactor's epoll set, or change
+// the events it is waiting for if it is already there.
+static bool reactorWatch(int fd, uint32_t events, uint32_t tag, int operation)
+{
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.u32 = tag;
+
+    return (epoll_ctl(gReactorEpollFd, operation, fd, &event) == 0);
+}
+
+// The reactor: a single task which does the work of the
+// encode, send and server status tasks.  It sleeps in
+// epoll_wait() on the PCM device's poll descriptors, the
+// streaming socket, a once-a-second timer and a stop event.
+// When a period of audio is ready it is encoded and sent
+// there and then; if the socket fills up the rest is sent
+// when it says there's room.
+static void audioReactor()
+{
+    struct pollfd pcmPollFds[AUDIO_REACTOR_MAX_PCM_POLL_FDS];
+    int numPcmPollFds;
+    struct epoll_event events[AUDIO_REACTOR_MAX_PCM_POLL_FDS + AUDIO_REACTOR_TAG_PCM];
+    int numEvents;
+    uint32_t socketEvents = EPOLLIN;
+    bool socketInEpoll;
+    bool pcmReady;
+    bool stop = false;
+    unsigned short revents;
+    snd_pcm_sframes_t framesAvailable;
+    uint64_t count;
+    int error;
+    socklen_t errorLength;
+    unsigned long bytesSent;
+
+    numPcmPollFds = snd_pcm_poll_descriptors(gpPcmHandle, pcmPollFds, AUDIO_REACTOR_MAX_PCM_POLL_FDS);
+    for (int x = 0; x < numPcmPollFds; x++) {
+        reactorWatch(pcmPollFds[x].fd, pcmPollFds[x].events, AUDIO_REACTOR_TAG_PCM + x, EPOLL_CTL_ADD);
+    }
+    socketInEpoll = reactorWatch(gStreamingSocket, socketEvents, AUDIO_REACTOR_TAG_SOCKET, EPOLL_CTL_ADD);
+
+    while (!stop) {
+        numEvents = epoll_wait(gReactorEpollFd, events, sizeof(events) / sizeof(events[0]), -1);
+        if ((numEvents < 0) && (errno != EINTR)) {
+            LOG(EVENT_RECEIVE_FAILURE, errno);
+            usleep(100000);
+        }
+
+        pcmReady = false;
+        for (int x = 0; x < numEvents; x++) {
+            switch (events[x].data.u32) {
+                case AUDIO_REACTOR_TAG_STOP:
+                    stop = true;
+                break;
+                case AUDIO_REACTOR_TAG_TIMER:
+                    // Once a second: monitor, check that the server is
+                    // still there and feed the watchdog
+                    if (read(gReactorTimerFd, &count, sizeof(count)) == sizeof(count)) {
+                        audioMonitor(0, NULL);
+                        if (gTcpConnected && (gpUrtp[0] != NULL)) {
+                            checkTimingDatagramsArrived();
+                        }
+                        if (gpWatchdogHandler != NULL) {
+                            gpWatchdogHandler();
                         }
                     }
-                } else {
-                    if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
-                        LOG(EVENT_RECEIVE_FAILURE, errno);
+                break;
+                case AUDIO_REACTOR_TAG_SOCKET:
+                    if (events[x].events & (EPOLLERR | EPOLLHUP)) {
+                        // Reading the error clears it, which is all
+                        // that an ICMP error on a UDP socket (e.g.
+                        // while the server restarts) needs; a hang-up
+                        // can't be cleared or masked, so stop listening
+                        // or it will be reported for ever, and listen
+                        // again once a send gets through
+                        errorLength = sizeof(error);
+                        if (getsockopt(gStreamingSocket, SOL_SOCKET, SO_ERROR, &error, &errorLength) < 0) {
+                            error = errno;
+                        }
+                        LOG(EVENT_SOCKET_BAD, error);
+                        if (events[x].events & EPOLLHUP) {
+                            epoll_ctl(gReactorEpollFd, EPOLL_CTL_DEL, gStreamingSocket, NULL);
+                            socketInEpoll = false;
+                        }
                     } else {
-                        //LOG(EVENT_RECEIVE_STOP, 0);
+                        if ((events[x].events & EPOLLIN) && (gpUrtp[0] != NULL) &&
+                            !receiveTimingDatagrams()) {
+                            // The far end has closed, don't spin on it
+                            socketEvents &= ~EPOLLIN;
+                            reactorWatch(gStreamingSocket, socketEvents, AUDIO_REACTOR_TAG_SOCKET, EPOLL_CTL_MOD);
+                        }
+                        if (events[x].events & EPOLLOUT) {
+                            // There's room again: the send below will
+                            // carry on with the backlog
+                            pcmReady = true;
+                        }
                     }
-                }
-                if (pBuffer < timingDatagram + sizeof(timingDatagram)) {
-                    usleep(100000); // Sleep only if we've not got the lot
-                }
+                break;
+                default:
+                    if (events[x].data.u32 - AUDIO_REACTOR_TAG_PCM < (uint32_t) numPcmPollFds) {
+                        pcmPollFds[events[x].data.u32 - AUDIO_REACTOR_TAG_PCM].revents = events[x].events;
+                        pcmReady = true;
+                    }
+                break;
             }
+        }
 
-            if (pBuffer == timingDatagram + sizeof(timingDatagram)) {
-                timestamp = getUSeconds();
-                // Is the sequence number in the right range?
-                sequenceNumber = (((int) timingDatagram[1]) << 8) + timingDatagram[2];
-                LOG(EVENT_TIMING_DATAGRAM_RECEIVED, sequenceNumber);
-                if (sequenceNumber > lastUrtpSequenceNumber - (AUDIO_TIMING_DATAGRAM_AGE_S * 1000 / BLOCK_DURATION_MS)) {
-                    // Yup, it's a usable timing datagram
-                    noValidTimingDatagramCount = 0;
-                    if (!gAudioCommsConnected) {
-                        LOG(EVENT_AUDIO_SERVER_CONNECTED, lastUrtpSequenceNumber);
-                        printf("Now connected to audio streaming server.\n");
-                        gAudioCommsConnected = true;
-                    }
-                    // Get the send time of the audio datagram
-                    datagramSendTime = ((((long long unsigned int) timingDatagram[3]) << 54) + (((long long unsigned int) timingDatagram[4]) << 48) +
-                                        (((long long unsigned int) timingDatagram[5]) << 40) + (((long long unsigned int) timingDatagram[6]) << 32) + 
-                                        (((long long unsigned int) timingDatagram[7]) << 24) + (((long long unsigned int) timingDatagram[8]) << 16) +
-                                        (((long long unsigned int) timingDatagram[9]) << 8)  + (((long long unsigned int) timingDatagram[10])));
-                    LOG(EVENT_ROUNDTRIP_DELAY_MICROSECONDS, (int)((long long unsigned int) timestamp - datagramSendTime));
-                } else {
-                    // If we're receiving very old timings then it is better to close the link
-                    // and re-establish to flush out any delay
-                    LOG(EVENT_TIMING_DATAGRAM_TIMEOUT, lastUrtpSequenceNumber);
-                    gAudioCommsConnected = false;
-                    noValidTimingDatagramCount = 0;
-                }
-            } else {
-                noValidTimingDatagramCount++;
-                LOG(EVENT_NO_TIMING_DATAGRAM_RECEIVED, noValidTimingDatagramCount);
-                if (noValidTimingDatagramCount > AUDIO_TIMING_DATAGRAM_WAIT_S) {
-                    LOG(EVENT_TIMING_DATAGRAM_TIMEOUT, lastUrtpSequenceNumber);
-                    gAudioCommsConnected = false;
-                    noValidTimingDatagramCount = 0;
+        if (pcmReady && !stop) {
+            // Let ALSA interpret its poll descriptors and then
+            // encode every whole period there is
+            revents = 0;
+            snd_pcm_poll_descriptors_revents(gpPcmHandle, pcmPollFds, numPcmPollFds, &revents);
+            if (revents & (POLLIN | POLLERR)) {
+                do {
+                    framesAvailable = snd_pcm_avail_update(gpPcmHandle);
+                } while (((framesAvailable < 0) || (framesAvailable >= (snd_pcm_sframes_t) gPcmFrames)) &&
+                         readAndEncodeAudio());
+            }
+            for (int x = 0; x < numPcmPollFds; x++) {
+                pcmPollFds[x].revents = 0;
+            }
+
+            // Send what we have without waiting; if the socket is
+            // full, wake up when there's room
+            bytesSent = gNumAudioBytesSent;
+            error = sendUrtpDatagrams(0);
+            if (!socketInEpoll && (error == 0) && (gNumAudioBytesSent != bytesSent)) {
+                socketEvents &= ~EPOLLOUT;
+                socketInEpoll = reactorWatch(gStreamingSocket, socketEvents, AUDIO_REACTOR_TAG_SOCKET, EPOLL_CTL_ADD);
+            } else if (socketInEpoll) {
+                if ((error == EAGAIN) && !(socketEvents & EPOLLOUT)) {
+                    socketEvents |= EPOLLOUT;
+                    reactorWatch(gStreamingSocket, socketEvents, AUDIO_REACTOR_TAG_SOCKET, EPOLL_CTL_MOD);
+                } else if ((error != EAGAIN) && (socketEvents & EPOLLOUT)) {
+                    socketEvents &= ~EPOLLOUT;
+                    reactorWatch(gStreamingSocket, socketEvents, AUDIO_REACTOR_TAG_SOCKET, EPOLL_CTL_MOD);
                 }
             }
+        }
+    }
+}
 
-            usleep(100000);
+// Create the things that the reactor waits on.
+// Note: here be multiple return statements.
+static bool startReactor()
+{
+    struct itimerspec tick;
+
+    gReactorEpollFd = epoll_create1(0);
+    if (gReactorEpollFd < 0) {
+        printf("Unable to create epoll instance (%s).\n", strerror(errno));
+        return false;
+    }
+    gReactorStopFd = eventfd(0, EFD_NONBLOCK);
+    if ((gReactorStopFd < 0) ||
+        !reactorWatch(gReactorStopFd, EPOLLIN, AUDIO_REACTOR_TAG_STOP, EPOLL_CTL_ADD)) {
+        printf("Unable to create stop event (%s).\n", strerror(errno));
+        return false;
+    }
+    gReactorTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    memset(&tick, 0, sizeof(tick));
+    tick.it_interval.tv_sec = AUDIO_TIMING_CHECK_INTERVAL_MS / 1000;
+    tick.it_value.tv_sec = AUDIO_TIMING_CHECK_INTERVAL_MS / 1000;
+    if ((gReactorTimerFd < 0) ||
+        (timerfd_settime(gReactorTimerFd, 0, &tick, NULL) != 0) ||
+        !reactorWatch(gReactorTimerFd, EPOLLIN, AUDIO_REACTOR_TAG_TIMER, EPOLL_CTL_ADD)) {
+        printf("Unable to create timer (%s).\n", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+// Tell the reactor to stop, wait for it to do so and then
+// tidy up.
+static void stopReactor()
+{
+    uint64_t count = 1;
+
+    if (gpReactorTask != NULL) {
+        if (write(gReactorStopFd, &count, sizeof(count)) != sizeof(count)) {
+            printf("Unable to signal reactor to stop (%s).\n", strerror(errno));
         }
+        gpReactorTask->join();
+        delete gpReactorTask;
+        gpReactorTask = NULL;
+    }
+    if (gReactorTimerFd >= 0) {
+        close(gReactorTimerFd);
+        gReactorTimerFd = -1;
+    }
+    if (gReactorStopFd >= 0) {
+        close(gReactorStopFd);
+        gReactorStopFd = -1;
+    }
+    if (gReactorEpollFd >= 0) {
+        close(gReactorEpollFd);
+        gReactorEpollFd = -1;
     }
 }
 
@@ -584,12 +1506,17 @@ static bool startPcm()
     int size;
     unsigned int val;
     int dir;
-    snd_pcm_uframes_t pcmFrames;    
+    snd_pcm_uframes_t periodFrames;
+    snd_pcm_uframes_t bufferFrames;
+    snd_pcm_sw_params_t *pPcmSwParams;
+    unsigned int numLayouts = sizeof(gPcmLayouts) / sizeof(gPcmLayouts[0]);
 
     LOG(EVENT_PCM_START, 0);
 
-    // Open PCM device for recording (capture)
-    rc = snd_pcm_open(&gpPcmHandle, gpAlsaPcmDeviceName, SND_PCM_STREAM_CAPTURE, 0);
+    // Open PCM device for recording (capture); the reactor
+    // must never block on it
+    rc = snd_pcm_open(&gpPcmHandle, gpAlsaPcmDeviceName, SND_PCM_STREAM_CAPTURE,
+                      gUseReactor ? SND_PCM_NONBLOCK : 0);
     if (rc < 0) {
         LOG(EVENT_PCM_START_FAILURE, 1);
         printf("Unable to open pcm device: %s.\n", snd_strerror(rc));
@@ -599,21 +1526,50 @@ static bool startPcm()
     // Allocate a hardware parameters object
     snd_pcm_hw_params_alloca(&gpPcmHwParams);
 
-    // Fill it in with default values
-    snd_pcm_hw_params_any(gpPcmHandle, gpPcmHwParams);
+    // Try each capture layout in turn, starting afresh
+    // each time, ending with the stereo 32-bit layout which
+    // is all we use if gUseMono is not set; there must be
+    // a channel for each stream
+    for (unsigned int x = gUseMono ? 0 : numLayouts - 1; x < numLayouts; x++) {
+        gpPcmLayout = &gPcmLayouts[x];
+        if (gpPcmLayout->channels >= (unsigned int) gNumStreams) {
+            // Fill it in with default values
+            snd_pcm_hw_params_any(gpPcmHandle, gpPcmHwParams);
+
+            // Set the desired hardware parameters...
+            // Interleaved mode
+            if (gUseMmap) {
+                rc = snd_pcm_hw_params_set_access(gpPcmHandle, gpPcmHwParams, SND_PCM_ACCESS_MMAP_INTERLEAVED);
+                if (rc < 0) {
+                    LOG(EVENT_PCM_START_FAILURE, 3);
+                    printf("Unable to set mmap access: %s.\n", snd_strerror(rc));
+                    return false;
+                }
+            } else {
+                snd_pcm_hw_params_set_access(gpPcmHandle, gpPcmHwParams, SND_PCM_ACCESS_RW_INTERLEAVED);
+            }
+            // Format and number of channels, stopping at the first
+            // that the device will take
+            if ((snd_pcm_hw_params_set_format(gpPcmHandle, gpPcmHwParams, gpPcmLayout->pcmFormat) == 0) &&
+                (snd_pcm_hw_params_set_channels(gpPcmHandle, gpPcmHwParams, gpPcmLayout->channels) == 0)) {
+                break;
+            }
+        }
+    }
+    if (gUseMono) {
+        printf("Capturing audio as %s.\n", gpPcmLayout->pName);
+    }
 
-    // Set the desired hardware parameters...
-    // Interleaved mode
-    snd_pcm_hw_params_set_access(gpPcmHandle, gpPcmHwParams, SND_PCM_ACCESS_RW_INTERLEAVED);
-    // Signed 32-bit little-endian format
-    snd_pcm_hw_params_set_format(gpPcmHandle, gpPcmHwParams, SND_PCM_FORMAT_S32_LE);
-    // Stereo
-    snd_pcm_hw_params_set_channels(gpPcmHandle, gpPcmHwParams, 2);
     // Sampling rate
     val = SAMPLING_FREQUENCY;
     snd_pcm_hw_params_set_rate_near(gpPcmHandle, gpPcmHwParams, &val, &dir);
-    // Set period size in frames
-    snd_pcm_hw_params_set_period_size_near(gpPcmHandle, gpPcmHwParams, &gPcmFrames, &dir);
+    // Set period and buffer size in frames, as the capture
+    // profile asks, rather than leaving the depth of the
+    // buffer to the driver
+    periodFrames = gpPcmProfile->periodFrames;
+    snd_pcm_hw_params_set_period_size_near(gpPcmHandle, gpPcmHwParams, &periodFrames, &dir);
+    bufferFrames = gpPcmProfile->bufferFrames;
+    snd_pcm_hw_params_set_buffer_size_near(gpPcmHandle, gpPcmHwParams, &bufferFrames);
 
     // Write the parameters to the driver
     rc = snd_pcm_hw_params(gpPcmHandle, gpPcmHwParams);
@@ -622,10 +1578,59 @@ static bool startPcm()
         printf("Unable to set HW parameters: %s.\n", snd_strerror(rc));
         return false;
     }
+
+    // The URTP block timing and the pre-emphasis filter are fixed
+    // at build time for SAMPLING_FREQUENCY, so anything else the
+    // driver may have settled on is no good
+    snd_pcm_hw_params_get_rate(gpPcmHwParams, &val, &dir);
+    if (val != SAMPLING_FREQUENCY) {
+        LOG(EVENT_PCM_START_FAILURE, 5);
+        printf("PCM device runs at %u Hz, not %d Hz: rebuild with SAMPLING_FREQUENCY=%u or use a device that can do %d Hz.\n",
+               val, SAMPLING_FREQUENCY, val, SAMPLING_FREQUENCY);
+        return false;
+    }
     
-    // Check that the buffer size we've ended up with is correct
-    snd_pcm_hw_params_get_period_size(gpPcmHwParams, &pcmFrames, &dir);
-    assert(pcmFrames == gPcmFrames);
+    // The driver may have adjusted the sizes: we read in whole
+    // URTP blocks whatever the period, but there must be room
+    // in the buffer for a read
+    snd_pcm_hw_params_get_period_size(gpPcmHwParams, &periodFrames, &dir);
+    snd_pcm_hw_params_get_buffer_size(gpPcmHwParams, &bufferFrames);
+    gPcmFrames = SAMPLES_PER_BLOCK * gpPcmProfile->blocksPerRead;
+    LOG(EVENT_PCM_PROFILE, gpPcmProfile - gPcmProfiles);
+    LOG(EVENT_PCM_PERIOD_FRAMES, periodFrames);
+    LOG(EVENT_PCM_BUFFER_FRAMES, bufferFrames);
+    printf("Audio capture profile is %s: period %lu frames, buffer %lu frames, reading %lu frames at a time.\n",
+           gpPcmProfile->pName, periodFrames, bufferFrames, gPcmFrames);
+    if (bufferFrames < gPcmFrames) {
+        LOG(EVENT_PCM_START_FAILURE, 4);
+        printf("PCM buffer too small (%lu frames, need at least %lu).\n", bufferFrames, gPcmFrames);
+        return false;
+    }
+
+    // Only count the device as readable once there is a whole
+    // read's worth of audio in it: otherwise, with periods
+    // smaller than a read, snd_pcm_wait() and the PCM poll()
+    // events would fire on every period and we'd spin until
+    // the rest of the read arrived
+    snd_pcm_sw_params_alloca(&pPcmSwParams);
+    rc = snd_pcm_sw_params_current(gpPcmHandle, pPcmSwParams);
+    if (rc >= 0) {
+        rc = snd_pcm_sw_params_set_avail_min(gpPcmHandle, pPcmSwParams, gPcmFrames);
+    }
+    if (rc >= 0) {
+        rc = snd_pcm_sw_params(gpPcmHandle, pPcmSwParams);
+    }
+    if (rc < 0) {
+        LOG(EVENT_PCM_START_FAILURE, 6);
+        printf("Unable to set SW parameters: %s.\n", snd_strerror(rc));
+        return false;
+    }
+
+    // Reading in blocking mode starts capture; otherwise
+    // it has to be kicked off here
+    if (gUseReactor || gUseMmap) {
+        snd_pcm_start(gpPcmHandle);
+    }
     
 #ifdef AUDIO_TEST_OUTPUT_FILENAME
     gpAudioOutputFile = fopen(AUDIO_TEST_OUTPUT_FILENAME, "wb+");
@@ -664,9 +1669,33 @@ static void stopPcm()
 bool startAudioStreaming(const char *pAlsaPcmDeviceName,
                          const char *pAudioServerUrl,
                          int maxShift,
+                         const AudioStreamingOptions *pOptions,
                          void(*pWatchdogHandler)(void),
                          void(*pNowStreamingHandler)(void))
 {
+    Urtp::AudioCoding audioCoding;
+    unsigned int audioCodings;
+    bool redundancy;
+    bool fec;
+    int datagramStoreSize;
+
+    gUseReactor = (pOptions != NULL) && pOptions->reactor;
+    gUseMmap = (pOptions != NULL) && pOptions->mmap;
+    gUseUdp = (pOptions != NULL) && pOptions->udp;
+    gMaxLatencyMs = 0;
+    if (pOptions != NULL) {
+        gMaxLatencyMs = pOptions->maxLatencyMs;
+    }
+    gNumAudioDatagramsStale = 0;
+    gUseMono = (pOptions != NULL) && pOptions->mono;
+    gNumStreams = 1;
+    if ((pOptions != NULL) && pOptions->stereo) {
+        gNumStreams = AUDIO_MAX_NUM_STREAMS;
+    }
+    gpPcmProfile = &gPcmProfiles[AUDIO_PCM_PROFILE_DEFAULT];
+    if ((pOptions != NULL) && (pOptions->pcmProfile < MAX_NUM_AUDIO_PCM_PROFILES)) {
+        gpPcmProfile = &gPcmProfiles[pOptions->pcmProfile];
+    }
     gpAlsaPcmDeviceName = pAlsaPcmDeviceName;
     gpAudioServerUrl = pAudioServerUrl;
     gpWatchdogHandler = pWatchdogHandler;
@@ -696,15 +1725,17 @@ bool startAudioStreaming(const char *pAlsaPcmDeviceName,
 
     // Start the per-second monitor tick and reset the diagnostics
     LOG(EVENT_AUDIO_STREAMING_START, 0);
-    gSecondTicker = startTimer(1000000L, TIMER_PERIODIC, audioMonitor, NULL);
+    if (!gUseReactor) {
+        gSecondTicker = startTimer(1000000L, TIMER_PERIODIC, audioMonitor, NULL);
+    }
 
     if (!startAudioStreamingConnection()) {
         LOG(EVENT_AUDIO_STREAMING_START_FAILURE, 4);
         return false;
     }
 
-    printf("Starting task to check that the audio streaming server is there...\n");
-    if (gpServerStatusTask == NULL) {
+    if (!gUseReactor && (gpServerStatusTask == NULL)) {
+        printf("Starting task to check that the audio streaming server is there...\n");
         gpServerStatusTask = new std::thread(checkServerStatus);
         if (gpServerStatusTask == NULL) {
             LOG(EVENT_AUDIO_STREAMING_START_FAILURE, 5);
@@ -714,12 +1745,86 @@ bool startAudioStreaming(const char *pAlsaPcmDeviceName,
     }
 
     printf("Setting up URTP...\n");
-    gpUrtp = new Urtp(&datagramReadyCb, &datagramOverflowStartCb, &datagramOverflowStopCb);
-    if (!gpUrtp->init((void *) &gDatagramStorage, maxShift)) {
-        LOG(EVENT_AUDIO_STREAMING_START_FAILURE, 6);
-        printf("Unable to start URTP.\n");
-        return false;
+    for (int x = 0; x < gNumStreams; x++) {
+        gpUrtp[x] = new Urtp(&datagramReadyCb, &datagramOverflowStartCb, &datagramOverflowStopCb);
+    }
+    audioCoding = gpUrtp[0]->getAudioCoding();
+    if ((pOptions != NULL) && (pOptions->pAudioCoding != NULL)) {
+        audioCoding = Urtp::MAX_NUM_AUDIO_CODINGS;
+        for (int x = 0; x < Urtp::MAX_NUM_AUDIO_CODINGS; x++) {
+            if ((Urtp::getAudioCodingName((Urtp::AudioCoding) x) != NULL) &&
+                (strcmp(pOptions->pAudioCoding, Urtp::getAudioCodingName((Urtp::AudioCoding) x)) == 0)) {
+                audioCoding = (Urtp::AudioCoding) x;
+            }
+        }
+        if (audioCoding == Urtp::MAX_NUM_AUDIO_CODINGS) {
+            LOG(EVENT_AUDIO_STREAMING_START_FAILURE, 12);
+            printf("Unknown URTP audio coding \"%s\".\n", pOptions->pAudioCoding);
+            return false;
+        }
+    }
+    printf("URTP audio coding is %s.\n", Urtp::getAudioCodingName(audioCoding));
+    audioCodings = URTP_AUDIO_CODING_BIT(audioCoding);
+
+    // Rate control starts from wherever the audio coding
+    // is on the ladder; if it isn't on the ladder there's
+    // nothing to step between
+    gUseRateControl = false;
+    if ((pOptions != NULL) && pOptions->rateControl) {
+        for (unsigned int x = 0; x < sizeof(gRateLadder) / sizeof(gRateLadder[0]); x++) {
+            if (gRateLadder[x] == audioCoding) {
+                gRateStep = x;
+                gUseRateControl = true;
+            }
+        }
+        if (gUseRateControl) {
+            for (unsigned int x = 0; x < sizeof(gRateLadder) / sizeof(gRateLadder[0]); x++) {
+                audioCodings |= URTP_AUDIO_CODING_BIT(gRateLadder[x]);
+            }
+        } else {
+            printf("Rate control is not available with this audio coding.\n");
+        }
+    }
+
+    // The datagram store only has room for what this
+    // session may send
+    redundancy = (pOptions != NULL) && pOptions->redundancy;
+    fec = (pOptions != NULL) && (pOptions->fecGroupSize != 0);
+    datagramStoreSize = Urtp::getDatagramStoreSize(audioCodings, redundancy, fec);
+    for (int x = 0; x < gNumStreams; x++) {
+        gpDatagramStorage[x] = new char[datagramStoreSize];
+        if (!gpUrtp[x]->init((void *) gpDatagramStorage[x], maxShift, audioCodings, redundancy, fec) ||
+            !gpUrtp[x]->setStreamId(x) ||
+            !gpUrtp[x]->setAudioCoding(audioCoding)) {
+            LOG(EVENT_AUDIO_STREAMING_START_FAILURE, 6);
+            printf("Unable to start URTP.\n");
+            return false;
+        }
+        gpUrtp[x]->setDtx((pOptions != NULL) && pOptions->dtx);
+        gpUrtp[x]->setRedundancy(redundancy);
+        if ((pOptions != NULL) &&
+            !gpUrtp[x]->setFec(pOptions->fecGroupSize, (pOptions->fecNumParity != 0) ? pOptions->fecNumParity : 1)) {
+            LOG(EVENT_AUDIO_STREAMING_START_FAILURE, 13);
+            printf("Unable to set forward error correction.\n");
+            return false;
+        }
+    }
+    printf("URTP datagram store is %d bytes per stream.\n", datagramStoreSize);
+    gNumFecBytesSent = 0;
+    gNumFecSkippedLast = 0;
+    if (fec) {
+        printf("URTP forward error correction: %d parity datagram(s) after every %d datagrams, recovering up to %d lost in each group.\n",
+               (pOptions->fecNumParity != 0) ? pOptions->fecNumParity : 1, pOptions->fecGroupSize,
+               (pOptions->fecNumParity != 0) ? pOptions->fecNumParity : 1);
     }
+    if (gNumStreams > 1) {
+        printf("Streaming %d channels as URTP streams 0 to %d.\n", gNumStreams, gNumStreams - 1);
+    }
+    gRateGoodSeconds = 0;
+    gRateHoldSeconds = 0;
+    gRateLastSendTookTooLong = gNumAudioDatagramsSendTookTooLong;
+    gRateOverflow = false;
+    gRoundTripDelayMs = 0;
 
     printf("Starting PCM...\n");
     if (!startPcm()) {
@@ -727,23 +1832,39 @@ bool startAudioStreaming(const char *pAlsaPcmDeviceName,
         return false;
     }
 
-    printf("Starting task to send audio data...\n");
-    if (gpSendTask == NULL) {
-        gpSendTask = new std::thread(sendAudioData);
+    if (gUseReactor) {
+        printf("Starting reactor task to encode and send audio data...\n");
+        if (gpReactorTask == NULL) {
+            if (!startReactor()) {
+                LOG(EVENT_AUDIO_STREAMING_START_FAILURE, 10);
+                return false;
+            }
+            gpReactorTask = new std::thread(audioReactor);
+            if (gpReactorTask == NULL) {
+                LOG(EVENT_AUDIO_STREAMING_START_FAILURE, 11);
+                printf("Error starting task (%s).\n", strerror(errno));
+                return false;
+            }
+        }
+    } else {
+        printf("Starting task to send audio data...\n");
         if (gpSendTask == NULL) {
-            LOG(EVENT_AUDIO_STREAMING_START_FAILURE, 8);
-            printf("Error starting task (%s).\n", strerror(errno));
-            return false;
+            gpSendTask = new std::thread(sendAudioData);
+            if (gpSendTask == NULL) {
+                LOG(EVENT_AUDIO_STREAMING_START_FAILURE, 8);
+                printf("Error starting task (%s).\n", strerror(errno));
+                return false;
+            }
         }
-    }
 
-    printf("Starting task to encode audio data...\n");
-    if (gpEncodeTask == NULL) {
-        gpEncodeTask = new std::thread(encodeAudioData);
+        printf("Starting task to encode audio data...\n");
         if (gpEncodeTask == NULL) {
-            LOG(EVENT_AUDIO_STREAMING_START_FAILURE, 9);
-            printf("Error starting task (%s).\n", strerror(errno));
-            return false;
+            gpEncodeTask = new std::thread(encodeAudioData);
+            if (gpEncodeTask == NULL) {
+                LOG(EVENT_AUDIO_STREAMING_START_FAILURE, 9);
+                printf("Error starting task (%s).\n", strerror(errno));
+                return false;
+            }
         }
     }
 
@@ -771,6 +1892,14 @@ void stopAudioStreaming()
     gpWatchdogHandler = NULL;
     gpNowStreamingHandler = NULL;
 
+    if ((gpReactorTask != NULL) || (gReactorEpollFd >= 0)) {
+        LOG(EVENT_AUDIO_STREAMING_STOP, 8);
+        printf("Stopping audio reactor task...\n");
+        stopReactor();
+        printf("Audio reactor task stopped.\n");
+        LOG(EVENT_AUDIO_STREAMING_STOP, 9);
+    }
+
     if (gpEncodeTask != NULL) {
         LOG(EVENT_AUDIO_STREAMING_STOP, 1);
         printf("Stopping audio encode task...\n");
@@ -808,13 +1937,20 @@ void stopAudioStreaming()
     stopPcm();
     stopAudioStreamingConnection();
     stopTimer(gSecondTicker);
+    gSecondTicker = 0;
     sem_destroy(&gUrtpDatagramReady);
     sem_destroy(&gStopEncodeTask);
     sem_destroy(&gStopSendTask);
     sem_destroy(&gStopServerStatusTask);
-    if (gpUrtp != NULL) {
-        delete gpUrtp;
-        gpUrtp = NULL;
+    for (int x = 0; x < AUDIO_MAX_NUM_STREAMS; x++) {
+        if (gpUrtp[x] != NULL) {
+            delete gpUrtp[x];
+            gpUrtp[x] = NULL;
+        }
+        if (gpDatagramStorage[x] != NULL) {
+            delete[] gpDatagramStorage[x];
+            gpDatagramStorage[x] = NULL;
+        }
     }
 
     printf("Audio streaming stopped.\n");
@@ -826,4 +1962,16 @@ bool audioIsStreaming()
     return gAudioCommsConnected;
 }
 
+// Return the name of a capture profile.
+const char *getAudioPcmProfileName(AudioPcmProfile profile)
+{
+    const char *pName = NULL;
+
+    if ((profile >= 0) && (profile < MAX_NUM_AUDIO_PCM_PROFILES)) {
+        pName = gPcmProfiles[profile].pName;
+    }
+
+    return pName;
+}
+
 // End of file
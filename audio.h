@@ -67,6 +67,82 @@
  * streaming server to establish. */
 #define AUDIO_SERVER_LINK_ESTABLISHMENT_WAIT_S 5
 
+/* ----------------------------------------------------------------
+ * TYPES
+ * -------------------------------------------------------------- */
+
+/** The ALSA capture profiles: these trade latency against the
+ * number of times per second that we are woken up to read audio.
+ * There is no profile with periods shorter than a URTP block: a
+ * block can't be encoded until all of it has arrived, so they
+ * would only wake us up more often.
+ */
+typedef enum {
+    AUDIO_PCM_PROFILE_DEFAULT = 0, //!< one URTP block per period, four
+                                   //!< periods in the ring.
+    AUDIO_PCM_PROFILE_LOW_POWER,   //!< several URTP blocks per period,
+                                   //!< read and encoded in one go.
+    MAX_NUM_AUDIO_PCM_PROFILES
+} AudioPcmProfile;
+
+/** Options for audio streaming; all zero gives the default behaviour.
+ */
+typedef struct {
+    bool reactor; //!< if true, read, encode and send audio and check on
+                  //!< the audio streaming server from a single task
+                  //!< driven by epoll(), rather than from separate
+                  //!< encode, send and server status tasks.
+    bool mmap;    //!< if true, capture audio with mmap access and encode
+                  //!< it straight out of the PCM device's buffer rather
+                  //!< than reading it into a buffer of our own first.
+    bool mono;    //!< if true, ask the PCM device for mono and/or packed
+                  //!< 24-bit (S24_3LE) samples, falling back to 32-bit
+                  //!< stereo if it supports neither.
+    AudioPcmProfile pcmProfile; //!< the ALSA period and buffer sizing
+                                //!< to use when capturing audio.
+    const char *pAudioCoding;   //!< the name of the URTP audio coding
+                                //!< scheme to stream with (see
+                                //!< Urtp::getAudioCodingName()), NULL
+                                //!< for the default.
+    bool rateControl;           //!< if true, step the URTP audio coding
+                                //!< down to a lower rate when the link
+                                //!< to the audio streaming server is
+                                //!< struggling and back up again when
+                                //!< it recovers.
+    bool dtx;                   //!< if true, send empty SILENCE
+                                //!< datagrams in place of quiet audio
+                                //!< (discontinuous transmission).
+    bool stereo;                //!< if true, stream both channels of
+                                //!< the PCM device, each as a URTP
+                                //!< stream of its own (stream ID 0 for
+                                //!< the left channel, 1 for the right),
+                                //!< rather than just the left channel.
+    bool udp;                   //!< if true, send each URTP datagram to
+                                //!< the audio streaming server as a UDP
+                                //!< packet, with timing datagrams coming
+                                //!< back on the same socket, rather than
+                                //!< streaming them over TCP.
+    bool redundancy;            //!< if true, send a low rate copy of the
+                                //!< previous block of audio in each URTP
+                                //!< datagram (see Urtp::setRedundancy())
+                                //!< so that the audio streaming server can
+                                //!< conceal a single lost datagram.
+    int maxLatencyMs;           //!< if not 0, URTP datagrams that have
+                                //!< waited longer than this to be sent
+                                //!< are dropped, so that the audio heard
+                                //!< at the audio streaming server is never
+                                //!< more than this far behind.
+    int fecGroupSize;           //!< if not 0, the number of URTP datagrams
+                                //!< (2 to URTP_FEC_MAX_GROUP_SIZE) of each
+                                //!< stream after which PARITY datagrams are
+                                //!< sent so that the audio streaming server
+                                //!< can reconstruct lost datagrams (see
+                                //!< Urtp::setFec()); only of use with udp.
+    int fecNumParity;           //!< the number of PARITY datagrams to send
+                                //!< for each group, 1 to
+                                //!< URTP_FEC_MAX_NUM_PARITY, 0 for 1.
+} AudioStreamingOptions;
+
 /* ----------------------------------------------------------------
  * FUNCTION PROTOTYPES
  * -------------------------------------------------------------- */
@@ -74,10 +150,13 @@
 /** Start audio streaming.
  * @param pAlsaPcmDeviceName   the name of the ALSA PCM device to stream
  *                             from (must be 32 bits per channel, stereo,
- *                             16 kHz sample rate).
+ *                             SAMPLING_FREQUENCY sample rate, unless the
+ *                             mono option is set, see AudioStreamingOptions).
  * @param maxShift             the maximum audio shift (gain) to apply,
  *                             see urtp.h for the valid range.
  * @param pAudioServerUrl      the URL of the server to stream at.
+ * @param pOptions             the streaming options, may be NULL for
+ *                             the defaults.
  * @param pWatchdogHandler     pointer to the watchdog handler, NULL if none is active.
  * @param pNowStreamingHandler pointer to a "I'm streaming" handler which should be called
  *                             frequently (e.g. every transmit) to show activity; may be
@@ -87,6 +166,7 @@
 bool startAudioStreaming(const char *pAlsaPcmDeviceName,
                          const char *pAudioServerUrl,
                          int maxShift,
+                         const AudioStreamingOptions *pOptions,
                          void(*pWatchdogHandler)(void),
                          void(*pNowStreamingHandler)(void));
 
@@ -94,6 +174,13 @@ bool startAudioStreaming(const char *pAlsaPcmDeviceName,
  */
 void stopAudioStreaming();
 
+/** Return the name of a capture profile, as used on the command line.
+ * @param profile the capture profile.
+ * @return        the name of the capture profile, NULL if there is
+ *                no such profile.
+ */
+const char *getAudioPcmProfileName(AudioPcmProfile profile);
+
 /** Return whether audio is streaming or not.
  * @return true if audio is streaming, else false.
  */
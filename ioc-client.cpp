@@ -26,6 +26,7 @@
 #include <compile_time.h>
 #include <utils.h>
 #include <timer.h>
+#include <resolver.h>
 #include <audio.h>
 #include <urtp.h>
 #include <log.h>
@@ -64,14 +65,38 @@ static int gGpio = -1;
 // Print the usage text
 static void printUsage(char * pExeName) {
     printf("\n%s: run the Internet of Chuffs client.  Usage:\n", pExeName);
-    printf("    %s audio_source audio_server_url <-g max_gain> <-ls log_server_url> <-ld log_directory> <-p gpio>\n", pExeName);
+    printf("    %s audio_source audio_server_url <-g max_gain> <-ls log_server_url> <-ld log_directory> <-p gpio> <-r> <-m> <-1> <-c profile> <-e coding> <-a> <-s> <-2> <-u> <-d> <-l max_latency_ms> <-f group_size> <-fp num_parity>\n", pExeName);
     printf("where:\n");
-    printf("    audio_source is the name of the ALSA PCM audio capture device (must be 32 bits per channel, stereo, 16 kHz sample rate),\n");
-    printf("    audio_server_url is the URL of the Internet of Chuffs server,\n");
+    printf("    audio_source is the name of the ALSA PCM audio capture device (must be 32 bits per channel, stereo, %d Hz sample rate, unless -1 is given),\n", SAMPLING_FREQUENCY);
+    printf("    audio_server_url is the URL of the Internet of Chuffs server (an IPv6 address goes in square brackets, e.g. [2001:db8::1]:1297),\n");
     printf("    -g optionally specifies the maximum gain to apply; default is max which is %d, lower numbers mean less gain (and noise),\n", AUDIO_MAX_SHIFT_BITS);
     printf("    -ls optionally specifies the URL of a server to upload log-files to (where a logging server application must be listening),\n");
     printf("    -ld optionally specifies the directory to use for log files (default %s); the directory will be created if it does not exist,\n", DEFAULT_LOG_FILE_PATH);
     printf("    -p optionally specifies a GPIO pin to toggle to show activity (using wiringPi numbering),\n");
+    printf("    -r optionally runs audio capture, encoding and streaming from a single epoll()-driven task rather than three tasks,\n");
+    printf("    -m optionally encodes audio straight out of the ALSA buffer using mmap access, saving a copy,\n");
+    printf("    -1 optionally asks the audio capture device for mono and/or packed 24-bit samples, falling back to 32-bit stereo,\n");
+    printf("    -c optionally specifies the audio capture profile, one of");
+    for (int x = 0; x < MAX_NUM_AUDIO_PCM_PROFILES; x++) {
+        printf(" %s", getAudioPcmProfileName((AudioPcmProfile) x));
+    }
+    printf(" (default %s); low-power reads several blocks of audio per period,\n",
+           getAudioPcmProfileName(AUDIO_PCM_PROFILE_DEFAULT));
+    printf("    -e optionally specifies the URTP audio coding scheme, one of");
+    for (int x = 0; x < Urtp::MAX_NUM_AUDIO_CODINGS; x++) {
+        if (Urtp::getAudioCodingName((Urtp::AudioCoding) x) != NULL) {
+            printf(" %s", Urtp::getAudioCodingName((Urtp::AudioCoding) x));
+        }
+    }
+    printf(" (default is the most compact),\n");
+    printf("    -a optionally steps the audio coding down when the link to the server is struggling and back up when it recovers,\n");
+    printf("    -s optionally sends short silence datagrams in place of quiet audio to save data (discontinuous transmission),\n");
+    printf("    -2 optionally streams both channels of the audio capture device, left as URTP stream 0 and right as URTP stream 1 (may not be used with -1),\n");
+    printf("    -u optionally sends each URTP datagram to the server as a UDP packet rather than streaming them over TCP, so that a loss doesn't hold up what follows,\n");
+    printf("    -d optionally adds a low rate copy of the previous block of audio to each URTP datagram, so that the server can cover a single lost datagram, for around a quarter more data,\n");
+    printf("    -l optionally specifies, in milliseconds, how long URTP datagrams may wait to be sent (e.g. while the link is down) before they are dropped, default is to send everything,\n");
+    printf("    -f optionally sends forward error correction over UDP (so only with -u): a parity datagram after every group_size (2 to %d) URTP datagrams,\n", URTP_FEC_MAX_GROUP_SIZE);
+    printf("    -fp optionally specifies the number of parity datagrams sent with -f, 1 (default) to recover one lost URTP datagram in each group or %d to recover %d,\n", URTP_FEC_MAX_NUM_PARITY, URTP_FEC_MAX_NUM_PARITY);
     printf("For example:\n");
     printf("    %s mic io-server.co.uk:1297 -ls logserver.com -ld /var/log -p 0\n\n", pExeName);
 }
@@ -84,6 +109,7 @@ static void exitHandler(int retValue)
     digitalWrite(gGpio, LOW);
     printLog();
     deinitLog();
+    deinitResolver();
     deinitTimers();
     exit(retValue); 
 }
@@ -136,6 +162,9 @@ int main(int argc, char *argv[])
     struct stat st = { 0 };
     char *pChar;
     struct sigaction sigIntHandler;
+    AudioStreamingOptions audioOptions;
+
+    memset(&audioOptions, 0, sizeof(audioOptions));
 
     // Find the exe name in the first argument
     pChar = strtok(argv[x], DIR_SEPARATORS);
@@ -184,6 +213,65 @@ int main(int argc, char *argv[])
             if (x < argc) {
                 gGpio = atoi(argv[x]);
             }
+        // Test for reactor option
+        } else if (strcmp(argv[x], "-r") == 0) {
+            audioOptions.reactor = true;
+        // Test for mmap option
+        } else if (strcmp(argv[x], "-m") == 0) {
+            audioOptions.mmap = true;
+        // Test for mono option
+        } else if (strcmp(argv[x], "-1") == 0) {
+            audioOptions.mono = true;
+        // Test for capture profile option
+        } else if (strcmp(argv[x], "-c") == 0) {
+            x++;
+            if (x < argc) {
+                audioOptions.pcmProfile = MAX_NUM_AUDIO_PCM_PROFILES;
+                for (int y = 0; y < MAX_NUM_AUDIO_PCM_PROFILES; y++) {
+                    if (strcmp(argv[x], getAudioPcmProfileName((AudioPcmProfile) y)) == 0) {
+                        audioOptions.pcmProfile = (AudioPcmProfile) y;
+                    }
+                }
+            }
+        // Test for audio coding option
+        } else if (strcmp(argv[x], "-e") == 0) {
+            x++;
+            if (x < argc) {
+                audioOptions.pAudioCoding = argv[x];
+            }
+        // Test for rate control option
+        } else if (strcmp(argv[x], "-a") == 0) {
+            audioOptions.rateControl = true;
+        // Test for discontinuous transmission option
+        } else if (strcmp(argv[x], "-s") == 0) {
+            audioOptions.dtx = true;
+        // Test for stereo option
+        } else if (strcmp(argv[x], "-2") == 0) {
+            audioOptions.stereo = true;
+        // Test for UDP option
+        } else if (strcmp(argv[x], "-u") == 0) {
+            audioOptions.udp = true;
+        // Test for redundancy option
+        } else if (strcmp(argv[x], "-d") == 0) {
+            audioOptions.redundancy = true;
+        // Test for latency option
+        } else if (strcmp(argv[x], "-l") == 0) {
+            x++;
+            if (x < argc) {
+                audioOptions.maxLatencyMs = atoi(argv[x]);
+            }
+        // Test for forward error correction option
+        } else if (strcmp(argv[x], "-f") == 0) {
+            x++;
+            if (x < argc) {
+                audioOptions.fecGroupSize = atoi(argv[x]);
+            }
+        // Test for forward error correction parity option
+        } else if (strcmp(argv[x], "-fp") == 0) {
+            x++;
+            if (x < argc) {
+                audioOptions.fecNumParity = atoi(argv[x]);
+            }
         }
         x++;
     }
@@ -207,6 +295,55 @@ int main(int argc, char *argv[])
             printf("Max gain must be between 0 and %d (not %d).\n", AUDIO_MAX_SHIFT_BITS, maxShift);
         }
 
+        // Check that the capture profile, if specified, was recognised
+        if (success && (audioOptions.pcmProfile >= MAX_NUM_AUDIO_PCM_PROFILES)) {
+            printf("Unknown capture profile.\n");
+            success = false;
+        }
+
+        // Mono capture would leave nothing for a second stream
+        if (success && audioOptions.mono && audioOptions.stereo) {
+            printf("Cannot stream both channels when capturing in mono.\n");
+            success = false;
+        }
+
+        // Check that the latency budget, if specified, is sensible
+        if (success && (audioOptions.maxLatencyMs < 0)) {
+            printf("Maximum latency must be positive (not %d).\n", audioOptions.maxLatencyMs);
+            success = false;
+        }
+
+        // Check that forward error correction, if specified, is sensible
+        if (success && (audioOptions.fecGroupSize != 0) &&
+            ((audioOptions.fecGroupSize < 2) || (audioOptions.fecGroupSize > URTP_FEC_MAX_GROUP_SIZE))) {
+            printf("Forward error correction group size must be between 2 and %d (not %d).\n", URTP_FEC_MAX_GROUP_SIZE, audioOptions.fecGroupSize);
+            success = false;
+        }
+        if (success && (audioOptions.fecNumParity != 0) &&
+            ((audioOptions.fecNumParity < 1) || (audioOptions.fecNumParity > URTP_FEC_MAX_NUM_PARITY))) {
+            printf("Number of forward error correction parity datagrams must be between 1 and %d (not %d).\n", URTP_FEC_MAX_NUM_PARITY, audioOptions.fecNumParity);
+            success = false;
+        }
+        // Over TCP nothing is lost for parity to recover
+        if (success && (audioOptions.fecGroupSize != 0) && !audioOptions.udp) {
+            printf("Forward error correction can only be used over UDP.\n");
+            success = false;
+        }
+
+        // Check that the audio coding, if specified, is one we have
+        if (success && (audioOptions.pAudioCoding != NULL)) {
+            success = false;
+            for (int x = 0; x < Urtp::MAX_NUM_AUDIO_CODINGS; x++) {
+                if ((Urtp::getAudioCodingName((Urtp::AudioCoding) x) != NULL) &&
+                    (strcmp(audioOptions.pAudioCoding, Urtp::getAudioCodingName((Urtp::AudioCoding) x)) == 0)) {
+                    success = true;
+                }
+            }
+            if (!success) {
+                printf("Unknown audio coding \"%s\".\n", audioOptions.pAudioCoding);
+            }
+        }
+
         if (success) {
             printf("Internet of Chuffs client starting.\nAudio PCM capture device is \"%s\", server is \"%s\"", pPcmAudio, pAudioUrl);
             if (pLogUrl != NULL) {
@@ -218,6 +355,41 @@ int main(int argc, char *argv[])
             if (gGpio >= 0) {
                 printf(", GPIO%d will be toggled to show activity", gGpio);
             }
+            if (audioOptions.reactor) {
+                printf(", audio will be handled by a single reactor task");
+            }
+            if (audioOptions.mmap) {
+                printf(", audio will be captured with mmap access");
+            }
+            if (audioOptions.mono) {
+                printf(", audio will be captured in mono if possible");
+            }
+            printf(", audio capture profile is %s", getAudioPcmProfileName(audioOptions.pcmProfile));
+            if (audioOptions.pAudioCoding != NULL) {
+                printf(", audio coding is %s", audioOptions.pAudioCoding);
+            }
+            if (audioOptions.rateControl) {
+                printf(", audio coding will adapt to the link");
+            }
+            if (audioOptions.dtx) {
+                printf(", quiet audio will be sent as silence");
+            }
+            if (audioOptions.stereo) {
+                printf(", both audio channels will be streamed");
+            }
+            if (audioOptions.udp) {
+                printf(", audio will be sent over UDP");
+            }
+            if (audioOptions.redundancy) {
+                printf(", a copy of the previous block of audio will be sent with each datagram");
+            }
+            if (audioOptions.maxLatencyMs > 0) {
+                printf(", audio more than %d ms old will be dropped", audioOptions.maxLatencyMs);
+            }
+            if (audioOptions.fecGroupSize != 0) {
+                printf(", %d parity datagram(s) will be sent after every %d URTP datagrams",
+                       (audioOptions.fecNumParity != 0) ? audioOptions.fecNumParity : 1, audioOptions.fecGroupSize);
+            }
             printf(".\n");
 
             // Set up the CTRL-C handler
@@ -229,6 +401,9 @@ int main(int argc, char *argv[])
             // Initialise the timers
             initTimers();
 
+            // Start the task that looks up server addresses
+            initResolver();
+
             // Initialise logging
             initLog(gLogBuffer);
             initLogFile(pLogFilePath);
@@ -257,7 +432,7 @@ int main(int argc, char *argv[])
                     // out of streaming.  In the latter case we need to clean up, so always
                     // do that here just in case
                     stopAudioStreaming();
-                    if (startAudioStreaming(pPcmAudio, pAudioUrl, maxShift, watchdogHandler, ledToggleHandler)) {
+                    if (startAudioStreaming(pPcmAudio, pAudioUrl, maxShift, &audioOptions, watchdogHandler, ledToggleHandler)) {
                         printf("Audio streaming started, press CTRL-C to exit\n");
                         // Safe to upload log files now we've succeeded in making
                         // at least one connection
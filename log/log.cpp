@@ -26,6 +26,7 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <utils.h>
+#include <resolver.h>
 #include <log.h>
 
 /* ----------------------------------------------------------------
@@ -43,6 +44,10 @@
 // The maximum length of the URL of the logging server (including port).
 #define LOGGING_MAX_LEN_SERVER_URL 128
 
+// How long the log file upload task waits for the
+// IP address of the logging server to be looked up.
+#define LOGGING_DNS_LOOKUP_WAIT_MS 10000
+
 // The TCP buffer size for log file uploads.
 // Note: chose a small value here since the logs are small
 // and it avoids a large malloc().
@@ -57,6 +62,7 @@
 // Type used to pass parameters to the log file upload callback.
 typedef struct {
     const char *pCurrentLogFile;
+    char loggingServerUrl[LOGGING_MAX_LEN_SERVER_URL];
 } LogFileUploadData;
 
 /* ----------------------------------------------------------------
@@ -94,9 +100,6 @@ static char gLogPath[LOGGING_MAX_LEN_PATH + 1];
 // The name of the current log file.
 static char gCurrentLogFileName[LOGGING_MAX_LEN_FILE_PATH + 1];
 
-// The address of the logging server.
-static struct sockaddr_in *gpLoggingServer = NULL;
-
 // A thread to run the log upload process.
 static std::thread *gpLogUploadThread = NULL;
 
@@ -169,18 +172,39 @@ static void logFileUploadTask()
     int size;
     char *pReadBuffer = new char[LOGGING_TCP_BUFFER_SIZE];
     char fileNameBuffer[LOGGING_MAX_LEN_FILE_PATH];
+    struct sockaddr_storage loggingServer;
+    socklen_t loggingServerLength;
+    char addressString[RESOLVER_ADDRESS_STRING_LENGTH];
+    int port;
+    bool resolved;
 
     assert(gpLogFileUploadData != NULL);
 
     tv.tv_sec = 10;  /* 10 second timeout */
 
+    // The lookup is done here, rather than in beginLogFileUpload(),
+    // so that a slow DNS server doesn't hold up the caller
+    printf("[Looking for logging server URL \"%s\"...]\n", gpLogFileUploadData->loggingServerUrl);
+    resolved = resolveUrl(gpLogFileUploadData->loggingServerUrl, &loggingServer,
+                          &loggingServerLength, LOGGING_DNS_LOOKUP_WAIT_MS);
+    if (resolved) {
+        printf("[Found it at IP address %s]\n",
+               getAddressString(&loggingServer, loggingServerLength, addressString));
+        if (!getPortFromUrl(gpLogFileUploadData->loggingServerUrl, &port)) {
+            printf("[WARNING: no port number was specified in the logging server URL (\"%s\")]\n",
+                   gpLogFileUploadData->loggingServerUrl);
+        }
+    } else {
+        printf("[Unable to locate logging server \"%s\"]\n", gpLogFileUploadData->loggingServerUrl);
+    }
+
     LOG(EVENT_DIR_OPEN, 0);
     pDir = opendir(gLogPath);
     if (pDir != NULL) {
         // Send those log files, using a different TCP
         // connection for each one so that the logging server
-        // stores them in separate files
-        while (((pDirEnt = readdir(pDir)) != NULL) && (sem_trywait(&gStopLogUploadTask) != 0)) {
+        // stores them in separate files (if there's a server to send them to)
+        while (resolved && ((pDirEnt = readdir(pDir)) != NULL) && (sem_trywait(&gStopLogUploadTask) != 0)) {
             // Open the file, provided it's not the one we're currently logging to
             if (((strcmp(pDirEnt->d_name, ".") != 0) && (strcmp(pDirEnt->d_name, "..") != 0)) &&
                 (pDirEnt->d_type == DT_REG) &&
@@ -188,12 +212,12 @@ static void logFileUploadTask()
                  (strcmp(pDirEnt->d_name, gpLogFileUploadData->pCurrentLogFile) != 0))) {
                 x++;
                 LOG(EVENT_SOCKET_OPENING, y);
-                sock = socket(AF_INET, SOCK_STREAM, 0);
+                sock = socket(loggingServer.ss_family, SOCK_STREAM, 0);
                 if (sock >= 0) {
                     LOG(EVENT_SOCKET_OPENED, x);
                     setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (void *) &tv, sizeof(tv));
                     LOG(EVENT_SOCKET_CONNECTING, x);
-                    y = connect(sock, (struct sockaddr *) gpLoggingServer, sizeof(struct sockaddr));
+                    y = connect(sock, (struct sockaddr *) &loggingServer, loggingServerLength);
                     if (y >= 0) {
                         LOG(EVENT_SOCKET_CONNECTED, x);
                         LOG(EVENT_LOG_UPLOAD_STARTING, x);
@@ -256,8 +280,6 @@ static void logFileUploadTask()
     // Clear up globals
     delete gpLogFileUploadData;
     gpLogFileUploadData = NULL;
-    delete gpLoggingServer;
-    gpLoggingServer = NULL;
     sem_destroy(&gStopLogUploadTask);
 }
 
@@ -307,11 +329,8 @@ bool initLogFile(const char *pPath)
 bool beginLogFileUpload(const char *pLoggingServerUrl)
 {
     bool success = false;
-    char *pBuf = new char[LOGGING_MAX_LEN_SERVER_URL];
     DIR *pDir;
     struct dirent *pDirEnt;
-    struct hostent *pHostEntries = NULL;
-    int port;
     int x;
     int y;
     int z = 0;
@@ -341,30 +360,10 @@ bool beginLogFileUpload(const char *pLoggingServerUrl)
             printf("[%d log file(s) to upload]\n", z);
 
             if (z > 0) {
-                gpLoggingServer = new struct sockaddr_in;
-                getAddressFromUrl(pLoggingServerUrl, pBuf, LOGGING_MAX_LEN_SERVER_URL);
-                LOG(EVENT_DNS_LOOKUP, 0);
-                printf("[Looking for logging server URL \"%s\"...]\n", pBuf);
-                pHostEntries = gethostbyname(pBuf);
-                if (pHostEntries != NULL) {
-                    // Copy the network address to sockaddr_in structure
-                    memcpy(&(gpLoggingServer->sin_addr), pHostEntries->h_addr_list[0], pHostEntries->h_length);
-                    gpLoggingServer->sin_family = AF_INET;
-                            printf("[Found it at IP address %s]\n", inet_ntoa(gpLoggingServer->sin_addr));
-                    if (getPortFromUrl(pLoggingServerUrl, &port)) {
-                        gpLoggingServer->sin_port = htons(port);
-                        printf("[Logging server port is %d]\n", port);
-                    } else {
-                        printf("[WARNING: no port number was specified in the logging server URL (\"%s\")]\n",
-                                pLoggingServerUrl);
-                    }
-                } else {
-                    LOG(EVENT_DNS_LOOKUP_FAILURE, h_errno);
-                    printf("[Unable to locate logging server \"%s\"]\n", pLoggingServerUrl);
-                }
-
                 gpLogFileUploadData = new LogFileUploadData();
                 gpLogFileUploadData->pCurrentLogFile = pCurrentLogFile;
+                strncpy(gpLogFileUploadData->loggingServerUrl, pLoggingServerUrl,
+                        sizeof(gpLogFileUploadData->loggingServerUrl) - 1);
                 // Note: gpLogFileUploadData will be destroyed by the log file upload thread when it finishes
                 sem_init(&gStopLogUploadTask, false, 0);
                 gpLogUploadThread = new std::thread(logFileUploadTask);
@@ -387,7 +386,6 @@ bool beginLogFileUpload(const char *pLoggingServerUrl)
     } else {
         printf("[Log file upload task already running]\n");
     }
-    delete[] pBuf;
 
     return success;
 }
@@ -406,11 +404,6 @@ void stopLogFileUpload()
         delete gpLogFileUploadData;
         gpLogFileUploadData = NULL;
     }
-
-    if (gpLoggingServer != NULL) {
-        delete gpLoggingServer;
-        gpLoggingServer = NULL;
-    }
 }
 
 // Log an event plus parameter.
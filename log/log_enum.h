@@ -9,7 +9,7 @@ extern "C" {
 // IMPORTANT: increment this variable if you make ANY changes
 // to the enum below
 // !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
-#define LOG_VERSION 0
+#define LOG_VERSION 7
 
 // The possible events for the RAM log
 // If you add an item here, don't forget to
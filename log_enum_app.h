@@ -61,5 +61,18 @@
     EVENT_TIMING_DATAGRAM_TIMEOUT,
     EVENT_ROUNDTRIP_DELAY_MICROSECONDS,
     EVENT_AUDIO_SERVER_CONNECTED,
+    EVENT_ENCODE_DURATION_AVERAGE,
+    EVENT_NEW_PEAK_ENCODE_DURATION,
+    EVENT_PCM_PROFILE,
+    EVENT_PCM_PERIOD_FRAMES,
+    EVENT_PCM_BUFFER_FRAMES,
+    EVENT_AUDIO_CODING_STEP_DOWN,
+    EVENT_AUDIO_CODING_STEP_UP,
+    EVENT_AUDIO_SILENCE_BEGINS,
+    EVENT_AUDIO_SILENCE_ENDS,
+    EVENT_FEC_THROUGHPUT_BITS_S,
+    EVENT_FEC_OVERHEAD_PERCENT,
+    EVENT_DATAGRAMS_STALE_DROPPED,
+    EVENT_FEC_PARITY_SKIPPED,
 
 // End of file
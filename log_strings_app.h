@@ -61,5 +61,18 @@
     "  TIMING_DATAGRAM_TIMEOUT",
     "  ROUNDTRIP_DELAY_MICROSECONDS",
     "  AUDIO_SERVER_CONNECTED",
+    "  ENCODE_DURATION_AVERAGE",
+    "  NEW_PEAK_ENCODE_DURATION",
+    "  PCM_PROFILE",
+    "  PCM_PERIOD_FRAMES",
+    "  PCM_BUFFER_FRAMES",
+    "* AUDIO_CODING_STEP_DOWN",
+    "  AUDIO_CODING_STEP_UP",
+    "  AUDIO_SILENCE_BEGINS",
+    "  AUDIO_SILENCE_ENDS",
+    "  FEC_THROUGHPUT_BITS_S",
+    "  FEC_OVERHEAD_PERCENT",
+    "* DATAGRAMS_STALE_DROPPED",
+    "* FEC_PARITY_SKIPPED",
 
 // End of file
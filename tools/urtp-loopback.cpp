@@ -0,0 +1,291 @@
+/* Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <utils.h>
+#include <urtp.h>
+#include <audio.h>
+
+/* A stand-in for the audio streaming server, for testing the UDP
+ * transport (ioc-client -u) on one machine; it is not part of
+ * ioc-client and is built by "make loopback".  Run it with:
+ *
+ * urtp-loopback port
+ *
+ * ...and point ioc-client at it with localhost:port (or
+ * [::1]:port).  It listens for URTP datagrams on UDP port "port",
+ * over IPv4 or IPv6, and:
+ *
+ * - sends a timing datagram (see audio.h) back to wherever the
+ *   audio is coming from once a second, so that ioc-client sees
+ *   a working server,
+ * - reports, once a second, the number of datagrams received on
+ *   each stream, the gaps in the sequence numbers (datagrams lost
+ *   on the way or dropped at source) and the number that arrived
+ *   out of order; PARITY datagrams, which repeat the sequence number
+ *   of the first datagram of their group, are counted separately.
+ *
+ * Audio is not decoded.  CTRL-C prints the totals and stops.
+ */
+
+/* ----------------------------------------------------------------
+ * COMPILE-TIME MACROS
+ * -------------------------------------------------------------- */
+
+// The size of the receive buffer: bigger than any URTP datagram.
+#define LOOPBACK_RECEIVE_BUFFER_SIZE 2048
+
+// The number of streams that can be told apart, from the
+// four-bit stream ID in the URTP header.
+#define LOOPBACK_MAX_NUM_STREAMS 16
+
+/* ----------------------------------------------------------------
+ * TYPES
+ * -------------------------------------------------------------- */
+
+// Counts for one stream.
+typedef struct {
+    bool started;                   //!< true once a datagram has arrived.
+    uint16_t nextSequenceNumber;    //!< the sequence number expected next.
+    unsigned int numDatagrams;      //!< audio datagrams received.
+    unsigned int numBytes;          //!< bytes received, PARITY included.
+    unsigned int numLost;           //!< sequence numbers skipped over.
+    unsigned int numOutOfOrder;     //!< datagrams from before the last one.
+    unsigned int numParity;         //!< PARITY datagrams received.
+} LoopbackStream;
+
+/* ----------------------------------------------------------------
+ * VARIABLES
+ * -------------------------------------------------------------- */
+
+// Set by CTRL-C.
+static volatile bool gStop = false;
+
+// The counts for this second and since the start.
+static LoopbackStream gStreams[LOOPBACK_MAX_NUM_STREAMS];
+static LoopbackStream gTotals[LOOPBACK_MAX_NUM_STREAMS];
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+// Signal handler for CTRL-C.
+static void stopSignal(int)
+{
+    gStop = true;
+}
+
+// Print the counts for each stream that has had something.
+static void printCounts(const LoopbackStream *pStreams, const char *pPrefix)
+{
+    for (int x = 0; x < LOOPBACK_MAX_NUM_STREAMS; x++) {
+        if (pStreams[x].numDatagrams + pStreams[x].numParity > 0) {
+            printf("%sstream %d: %u datagram(s), %u byte(s), %u lost, %u out of order, %u parity.\n",
+                   pPrefix, x, pStreams[x].numDatagrams, pStreams[x].numBytes,
+                   pStreams[x].numLost, pStreams[x].numOutOfOrder, pStreams[x].numParity);
+        }
+    }
+}
+
+// Count a received URTP datagram against its stream.
+static void countDatagram(const unsigned char *pDatagram, int length)
+{
+    LoopbackStream *pStream = &(gStreams[pDatagram[1] >> 4]);
+    uint16_t sequenceNumber = (uint16_t) ((pDatagram[2] << 8) | pDatagram[3]);
+    uint16_t gap;
+
+    pStream->numBytes += length;
+    if ((pDatagram[1] & 0x0F) == Urtp::PARITY) {
+        pStream->numParity++;
+    } else {
+        pStream->numDatagrams++;
+        if (pStream->started) {
+            // The sequence number wraps, so a gap of more than
+            // half the range means this one is from the past
+            gap = sequenceNumber - pStream->nextSequenceNumber;
+            if (gap < 0x8000) {
+                pStream->numLost += gap;
+                pStream->nextSequenceNumber = sequenceNumber + 1;
+            } else {
+                pStream->numOutOfOrder++;
+            }
+        } else {
+            pStream->started = true;
+            pStream->nextSequenceNumber = sequenceNumber + 1;
+        }
+    }
+}
+
+// Add this second's counts to the totals and start again.
+static void addToTotals()
+{
+    for (int x = 0; x < LOOPBACK_MAX_NUM_STREAMS; x++) {
+        gTotals[x].numDatagrams += gStreams[x].numDatagrams;
+        gTotals[x].numBytes += gStreams[x].numBytes;
+        gTotals[x].numLost += gStreams[x].numLost;
+        gTotals[x].numOutOfOrder += gStreams[x].numOutOfOrder;
+        gTotals[x].numParity += gStreams[x].numParity;
+        gStreams[x].numDatagrams = 0;
+        gStreams[x].numBytes = 0;
+        gStreams[x].numLost = 0;
+        gStreams[x].numOutOfOrder = 0;
+        gStreams[x].numParity = 0;
+    }
+}
+
+// Open a UDP socket on the given port, IPv6 (taking IPv4 as well)
+// if possible, otherwise IPv4.
+static int openSocket(int port)
+{
+    struct sockaddr_in6 address6;
+    struct sockaddr_in address4;
+    struct timeval tv;
+    int setOption = 0;
+    int sock;
+
+    sock = socket(AF_INET6, SOCK_DGRAM, 0);
+    if (sock >= 0) {
+        setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &setOption, sizeof(setOption));
+        memset(&address6, 0, sizeof(address6));
+        address6.sin6_family = AF_INET6;
+        address6.sin6_addr = in6addr_any;
+        address6.sin6_port = htons(port);
+        if (bind(sock, (struct sockaddr *) &address6, sizeof(address6)) < 0) {
+            close(sock);
+            sock = -1;
+        }
+    }
+    // IPv6 may be there but switched off for binding (e.g.
+    // disabled by sysctl), so fall back to IPv4 either way
+    if (sock < 0) {
+        sock = socket(AF_INET, SOCK_DGRAM, 0);
+        if (sock >= 0) {
+            memset(&address4, 0, sizeof(address4));
+            address4.sin_family = AF_INET;
+            address4.sin_addr.s_addr = htonl(INADDR_ANY);
+            address4.sin_port = htons(port);
+            if (bind(sock, (struct sockaddr *) &address4, sizeof(address4)) < 0) {
+                close(sock);
+                sock = -1;
+            }
+        }
+    }
+
+    if (sock >= 0) {
+        // Wake up at least every 100 ms to keep the once a second
+        // things going when nothing is arriving
+        memset(&tv, 0, sizeof(tv));
+        tv.tv_usec = 100000;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (void *) &tv, sizeof(tv));
+    }
+
+    return sock;
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+int main(int argc, char *argv[])
+{
+    struct sigaction sigIntHandler;
+    unsigned char buffer[LOOPBACK_RECEIVE_BUFFER_SIZE];
+    unsigned char timingDatagram[AUDIO_TIMING_DATAGRAM_LENGTH];
+    struct sockaddr_storage from;
+    struct sockaddr_storage sender;
+    socklen_t senderLength = 0;
+    socklen_t length;
+    char host[NI_MAXHOST];
+    char serv[NI_MAXSERV];
+    bool haveTiming = false;
+    long long int nextSecond;
+    int port = 0;
+    int sock;
+    int x;
+
+    if (argc == 2) {
+        port = atoi(argv[1]);
+    }
+    if ((port <= 0) || (port > 0xFFFF)) {
+        printf("Usage: %s port\n", argv[0]);
+        return 1;
+    }
+
+    sock = openSocket(port);
+    if (sock < 0) {
+        printf("Unable to listen on UDP port %d (%s).\n", port, strerror(errno));
+        return 1;
+    }
+
+    sigIntHandler.sa_handler = stopSignal;
+    sigemptyset(&sigIntHandler.sa_mask);
+    sigIntHandler.sa_flags = 0;
+    sigaction(SIGINT, &sigIntHandler, NULL);
+
+    printf("Listening for URTP datagrams on UDP port %d, CTRL-C to stop.\n", port);
+    nextSecond = getUSeconds() + 1000000;
+    while (!gStop) {
+        length = sizeof(from);
+        x = recvfrom(sock, buffer, sizeof(buffer), 0, (struct sockaddr *) &from, &length);
+        if ((x >= URTP_HEADER_SIZE) && (buffer[0] == SYNC_BYTE)) {
+            if ((length != senderLength) || (memcmp(&from, &sender, length) != 0)) {
+                // A new sender, or ioc-client has reconnected from
+                // a new port, so the sequence numbers start again
+                getnameinfo((struct sockaddr *) &from, length, host, sizeof(host),
+                            serv, sizeof(serv), NI_NUMERICHOST | NI_NUMERICSERV);
+                printf("Receiving from %s port %s.\n", host, serv);
+                for (int y = 0; y < LOOPBACK_MAX_NUM_STREAMS; y++) {
+                    gStreams[y].started = false;
+                }
+            }
+            memcpy(&sender, &from, length);
+            senderLength = length;
+            countDatagram(buffer, x);
+            // Keep the sequence number and timestamp of the latest
+            // audio datagram of stream 0 to send back
+            if (((buffer[1] >> 4) == 0) && ((buffer[1] & 0x0F) != Urtp::PARITY)) {
+                timingDatagram[0] = SYNC_BYTE;
+                memcpy(timingDatagram + 1, buffer + 2, AUDIO_TIMING_DATAGRAM_LENGTH - 1);
+                haveTiming = true;
+            }
+        }
+
+        if (getUSeconds() >= nextSecond) {
+            nextSecond += 1000000;
+            if (haveTiming) {
+                sendto(sock, timingDatagram, sizeof(timingDatagram), 0,
+                       (struct sockaddr *) &sender, senderLength);
+                haveTiming = false;
+            }
+            printCounts(gStreams, "");
+            addToTotals();
+        }
+    }
+
+    addToTotals();
+    printf("\nTotals:\n");
+    printCounts(gTotals, "  ");
+    close(sock);
+
+    return 0;
+}
+
+// End of file
@@ -0,0 +1,1978 @@
+/* Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <atomic>
+#include <thread>
+#include <utils.h>
+#include <urtp.h>
+
+/* Test program for the URTP encoder, not part of ioc-client; it
+ * is built and run by "make test".
+ *
+ * - The Q15 pre-emphasis filter is checked against the double
+ *   precision filter that it was derived from.
+ * - Every audio coding scheme, with and without redundancy, is
+ *   run over the same synthetic audio in each raw audio format
+ *   and a hash of the datagrams is printed.  "make test" builds
+ *   this twice, once as normal and once with URTP_DISABLE_SIMD,
+ *   and compares the output, so any difference between the
+ *   NEON/SSE2 encoder and the plain C one shows up.
+ * - A copy of the baseline encoder, which applied gain and
+ *   packed UNICAM one sample at a time, is run alongside the
+ *   block-at-a-time one and the datagram bodies must be
+ *   byte-identical.
+ * - The datagrams of each of the UNICAM codings are unpacked
+ *   again, checking the length of the body and that each sample
+ *   comes back within what the shift of its block throws away.
+ * - The datagrams of UNICAM_RICE_8_BIT are decoded again, from
+ *   audio that takes in silence, full-scale and alternating
+ *   sign blocks, and must match UNICAM_COMPRESSED_8_BIT of the
+ *   same audio bit for bit, with every Rice parameter (0 to 6)
+ *   and the escape having been used.
+ * - The datagrams of LPC_RESIDUAL_6_BIT are decoded again, with
+ *   the predictor carried over from one datagram to the next,
+ *   checking that the history in each matches where the decoder
+ *   got to and that each sample comes back within the bound
+ *   that the shift of its block sets.
+ * - Forward error correction is run over UNICAM_RICE_8_BIT, so
+ *   that the datagrams of a group differ in length, and each
+ *   datagram of every group is rebuilt from the others and P,
+ *   each pair of datagrams from the others, P and Q, and checked
+ *   against the original; the number of PARITY datagrams skipped
+ *   with the store full is checked against a model, as is that a
+ *   group cut short by a dropped datagram, or by the end, has no
+ *   parity.
+ * - REDUNDANT datagrams, with discontinuous transmission, are
+ *   taken apart again: the primary coding and length, then the
+ *   copy of the previous block, which must be there only if the
+ *   previous datagram was sent and wasn't SILENCE.  The primary
+ *   payload must be what the coding gives without redundancy and
+ *   the copy must decode to within its shifts of the previous
+ *   block, which, for PCM_SIGNED_16_BIT, is the previous primary
+ *   payload decimated.
+ * - Every audio coding scheme, with and without redundancy and
+ *   with forward error correction, is run with a datagram store
+ *   sized for just that session, checking that no datagram is
+ *   larger than the room the store has for it and that nothing
+ *   that wasn't allowed for can be switched on.
+ * - The datagram ring is taken round and round, overflowing with
+ *   and without the oldest datagram held, checking the counts
+ *   and the order against a model until the sequence number has
+ *   wrapped, then hammered from an encode thread and a send
+ *   thread at once, checking that datagrams come out in order
+ *   and that the only ones missing are those counted as
+ *   overwritten or dropped as stale.
+ *
+ * The exit code is 0 on success, otherwise 1.
+ */
+
+/* ----------------------------------------------------------------
+ * COMPILE-TIME MACROS
+ * -------------------------------------------------------------- */
+
+// The largest error, compared with filtering in double
+// precision, that the Q15 filter may have.
+#define FIR_TEST_MAX_ERROR 4
+
+// The number of blocks of audio coded for each coding scheme.
+#define CODING_TEST_NUM_BLOCKS 2000
+
+// The maximum value of a 24-bit sample.
+#define SAMPLE_24_BIT_MAX 0x7FFFFF
+
+// The period, in samples, of the tone in the LPC test.
+#define LPC_TEST_TONE_PERIOD 40
+
+// The number of datagrams in a forward error correction group
+// in the FEC test.
+#define FEC_TEST_GROUP_SIZE 5
+
+// The number of blocks coded, and read, in each part of the FEC
+// test.
+#define FEC_TEST_NUM_BLOCKS 1000
+
+// The number of blocks of each hundred in the REDUNDANT test
+// which are silent, long enough for discontinuous transmission
+// to send SILENCE.
+#define REDUNDANT_TEST_NUM_SILENT_BLOCKS 40
+
+// The number of times round the datagram ring in the single
+// threaded ring test: enough for the 16 bit sequence number
+// to wrap.
+#define RING_TEST_NUM_LAPS 500
+
+// The number of blocks coded by the encode thread in the ring
+// stress test.
+#define RING_STRESS_NUM_BLOCKS 200000
+
+/* ----------------------------------------------------------------
+ * TYPES
+ * -------------------------------------------------------------- */
+
+// What the FEC test has received of the current group.
+typedef struct {
+    int numHeld;
+    int lastSequenceNumber;
+    unsigned char p[URTP_FEC_PROTECTED_SIZE];
+    int pSequenceNumber;
+    int pLength;
+    int numParity;
+    int numRebuiltP;
+    int numRebuiltPQ;
+    int numUnchecked;
+    int numBad;
+    int firstParitySequenceNumber;
+} FecReceiver;
+
+// Double precision version of the filter.
+typedef struct {
+    double history[FIR_TAP_NUM];
+    unsigned int lastIndex;
+} FirReference;
+
+// The state of the baseline encoder.
+typedef struct {
+    int audioShiftSampleCount;
+    int audioUnusedBitsMin;
+    int audioShift;
+    int audioUpShiftCount;
+    Fir preemphasis;
+    int unicamBuffer[SAMPLES_PER_UNICAM_BLOCK];
+} Baseline;
+
+/* ----------------------------------------------------------------
+ * VARIABLES
+ * -------------------------------------------------------------- */
+
+// The taps as designed, from which the Q15 ones in urtp/fir.cpp
+// were derived.
+#if FIR_SAMPLING_FREQUENCY == 8000
+static const double filterTaps[] = {-0.0405145154415521,
+                                    -0.030752436208519165,
+                                    -0.19772128908628347,
+                                     0.547833084803133,
+                                    -0.19772128908628347,
+                                    -0.030752436208519165,
+                                    -0.0405145154415521};
+
+#elif FIR_SAMPLING_FREQUENCY == 16000
+static const double filterTaps[] = {-0.07951087685285016,
+                                     0.01945354671754785,
+                                    -0.005453575732499895,
+                                    -0.04837063849132621,
+                                    -0.07168597959153167,
+                                    -0.16374206778816897,
+                                     0.7588178512425175,
+                                    -0.16374206778816897,
+                                    -0.07168597959153167,
+                                    -0.04837063849132621,
+                                    -0.005453575732499895,
+                                     0.01945354671754785,
+                                    -0.07951087685285016};
+
+#elif FIR_SAMPLING_FREQUENCY == 32000
+static const double filterTaps[] = {-0.026035353062070724,
+                                    -0.012600855607778677,
+                                    -0.0014625907040377252,
+                                     0.001172302047458353,
+                                    -0.006493150335799233,
+                                    -0.01969653720515719,
+                                    -0.029701004984208777,
+                                    -0.03423805941144596,
+                                    -0.039884760899308605,
+                                    -0.0570137584707644,
+                                    -0.08649676852293722,
+                                    -0.11647810537014147,
+                                     0.8709243143723675,
+                                    -0.11647810537014147,
+                                    -0.08649676852293722,
+                                    -0.0570137584707644,
+                                    -0.039884760899308605,
+                                    -0.03423805941144596,
+                                    -0.029701004984208777,
+                                    -0.01969653720515719,
+                                    -0.006493150335799233,
+                                     0.001172302047458353,
+                                    -0.0014625907040377252,
+                                    -0.012600855607778677,
+                                    -0.026035353062070724};
+
+#elif FIR_SAMPLING_FREQUENCY == 48000
+static const double filterTaps[] = {-0.022693907883019036,
+                                    -0.01282224357381771,
+                                    -0.0048857160421552056,
+                                     3.247531652985006e-05,
+                                     0.00174815617961579,
+                                    -0.00020882307430763642,
+                                    -0.004711023859375592,
+                                    -0.010673839267509654,
+                                    -0.015975939037288386,
+                                    -0.0198015036229937,
+                                    -0.021705632327846856,
+                                    -0.023351570481146472,
+                                    -0.026427890740846845,
+                                    -0.03322801884448266,
+                                    -0.04400366271124685,
+                                    -0.05793340338551464,
+                                    -0.07172510260306462,
+                                    -0.0821631391990514,
+                                     0.9141091946062653,
+                                    -0.0821631391990514,
+                                    -0.07172510260306462,
+                                    -0.05793340338551464,
+                                    -0.04400366271124685,
+                                    -0.03322801884448266,
+                                    -0.026427890740846845,
+                                    -0.023351570481146472,
+                                    -0.021705632327846856,
+                                    -0.0198015036229937,
+                                    -0.015975939037288386,
+                                    -0.010673839267509654,
+                                    -0.004711023859375592,
+                                    -0.00020882307430763642,
+                                     0.00174815617961579,
+                                     3.247531652985006e-05,
+                                    -0.0048857160421552056,
+                                    -0.01282224357381771,
+                                    -0.022693907883019036};
+#endif
+
+// Datagram storage.
+static char gDatagramStorage[URTP_DATAGRAM_STORE_SIZE];
+
+// Datagram storage for a second URTP instance, for the tests
+// that code the same audio two ways at once.
+static char gSecondDatagramStorage[URTP_DATAGRAM_STORE_SIZE];
+
+// The last FEC_TEST_GROUP_SIZE audio datagrams received in the
+// FEC test, oldest first.
+static char gFecGroup[FEC_TEST_GROUP_SIZE][URTP_DATAGRAM_SIZE];
+
+// The synthetic audio, 24-bit samples.
+static int gSamples[SAMPLES_PER_BLOCK];
+
+// The number of datagram overflows reported by the ring
+// tests' overflow callback, which has no context.
+static std::atomic<int> gRingNumOverflows;
+
+// The synthetic audio in each of the raw audio formats.
+static uint32_t gRawStereoS32[SAMPLES_PER_BLOCK * 2];
+static uint32_t gRawMonoS32[SAMPLES_PER_BLOCK];
+static unsigned char gRawStereoS24[SAMPLES_PER_BLOCK * 2 * 3];
+static unsigned char gRawMonoS24[SAMPLES_PER_BLOCK * 3];
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+static void firReferenceInit(FirReference *f)
+{
+    memset(f, 0, sizeof(*f));
+}
+
+static void firReferencePut(FirReference *f, double input)
+{
+    f->history[f->lastIndex] = input;
+    f->lastIndex++;
+
+    if (f->lastIndex == sizeof(filterTaps) / sizeof(filterTaps[0])) {
+        f->lastIndex = 0;
+    }
+}
+
+static double firReferenceGet(FirReference *f)
+{
+    double acc = 0;
+    int index = f->lastIndex;
+
+    for (unsigned int i = 0; i < sizeof(filterTaps) / sizeof(filterTaps[0]); ++i) {
+        if (index != 0) {
+            index = index - 1;
+        } else {
+            index = sizeof(filterTaps) / sizeof(filterTaps[0]) - 1;
+        }
+        acc += f->history[index] * filterTaps[i];
+    }
+
+    return acc;
+}
+
+// Check the Q15 filter against the double precision one.
+static bool firTest()
+{
+    Fir fir;
+    FirReference firReference;
+    int32_t input[FIR_CHUNK_SIZE + 1];
+    int32_t output[FIR_CHUNK_SIZE + 1];
+    uint32_t seed = 1;
+    int error;
+    int maxError = 0;
+
+    firInit(&fir);
+    firReferenceInit(&firReference);
+
+    // Run blocks of pseudo-random full-scale noise, followed
+    // by a full-scale square wave, through both versions; the
+    // block is one sample longer than a chunk to exercise the
+    // chunking
+    for (int block = 0; block < 64; block++) {
+        for (unsigned int i = 0; i < sizeof(input) / sizeof(input[0]); i++) {
+            if (block < 32) {
+                seed = seed * 1103515245 + 12345;
+                input[i] = ((int32_t) seed) >> 16;
+            } else {
+                input[i] = (i & 4) ? 32767 : -32768;
+            }
+        }
+        firProcessBlock(&fir, input, output, sizeof(output) / sizeof(output[0]));
+        for (unsigned int i = 0; i < sizeof(input) / sizeof(input[0]); i++) {
+            firReferencePut(&firReference, (double) input[i]);
+            error = abs((int) firReferenceGet(&firReference) - output[i]);
+            if (error > maxError) {
+                maxError = error;
+            }
+        }
+    }
+
+    printf("FIR: largest error %d (limit %d).\n", maxError, FIR_TEST_MAX_ERROR);
+
+    return (maxError <= FIR_TEST_MAX_ERROR);
+}
+
+static void makeRawBlock();
+
+// Make the synthetic audio for a block: a tone plus noise at a
+// level that steps up and down every few blocks, with the odd
+// block of full-scale noise to exercise clipping.
+static void makeBlock(int block, uint32_t *pSeed)
+{
+    int level = (block / 7) % 24;
+    int x;
+
+    for (int i = 0; i < SAMPLES_PER_BLOCK; i++) {
+        *pSeed = *pSeed * 1103515245 + 12345;
+        if (block % 50 == 49) {
+            x = (*pSeed & 0x80000000) ? SAMPLE_24_BIT_MAX : -SAMPLE_24_BIT_MAX - 1;
+        } else {
+            x = (((int32_t) *pSeed) >> (31 - level)) + ((((i * 13) + block) % 64) << level) - (32 << level);
+            if (x > SAMPLE_24_BIT_MAX) {
+                x = SAMPLE_24_BIT_MAX;
+            } else if (x < -SAMPLE_24_BIT_MAX - 1) {
+                x = -SAMPLE_24_BIT_MAX - 1;
+            }
+        }
+        gSamples[i] = x;
+    }
+
+    makeRawBlock();
+}
+
+// Put the synthetic audio into each of the raw audio formats.
+static void makeRawBlock()
+{
+    int x;
+
+    // I2S puts the 24 bits at the top of a 32-bit word, a
+    // packed sample is the 24 bits little-endian; the right
+    // channel is filled with something else to be ignored
+    for (int i = 0; i < SAMPLES_PER_BLOCK; i++) {
+        x = gSamples[i];
+        gRawStereoS32[i * 2] = ((uint32_t) x) << 8;
+        gRawStereoS32[(i * 2) + 1] = ((uint32_t) ~x) << 8;
+        gRawMonoS32[i] = ((uint32_t) x) << 8;
+        for (int y = 0; y < 3; y++) {
+            gRawStereoS24[(i * 6) + y] = (unsigned char) (x >> (y * 8));
+            gRawStereoS24[(i * 6) + 3 + y] = (unsigned char) (~x >> (y * 8));
+            gRawMonoS24[(i * 3) + y] = (unsigned char) (x >> (y * 8));
+        }
+    }
+}
+
+// Add some bytes to an FNV-1a hash.
+static uint32_t hash(uint32_t h, const char *pData, int length)
+{
+    for (int x = 0; x < length; x++) {
+        h = (h ^ (unsigned char) pData[x]) * 16777619;
+    }
+
+    return h;
+}
+
+// Get the sequence number from a datagram.
+static int sequenceNumber(const char *pDatagram)
+{
+    return (((unsigned char) pDatagram[2]) << 8) | (unsigned char) pDatagram[3];
+}
+
+// Code the synthetic audio with a coding scheme from a raw audio
+// format and return a hash of the datagrams, less the timestamps.
+static uint32_t codeBlocks(Urtp::AudioCoding audioCoding, bool redundancy,
+                           Urtp::RawAudioFormat format)
+{
+    Urtp urtp(NULL);
+    const void *pRaw[] = {gRawStereoS32, gRawMonoS32, gRawStereoS24, gRawMonoS24};
+    const char *pDatagram;
+    uint32_t h = 2166136261;
+    uint32_t seed = 1;
+
+    urtp.init(gDatagramStorage);
+    urtp.setAudioCoding(audioCoding);
+    urtp.setRedundancy(redundancy);
+    for (int block = 0; block < CODING_TEST_NUM_BLOCKS; block++) {
+        makeBlock(block, &seed);
+        urtp.codeAudioBlock(pRaw[format], format);
+        while ((pDatagram = urtp.getUrtpDatagram()) != NULL) {
+            h = hash(h, pDatagram, 4);
+            h = hash(h, pDatagram + 12, Urtp::getDatagramSize(pDatagram) - 12);
+            urtp.setUrtpDatagramAsRead(pDatagram);
+        }
+    }
+
+    return h;
+}
+
+// Run each coding scheme over the synthetic audio and print
+// the hash; every raw audio format should give the same one.
+static bool codingTest()
+{
+    bool success = true;
+    const char *pName;
+    uint32_t h[4];
+
+    for (int x = 0; x < Urtp::MAX_NUM_AUDIO_CODINGS; x++) {
+        for (int redundancy = 0; redundancy < 2; redundancy++) {
+            // Skip those that can't be selected
+            pName = Urtp::getAudioCodingName((Urtp::AudioCoding) x);
+            if (pName != NULL) {
+                for (int format = 0; format < 4; format++) {
+                    h[format] = codeBlocks((Urtp::AudioCoding) x, redundancy, (Urtp::RawAudioFormat) format);
+                }
+                printf("%s%s: %08x.\n", pName, redundancy ? " + redundancy" : "", h[0]);
+                if ((h[1] != h[0]) || (h[2] != h[0]) || (h[3] != h[0])) {
+                    printf("%s%s: raw audio formats differ (%08x %08x %08x %08x).\n",
+                           pName, redundancy ? " + redundancy" : "", h[0], h[1], h[2], h[3]);
+                    success = false;
+                }
+            }
+        }
+    }
+
+    return success;
+}
+
+static void baselineInit(Baseline *b)
+{
+    b->audioShiftSampleCount = 0;
+    b->audioUnusedBitsMin = 0x7FFFFFFF;
+    b->audioShift = AUIDIO_SHIFT_DEFAULT;
+    b->audioUpShiftCount = 0;
+    firInit(&b->preemphasis);
+}
+
+// The baseline gain control, as it was before being done a
+// block at a time, less the logging.
+static int baselineProcessAudio(Baseline *b, int monoSample)
+{
+    int unusedBits = 0;
+    int absSample = monoSample;
+
+    // First, determine the number of unused bits
+    // (avoiding testing the top bit since that is
+    // never unused)
+    if (absSample < 0) {
+        absSample = -absSample;
+    }
+
+    for (int x = 30; x >= 0; x--) {
+        if (absSample & (1 << x)) {
+            break;
+        } else {
+            unusedBits++;
+        }
+    }
+
+    if (absSample > AUDIO_SHIFT_THRESHOLD) {
+        monoSample <<= b->audioShift;
+    }
+
+    // Update the minimum number of unused bits
+    if (unusedBits < b->audioUnusedBitsMin) {
+        b->audioUnusedBitsMin = unusedBits;
+    }
+    b->audioShiftSampleCount++;
+    // If we've had a block's worth of data, work out how much gain we may be
+    // able to apply for the next period
+    if (b->audioShiftSampleCount >= SAMPLING_FREQUENCY / (1000 / BLOCK_DURATION_MS)) {
+        b->audioShiftSampleCount = 0;
+        if (b->audioShift > b->audioUnusedBitsMin) {
+            b->audioShift = b->audioUnusedBitsMin;
+        }
+        if ((b->audioUnusedBitsMin - b->audioShift > (AUDIO_DESIRED_UNUSED_BITS + AUDIO_SHIFT_HYSTERESIS_BITS)) &&
+            (b->audioShift < AUDIO_MAX_SHIFT_BITS)) {
+            b->audioUpShiftCount++;
+            if (b->audioUpShiftCount > AUDIO_NUM_UP_SHIFTS_FOR_A_SHIFT) {
+                b->audioShift++;
+                b->audioUpShiftCount = 0;
+            }
+        } else if ((b->audioUnusedBitsMin - b->audioShift < AUDIO_DESIRED_UNUSED_BITS) && (b->audioShift > 0)) {
+            b->audioShift--;
+            b->audioUpShiftCount = 0;
+        }
+
+        // Increment the minimum number of unused bits in the period
+        // to let the number "relax"
+        b->audioUnusedBitsMin++;
+    }
+
+    return monoSample;
+}
+
+// The baseline PCM_SIGNED_16_BIT encoder, one sample at a time,
+// taking the samples of the synthetic audio directly.
+static int baselineCodePcm(Baseline *b, char *dest)
+{
+    int monoSample;
+
+    for (int x = 0; x < SAMPLES_PER_BLOCK; x++) {
+        monoSample = baselineProcessAudio(b, gSamples[x]);
+        *dest = (char) (monoSample >> 24);
+        dest++;
+        *dest = (char) (monoSample >> 16);
+        dest++;
+    }
+
+    return SAMPLES_PER_BLOCK * 2;
+}
+
+// The baseline UNICAM_COMPRESSED_8_BIT encoder, one sample at a
+// time, less the logging and ramp test; the one change is that
+// the pre-emphasis is the Q15 filter, fed a sample at a time,
+// since the double precision one it replaced is checked
+// separately and is not bit-exact.
+static int baselineCodeUnicam(Baseline *b, char *dest)
+{
+    int monoSample;
+    int filteredSample;
+    int absSample;
+    int maxSample = 0;
+    int numBytes = 0;
+    int numBlocks = 0;
+    unsigned int i = 0;
+    int usedBits;
+    int shiftValueCoded;
+    bool isEvenBlock = false;
+    char *pDestOriginal = dest;
+
+    for (int x = 0; x < SAMPLES_PER_BLOCK; x++) {
+        monoSample = baselineProcessAudio(b, gSamples[x]);
+
+        // Scale the sample down to the maximum size we want the
+        // decoder to derive
+        monoSample >>= (32 - UNICAM_MAX_DECODED_SAMPLE_SIZE_BITS);
+
+        // Add the preemphasis
+        firProcessBlock(&b->preemphasis, &monoSample, &filteredSample, 1);
+        monoSample = filteredSample;
+
+        // Track the max abs value
+        absSample = monoSample;
+        if (absSample < 0) {
+            absSample = -absSample;
+        }
+        if (absSample > maxSample) {
+            maxSample = absSample;
+        }
+
+        // Put the sample into the unicam buffer
+        b->unicamBuffer[i] = monoSample;
+        i++;
+
+        // Check if we have a unicam block's worth ready to go
+        if (i >= sizeof (b->unicamBuffer) / sizeof (b->unicamBuffer[0])) {
+            i = 0;
+            shiftValueCoded = 0;
+            usedBits = 32;
+
+            // Once we have a buffer full, work out the shift value
+            // to just fit the maximum value into 8 bits.  First
+            // find the number of bits used (avoid testing the top
+            // bit since that is always used)
+            for (int y = 30; y >= 0; y--) {
+                if ((maxSample & (1 << y)) != 0) {
+                    break;
+                } else {
+                    usedBits--;
+                }
+            }
+            maxSample = 0;
+
+            if (usedBits > UNICAM_CODED_SAMPLE_SIZE_BITS) {
+                shiftValueCoded = usedBits - UNICAM_CODED_SAMPLE_SIZE_BITS;
+            }
+
+            isEvenBlock = false;
+            if ((numBlocks & 1) == 0) {
+                isEvenBlock = true;
+            }
+
+            // If we're on an odd block, the shift value goes into the
+            // upper nibble of the shift byte, which is where the dest
+            // pointer will already be pointed at, with nibble
+            // already zeroed for us
+            if (!isEvenBlock) {
+                *dest |= shiftValueCoded << 4;
+                dest++;
+            }
+
+            // Write into the output all the values in the buffer shifted down by this amount
+            for (unsigned int y = 0; y < sizeof (b->unicamBuffer) / sizeof (b->unicamBuffer[0]); y++) {
+                *dest = b->unicamBuffer[y] >> shiftValueCoded;
+                dest++;
+            }
+
+            // If we're on an even block number the shift value goes into
+            // the lower nibble of the shift byte that follows the unicam block
+            // and we don't increment the dest pointer so that the shift value
+            // for the next block can be written in the upper nibble
+            if (isEvenBlock) {
+                *dest = shiftValueCoded & 0x0F;
+            }
+
+            numBlocks++;
+        }
+    }
+
+    numBytes = dest - pDestOriginal;
+    if (isEvenBlock) {
+        numBytes++;
+    }
+
+    return numBytes;
+}
+
+// Run a coding scheme alongside the baseline encoder for it and
+// check that the datagram bodies are byte-identical.
+static bool baselineCompare(Urtp::AudioCoding audioCoding,
+                            int (*baselineCode)(Baseline *, char *))
+{
+    Urtp urtp(NULL);
+    Baseline baseline;
+    char body[URTP_BODY_SIZE];
+    const char *pDatagram;
+    int numBytes;
+    int numDiffering = 0;
+    uint32_t seed = 1;
+
+    urtp.init(gDatagramStorage);
+    urtp.setAudioCoding(audioCoding);
+    baselineInit(&baseline);
+    for (int block = 0; block < CODING_TEST_NUM_BLOCKS; block++) {
+        makeBlock(block, &seed);
+        urtp.codeAudioBlock(gRawStereoS32);
+        numBytes = baselineCode(&baseline, body);
+        pDatagram = urtp.getUrtpDatagram();
+        if ((pDatagram == NULL) ||
+            (Urtp::getDatagramSize(pDatagram) != URTP_HEADER_SIZE + numBytes) ||
+            (memcmp(pDatagram + URTP_HEADER_SIZE, body, numBytes) != 0)) {
+            numDiffering++;
+        }
+        urtp.setUrtpDatagramAsRead(pDatagram);
+    }
+
+    printf("%s: %d of %d blocks differ from the baseline encoder.\n",
+           Urtp::getAudioCodingName(audioCoding), numDiffering, CODING_TEST_NUM_BLOCKS);
+
+    return (numDiffering == 0);
+}
+
+// Check the block-at-a-time encoder against the baseline one.
+static bool baselineTest()
+{
+    bool success = baselineCompare(Urtp::PCM_SIGNED_16_BIT, baselineCodePcm);
+
+    if (!baselineCompare(Urtp::UNICAM_COMPRESSED_8_BIT, baselineCodeUnicam)) {
+        success = false;
+    }
+
+    return success;
+}
+
+// Gain and pre-emphasis, as the baseline encoder does them, giving
+// the samples that a UNICAM decoder should get back.
+static void baselinePreemphasise(Baseline *b, int *filteredSamples)
+{
+    int monoSample;
+
+    for (int x = 0; x < SAMPLES_PER_BLOCK; x++) {
+        monoSample = baselineProcessAudio(b, gSamples[x]) >> (32 - UNICAM_MAX_DECODED_SAMPLE_SIZE_BITS);
+        firProcessBlock(&b->preemphasis, &monoSample, filteredSamples + x, 1);
+    }
+}
+
+// Unpack numBlocks UNICAM blocks of codedBits samples, the reverse
+// of packUnicamBlocks() in urtp.cpp, putting the samples into
+// samples and the shift of each block into shifts and returning
+// the number of bytes read.  An odd block on the end would have
+// a shift byte of its own, with the shift in the low nibble.
+static int unpackUnicamBlocks(const char *body, int numBlocks, int codedBits,
+                              int *samples, int *shifts)
+{
+    const unsigned char *pBody = (const unsigned char *) body;
+    int blockSize = ((SAMPLES_PER_UNICAM_BLOCK * codedBits) + 7) / 8;
+    unsigned int accumulator;
+    int numBits;
+    int sample;
+
+    for (int x = 0; x < numBlocks; x++) {
+        // The shift byte follows an even block and comes
+        // before an odd one
+        if ((x & 1) == 0) {
+            shifts[x] = *(pBody + blockSize) & 0x0F;
+        } else {
+            shifts[x] = *pBody >> 4;
+            pBody++;
+        }
+        // Each block starts on a byte boundary, most significant
+        // bit first; sign extend each sample then shift it back up
+        accumulator = 0;
+        numBits = 0;
+        for (int y = 0; y < SAMPLES_PER_UNICAM_BLOCK; y++) {
+            while (numBits < codedBits) {
+                accumulator = (accumulator << 8) | *pBody;
+                pBody++;
+                numBits += 8;
+            }
+            numBits -= codedBits;
+            sample = (int) ((accumulator >> numBits) << (32 - codedBits)) >> (32 - codedBits);
+            samples[(x * SAMPLES_PER_UNICAM_BLOCK) + y] = sample << shifts[x];
+        }
+    }
+    if ((numBlocks & 1) != 0) {
+        pBody++;
+    }
+
+    return pBody - (const unsigned char *) body;
+}
+
+// Code the synthetic audio with a UNICAM coding and unpack it
+// again, checking that the body is the length it should be and
+// that every sample is within what the shift of its block lost.
+static bool unicamDecodeTest(Urtp::AudioCoding audioCoding, int codedBits, int bodySize)
+{
+    Urtp urtp(NULL);
+    Baseline baseline;
+    int filteredSamples[SAMPLES_PER_BLOCK];
+    int samples[SAMPLES_PER_BLOCK];
+    int shifts[UNICAM_BLOCKS_PER_BLOCK];
+    const char *pDatagram;
+    int numBytes;
+    int error;
+    int maxError = 0;
+    int maxShift = 0;
+    int numBad = 0;
+    uint32_t seed = 1;
+
+    urtp.init(gDatagramStorage);
+    urtp.setAudioCoding(audioCoding);
+    baselineInit(&baseline);
+    for (int block = 0; block < CODING_TEST_NUM_BLOCKS; block++) {
+        makeBlock(block, &seed);
+        urtp.codeAudioBlock(gRawStereoS32);
+        baselinePreemphasise(&baseline, filteredSamples);
+        pDatagram = urtp.getUrtpDatagram();
+        if (pDatagram == NULL) {
+            numBad++;
+            continue;
+        }
+        numBytes = unpackUnicamBlocks(pDatagram + URTP_HEADER_SIZE, UNICAM_BLOCKS_PER_BLOCK,
+                                      codedBits, samples, shifts);
+        if ((numBytes != bodySize) || (Urtp::getDatagramSize(pDatagram) != URTP_HEADER_SIZE + bodySize)) {
+            numBad++;
+        }
+        // Shifting down rounds towards minus infinity, so
+        // what comes back is never more than went in
+        for (int x = 0; x < SAMPLES_PER_BLOCK; x++) {
+            error = filteredSamples[x] - samples[x];
+            if ((error < 0) || (error >= (1 << shifts[x / SAMPLES_PER_UNICAM_BLOCK]))) {
+                numBad++;
+            }
+            if (error > maxError) {
+                maxError = error;
+            }
+        }
+        for (int x = 0; x < UNICAM_BLOCKS_PER_BLOCK; x++) {
+            if (shifts[x] > maxShift) {
+                maxShift = shifts[x];
+            }
+        }
+        urtp.setUrtpDatagramAsRead(pDatagram);
+    }
+
+    printf("%s: decoded, largest error %d, largest shift %d, %d bad.\n",
+           Urtp::getAudioCodingName(audioCoding), maxError, maxShift, numBad);
+
+    return (numBad == 0) && (maxShift > 0);
+}
+
+// Unpack each of the UNICAM codings.
+static bool unicamTest()
+{
+    bool success = unicamDecodeTest(Urtp::UNICAM_COMPRESSED_8_BIT, 8, URTP_UNICAM_BODY_SIZE);
+
+    if (!unicamDecodeTest(Urtp::UNICAM_COMPRESSED_6_BIT, 6, URTP_UNICAM_6_BODY_SIZE)) {
+        success = false;
+    }
+
+    if (!unicamDecodeTest(Urtp::UNICAM_COMPRESSED_4_BIT, 4, URTP_UNICAM_4_BODY_SIZE)) {
+        success = false;
+    }
+
+    return success;
+}
+
+// Make the synthetic audio for a block for the Rice test: the
+// usual audio, with silence, full-scale alternating sign and
+// alternating sign at a stepping level mixed in, so that every
+// Rice parameter gets used.
+static void makeRiceBlock(int block, uint32_t *pSeed)
+{
+    int level = (block / 8) % 24;
+
+    switch (block % 8) {
+        case 0:
+            memset(gSamples, 0, sizeof(gSamples));
+            makeRawBlock();
+        break;
+        case 1:
+            for (int i = 0; i < SAMPLES_PER_BLOCK; i++) {
+                gSamples[i] = (i & 1) ? SAMPLE_24_BIT_MAX : -SAMPLE_24_BIT_MAX - 1;
+            }
+            makeRawBlock();
+        break;
+        case 2:
+            for (int i = 0; i < SAMPLES_PER_BLOCK; i++) {
+                gSamples[i] = (i & 1) ? (1 << level) : -(1 << level);
+            }
+            makeRawBlock();
+        break;
+        default:
+            makeBlock(block, pSeed);
+        break;
+    }
+}
+
+// Read numBits from body, most significant bit first, starting
+// at bit *pBitIndex, which is moved on.
+static unsigned int readBits(const char *body, int *pBitIndex, int numBits)
+{
+    unsigned int value = 0;
+
+    for (int x = 0; x < numBits; x++) {
+        value = (value << 1) | ((((unsigned char) body[*pBitIndex / 8]) >> (7 - (*pBitIndex % 8))) & 1);
+        (*pBitIndex)++;
+    }
+
+    return value;
+}
+
+// Decode a UNICAM_RICE_8_BIT body, the reverse of
+// codeUnicamRice() in urtp.cpp, putting the samples, shifted
+// back up, into samples and the shift and Rice parameter of
+// each block into shifts and ks, returning the number of bytes
+// read.
+static int riceDecodeBlocks(const char *body, int *samples, int *shifts, int *ks)
+{
+    int bitIndex = 0;
+    unsigned int header;
+    unsigned int mapped;
+    unsigned int quotient;
+    int sample;
+
+    for (int x = 0; x < UNICAM_BLOCKS_PER_BLOCK; x++) {
+        header = readBits(body, &bitIndex, 8);
+        shifts[x] = header >> 4;
+        ks[x] = header & 0x0F;
+        for (int y = 0; y < SAMPLES_PER_UNICAM_BLOCK; y++) {
+            if (ks[x] == 0x0F) {
+                // The escape: plain 8 bit samples
+                sample = (signed char) readBits(body, &bitIndex, 8);
+            } else {
+                // The quotient in unary, ones ended by a zero,
+                // then k bits of remainder, then unfold the sign
+                quotient = 0;
+                while (readBits(body, &bitIndex, 1) != 0) {
+                    quotient++;
+                }
+                mapped = (quotient << ks[x]) | readBits(body, &bitIndex, ks[x]);
+                sample = (mapped & 1) ? -(int) ((mapped + 1) >> 1) : (int) (mapped >> 1);
+            }
+            samples[(x * SAMPLES_PER_UNICAM_BLOCK) + y] = sample << shifts[x];
+        }
+    }
+
+    return (bitIndex + 7) / 8;
+}
+
+// Code the same audio as UNICAM_RICE_8_BIT and as
+// UNICAM_COMPRESSED_8_BIT, decode both and check that they
+// match exactly.
+static bool riceTest()
+{
+    Urtp urtp(NULL);
+    Urtp urtpUnicam(NULL);
+    int riceSamples[SAMPLES_PER_BLOCK];
+    int riceShifts[UNICAM_BLOCKS_PER_BLOCK];
+    int ks[UNICAM_BLOCKS_PER_BLOCK];
+    int samples[SAMPLES_PER_BLOCK];
+    int shifts[UNICAM_BLOCKS_PER_BLOCK];
+    int kCount[16] = {0};
+    const char *pDatagram;
+    const char *pDatagramUnicam;
+    int numBytes;
+    int numBad = 0;
+    uint32_t seed = 1;
+    bool success = true;
+
+    urtp.init(gDatagramStorage);
+    urtp.setAudioCoding(Urtp::UNICAM_RICE_8_BIT);
+    urtpUnicam.init(gSecondDatagramStorage);
+    urtpUnicam.setAudioCoding(Urtp::UNICAM_COMPRESSED_8_BIT);
+    for (int block = 0; block < CODING_TEST_NUM_BLOCKS; block++) {
+        makeRiceBlock(block, &seed);
+        urtp.codeAudioBlock(gRawStereoS32);
+        urtpUnicam.codeAudioBlock(gRawStereoS32);
+        pDatagram = urtp.getUrtpDatagram();
+        pDatagramUnicam = urtpUnicam.getUrtpDatagram();
+        if ((pDatagram == NULL) || (pDatagramUnicam == NULL)) {
+            numBad++;
+            continue;
+        }
+        numBytes = riceDecodeBlocks(pDatagram + URTP_HEADER_SIZE, riceSamples, riceShifts, ks);
+        unpackUnicamBlocks(pDatagramUnicam + URTP_HEADER_SIZE, UNICAM_BLOCKS_PER_BLOCK, 8, samples, shifts);
+        if ((Urtp::getDatagramSize(pDatagram) != URTP_HEADER_SIZE + numBytes) ||
+            (numBytes > URTP_UNICAM_RICE_BODY_SIZE) ||
+            (memcmp(riceSamples, samples, sizeof(samples)) != 0) ||
+            (memcmp(riceShifts, shifts, sizeof(shifts)) != 0)) {
+            numBad++;
+        }
+        for (int x = 0; x < UNICAM_BLOCKS_PER_BLOCK; x++) {
+            kCount[ks[x]]++;
+        }
+        urtp.setUrtpDatagramAsRead(pDatagram);
+        urtpUnicam.setUrtpDatagramAsRead(pDatagramUnicam);
+    }
+
+    printf("unicamrice: decoded, %d bad; blocks with k", numBad);
+    for (int x = 0; x < 7; x++) {
+        printf(" %d: %d,", x, kCount[x]);
+        if (kCount[x] == 0) {
+            success = false;
+        }
+    }
+    printf(" escaped: %d.\n", kCount[0x0F]);
+    if (kCount[0x0F] == 0) {
+        success = false;
+    }
+
+    return success && (numBad == 0);
+}
+
+// Make the synthetic audio for a block for the LPC test: the
+// usual audio alternating, every 100 blocks, with a tone of
+// a stepping level and a period of LPC_TEST_TONE_PERIOD
+// samples, which survives the pre-emphasis and suits the
+// higher order predictors.
+static void makeLpcBlock(int block, uint32_t *pSeed)
+{
+    int level = (block / 100) % 12;
+
+    if ((block / 100) % 2 == 0) {
+        makeBlock(block, pSeed);
+    } else {
+        for (int i = 0; i < SAMPLES_PER_BLOCK; i++) {
+            gSamples[i] = (int) (sin((2 * M_PI * ((block * SAMPLES_PER_BLOCK) + i)) / LPC_TEST_TONE_PERIOD) *
+                                 (1 << (level + 10)));
+        }
+        makeRawBlock();
+    }
+}
+
+// Limit a sample to 16 bits, as the LPC decoder does.
+static int limit16(int sample)
+{
+    if (sample > 32767) {
+        sample = 32767;
+    } else if (sample < -32768) {
+        sample = -32768;
+    }
+
+    return sample;
+}
+
+// Code the synthetic audio as LPC_RESIDUAL_6_BIT and decode it
+// again, carrying the predictor over from one datagram to the
+// next as a receiver would, checking that the history at the
+// start of each datagram is where the decoder got to and that
+// every sample is within the bound that its block's shift sets.
+static bool lpcTest()
+{
+    Urtp urtp(NULL);
+    Baseline baseline;
+    int filteredSamples[SAMPLES_PER_BLOCK];
+    int residuals[SAMPLES_PER_BLOCK];
+    int shifts[UNICAM_BLOCKS_PER_BLOCK];
+    int orderCount[URTP_LPC_MAX_ORDER + 1] = {0};
+    int history[2] = {0, 0};
+    const unsigned char *pBody;
+    const char *pDatagram;
+    int order;
+    int numBytes;
+    int decoded;
+    int error;
+    int maxError = 0;
+    int numBad = 0;
+    uint32_t seed = 1;
+    bool success = true;
+
+    urtp.init(gDatagramStorage);
+    urtp.setAudioCoding(Urtp::LPC_RESIDUAL_6_BIT);
+    baselineInit(&baseline);
+    for (int block = 0; block < CODING_TEST_NUM_BLOCKS; block++) {
+        makeLpcBlock(block, &seed);
+        urtp.codeAudioBlock(gRawStereoS32);
+        baselinePreemphasise(&baseline, filteredSamples);
+        pDatagram = urtp.getUrtpDatagram();
+        if (pDatagram == NULL) {
+            numBad++;
+            continue;
+        }
+        pBody = (const unsigned char *) pDatagram + URTP_HEADER_SIZE;
+        order = pBody[0];
+        if (order > URTP_LPC_MAX_ORDER) {
+            printf("lpc: block %d, predictor order %d.\n", block, order);
+            success = false;
+            order = 0;
+        }
+        orderCount[order]++;
+        for (int y = 0; y < 2; y++) {
+            if ((int16_t) ((pBody[1 + (y * 2)] << 8) | pBody[2 + (y * 2)]) != history[y]) {
+                printf("lpc: block %d, history sample %d is %d, decoder has %d.\n", block, y,
+                       (int16_t) ((pBody[1 + (y * 2)] << 8) | pBody[2 + (y * 2)]), history[y]);
+                success = false;
+            }
+        }
+        numBytes = 5 + unpackUnicamBlocks((const char *) pBody + 5, UNICAM_BLOCKS_PER_BLOCK,
+                                          URTP_LPC_CODED_SAMPLE_SIZE_BITS, residuals, shifts);
+        if ((numBytes != URTP_LPC_BODY_SIZE) ||
+            (Urtp::getDatagramSize(pDatagram) != URTP_HEADER_SIZE + URTP_LPC_BODY_SIZE)) {
+            numBad++;
+        }
+        for (int x = 0; x < SAMPLES_PER_BLOCK; x++) {
+            if (order == 1) {
+                decoded = history[1];
+            } else if (order == 2) {
+                decoded = (history[1] << 1) - history[0];
+            } else {
+                decoded = 0;
+            }
+            decoded = limit16(decoded + residuals[x]);
+            history[0] = history[1];
+            history[1] = decoded;
+            // The residual is rounded to the shift and coded
+            // against what the decoder has, so the error
+            // doesn't build up from one sample to the next
+            error = abs(decoded - limit16(filteredSamples[x]));
+            if (error >= (1 << shifts[x / SAMPLES_PER_UNICAM_BLOCK])) {
+                numBad++;
+            }
+            if (error > maxError) {
+                maxError = error;
+            }
+        }
+        urtp.setUrtpDatagramAsRead(pDatagram);
+    }
+
+    printf("lpc: decoded, largest error %d, %d bad; datagrams with order", maxError, numBad);
+    for (int y = 0; y <= URTP_LPC_MAX_ORDER; y++) {
+        printf(" %d: %d%s", y, orderCount[y], (y < URTP_LPC_MAX_ORDER) ? "," : ".\n");
+        if (orderCount[y] == 0) {
+            success = false;
+        }
+    }
+
+    return success && (numBad == 0);
+}
+
+// Multiply two bytes in GF(2^8) with the polynomial 0x11D.
+static unsigned char gfMultiply(unsigned char a, unsigned char b)
+{
+    unsigned char product = 0;
+
+    while (b != 0) {
+        if (b & 1) {
+            product ^= a;
+        }
+        a = (unsigned char) ((a << 1) ^ ((a & 0x80) ? 0x1D : 0));
+        b >>= 1;
+    }
+
+    return product;
+}
+
+// 2 to the power n in GF(2^8).
+static unsigned char gfPower2(int n)
+{
+    unsigned char value = 1;
+
+    for (int x = 0; x < n; x++) {
+        value = gfMultiply(value, 2);
+    }
+
+    return value;
+}
+
+// The inverse of a non-zero byte in GF(2^8), the slow way.
+static unsigned char gfInverse(unsigned char a)
+{
+    unsigned char inverse = 0;
+
+    for (int x = 1; (x < 256) && (inverse == 0); x++) {
+        if (gfMultiply(a, (unsigned char) x) == 1) {
+            inverse = (unsigned char) x;
+        }
+    }
+
+    return inverse;
+}
+
+// Rebuild datagram lost1 of the group in gFecGroup from the
+// others and P or, if lost2 is not negative, datagrams lost1
+// and lost2 from the others, P and Q, checking that what comes
+// back is the original, padded with zeroes to length.
+static bool fecRebuild(const unsigned char *p, const unsigned char *q, int length,
+                       int lost1, int lost2)
+{
+    unsigned char pSum[URTP_FEC_PROTECTED_SIZE];
+    unsigned char qSum[URTP_FEC_PROTECTED_SIZE];
+    unsigned char rebuilt[2][URTP_FEC_PROTECTED_SIZE];
+    const unsigned char *bytes;
+    unsigned char weight;
+    unsigned char inverse;
+    int lost[2] = {lost1, lost2};
+    int numBytes;
+    bool success = true;
+
+    // Take the datagrams that got through out of the parity,
+    // leaving that of those that didn't
+    memcpy(pSum, p, length);
+    if (q != NULL) {
+        memcpy(qSum, q, length);
+    }
+    for (int x = 0; x < FEC_TEST_GROUP_SIZE; x++) {
+        if ((x != lost1) && (x != lost2)) {
+            bytes = (const unsigned char *) gFecGroup[x] + 1;
+            numBytes = Urtp::getDatagramSize(gFecGroup[x]) - 1;
+            weight = gfPower2(FEC_TEST_GROUP_SIZE - 1 - x);
+            for (int y = 0; y < numBytes; y++) {
+                pSum[y] ^= bytes[y];
+                if (q != NULL) {
+                    qSum[y] ^= gfMultiply(weight, bytes[y]);
+                }
+            }
+        }
+    }
+
+    if (lost2 < 0) {
+        memcpy(rebuilt[0], pSum, length);
+    } else {
+        // What is left of P is d1 + d2 and of Q is a.d1 + b.d2,
+        // so d1 is (Q + b.P) / (a + b) and d2 is P + d1
+        weight = gfPower2(FEC_TEST_GROUP_SIZE - 1 - lost2);
+        inverse = gfInverse(gfPower2(FEC_TEST_GROUP_SIZE - 1 - lost1) ^ weight);
+        for (int y = 0; y < length; y++) {
+            rebuilt[0][y] = gfMultiply(qSum[y] ^ gfMultiply(weight, pSum[y]), inverse);
+            rebuilt[1][y] = pSum[y] ^ rebuilt[0][y];
+        }
+    }
+
+    for (int x = 0; (x < 2) && (lost[x] >= 0); x++) {
+        numBytes = Urtp::getDatagramSize(gFecGroup[lost[x]]) - 1;
+        if (memcmp(rebuilt[x], gFecGroup[lost[x]] + 1, numBytes) != 0) {
+            success = false;
+        }
+        for (int y = numBytes; y < length; y++) {
+            if (rebuilt[x][y] != 0) {
+                success = false;
+            }
+        }
+    }
+
+    return success;
+}
+
+// Take a datagram in the FEC test: keep audio, and once a
+// group's PARITY arrives, lose each datagram of it, and with Q
+// each pair, and rebuild them.
+static void fecReceive(FecReceiver *pReceiver, const char *pDatagram)
+{
+    const unsigned char *pBody = (const unsigned char *) pDatagram + URTP_HEADER_SIZE;
+    int length = Urtp::getDatagramSize(pDatagram) - URTP_HEADER_SIZE - 2;
+    int maxLength = 0;
+    bool complete = true;
+
+    if ((pDatagram[1] & 0x0F) != Urtp::PARITY) {
+        if (pReceiver->numHeld == FEC_TEST_GROUP_SIZE) {
+            memmove(gFecGroup[0], gFecGroup[1], sizeof(gFecGroup[0]) * (FEC_TEST_GROUP_SIZE - 1));
+            pReceiver->numHeld--;
+        }
+        memcpy(gFecGroup[pReceiver->numHeld], pDatagram, Urtp::getDatagramSize(pDatagram));
+        pReceiver->numHeld++;
+        pReceiver->lastSequenceNumber = sequenceNumber(pDatagram);
+        return;
+    }
+
+    pReceiver->numParity++;
+    if (pReceiver->firstParitySequenceNumber < 0) {
+        pReceiver->firstParitySequenceNumber = sequenceNumber(pDatagram);
+    }
+    if ((pBody[0] != FEC_TEST_GROUP_SIZE) || (pBody[1] > 1)) {
+        pReceiver->numBad++;
+        return;
+    }
+
+    // The group is the datagrams from the sequence number of
+    // the PARITY on, unless some went missing on the way
+    if (pReceiver->numHeld < FEC_TEST_GROUP_SIZE) {
+        complete = false;
+    }
+    for (int x = 0; (x < pReceiver->numHeld) && complete; x++) {
+        if (sequenceNumber(gFecGroup[x]) != ((sequenceNumber(pDatagram) + x) & 0xFFFF)) {
+            complete = false;
+        }
+        if (Urtp::getDatagramSize(gFecGroup[x]) - 1 > maxLength) {
+            maxLength = Urtp::getDatagramSize(gFecGroup[x]) - 1;
+        }
+    }
+    if (!complete) {
+        pReceiver->numUnchecked++;
+        return;
+    }
+    if (length != maxLength) {
+        pReceiver->numBad++;
+        return;
+    }
+
+    if (pBody[1] == 0) {
+        memcpy(pReceiver->p, pBody + 2, length);
+        pReceiver->pSequenceNumber = sequenceNumber(pDatagram);
+        pReceiver->pLength = length;
+        for (int x = 0; x < FEC_TEST_GROUP_SIZE; x++) {
+            if (!fecRebuild(pReceiver->p, NULL, length, x, -1)) {
+                pReceiver->numBad++;
+            }
+        }
+        pReceiver->numRebuiltP++;
+    } else if ((pReceiver->pSequenceNumber == sequenceNumber(pDatagram)) && (pReceiver->pLength == length)) {
+        for (int x = 0; x < FEC_TEST_GROUP_SIZE; x++) {
+            for (int y = x + 1; y < FEC_TEST_GROUP_SIZE; y++) {
+                if (!fecRebuild(pReceiver->p, pBody + 2, length, x, y)) {
+                    pReceiver->numBad++;
+                }
+            }
+        }
+        pReceiver->numRebuiltPQ++;
+    } else {
+        // Q without its P
+        pReceiver->numBad++;
+    }
+}
+
+// Code a number of blocks for the FEC test, reading each
+// datagram straight out into the receiver.
+static void fecCodeBlocks(Urtp *pUrtp, FecReceiver *pReceiver, int *pBlock,
+                          int numBlocks, uint32_t *pSeed)
+{
+    const char *pDatagram;
+
+    for (int x = 0; x < numBlocks; x++) {
+        makeRiceBlock(*pBlock, pSeed);
+        (*pBlock)++;
+        pUrtp->codeAudioBlock(gRawStereoS32);
+        while ((pDatagram = pUrtp->getUrtpDatagram()) != NULL) {
+            fecReceive(pReceiver, pDatagram);
+            pUrtp->setUrtpDatagramAsRead(pDatagram);
+        }
+    }
+}
+
+// Run forward error correction with P and Q, losing datagrams
+// and rebuilding them, then with the store full, so that
+// parity is skipped, then with a datagram dropped.
+static bool fecTest()
+{
+    Urtp urtp(NULL);
+    FecReceiver receiver;
+    const char *pDatagram;
+    const char *pHeld;
+    int numStored = 0;
+    int numInGroup = 0;
+    int numSkipped = 0;
+    int numParity;
+    int groupSequenceNumber;
+    int droppedSequenceNumber;
+    int block = 0;
+    uint32_t seed = 1;
+    bool success = true;
+
+    memset(&receiver, 0, sizeof(receiver));
+    receiver.firstParitySequenceNumber = -1;
+    if (!urtp.init(gDatagramStorage) || !urtp.setAudioCoding(Urtp::UNICAM_RICE_8_BIT) ||
+        !urtp.setFec(FEC_TEST_GROUP_SIZE, 2)) {
+        printf("FEC: unable to start URTP.\n");
+        return false;
+    }
+
+    // Every group has its P and Q and every loss of one or
+    // two datagrams of it can be made good
+    fecCodeBlocks(&urtp, &receiver, &block, FEC_TEST_NUM_BLOCKS, &seed);
+    if ((receiver.numRebuiltP != FEC_TEST_NUM_BLOCKS / FEC_TEST_GROUP_SIZE) ||
+        (receiver.numRebuiltPQ != FEC_TEST_NUM_BLOCKS / FEC_TEST_GROUP_SIZE) ||
+        (receiver.numUnchecked != 0) || (receiver.numBad != 0)) {
+        printf("FEC: %d groups rebuilt from P, %d from P and Q, %d unchecked, %d bad, expected %d.\n",
+               receiver.numRebuiltP, receiver.numRebuiltPQ, receiver.numUnchecked, receiver.numBad,
+               FEC_TEST_NUM_BLOCKS / FEC_TEST_GROUP_SIZE);
+        success = false;
+    }
+
+    // Stop reading: once the store is full parity is skipped
+    // rather than push out audio (audio pushes out the oldest)
+    for (int x = 0; x < MAX_NUM_DATAGRAMS * 2; x++) {
+        makeRiceBlock(block, &seed);
+        block++;
+        urtp.codeAudioBlock(gRawStereoS32);
+        if (numStored < MAX_NUM_DATAGRAMS) {
+            numStored++;
+        }
+        numInGroup++;
+        if (numInGroup == FEC_TEST_GROUP_SIZE) {
+            for (int y = 0; y < 2; y++) {
+                if (numStored < MAX_NUM_DATAGRAMS) {
+                    numStored++;
+                } else {
+                    numSkipped++;
+                }
+            }
+            numInGroup = 0;
+        }
+    }
+    if ((urtp.getNumFecSkipped() != (unsigned int) numSkipped) || (numSkipped == 0)) {
+        printf("FEC: %u PARITY datagrams skipped, expected %d.\n", urtp.getNumFecSkipped(), numSkipped);
+        success = false;
+    }
+
+    // Start a group, then, with the store full and the oldest
+    // datagram held, code a block, which is dropped: the group
+    // is cut short, so it gets no parity, and the next group
+    // starts after the dropped datagram
+    while ((pDatagram = urtp.getUrtpDatagram()) != NULL) {
+        urtp.setUrtpDatagramAsRead(pDatagram);
+    }
+    receiver.numHeld = 0;
+    fecCodeBlocks(&urtp, &receiver, &block, FEC_TEST_GROUP_SIZE - 2, &seed);
+    groupSequenceNumber = receiver.lastSequenceNumber - (FEC_TEST_GROUP_SIZE - 3);
+    while (urtp.getUrtpDatagramsFree() > 0) {
+        makeRiceBlock(block, &seed);
+        block++;
+        urtp.codeAudioBlock(gRawStereoS32);
+    }
+    pHeld = urtp.getUrtpDatagram();
+    makeRiceBlock(block, &seed);
+    block++;
+    urtp.codeAudioBlock(gRawStereoS32);
+    fecReceive(&receiver, pHeld);
+    urtp.setUrtpDatagramAsRead(pHeld);
+    while ((pDatagram = urtp.getUrtpDatagram()) != NULL) {
+        fecReceive(&receiver, pDatagram);
+        urtp.setUrtpDatagramAsRead(pDatagram);
+    }
+    droppedSequenceNumber = (receiver.lastSequenceNumber + 1) & 0xFFFF;
+    if (((droppedSequenceNumber - groupSequenceNumber) & 0xFFFF) % FEC_TEST_GROUP_SIZE == 0) {
+        printf("FEC: the dropped datagram didn't cut a group short.\n");
+        success = false;
+    }
+    receiver.firstParitySequenceNumber = -1;
+    receiver.numRebuiltP = 0;
+    receiver.numRebuiltPQ = 0;
+    fecCodeBlocks(&urtp, &receiver, &block, FEC_TEST_NUM_BLOCKS, &seed);
+    if ((receiver.firstParitySequenceNumber != ((droppedSequenceNumber + 1) & 0xFFFF)) ||
+        (receiver.numRebuiltP != FEC_TEST_NUM_BLOCKS / FEC_TEST_GROUP_SIZE) ||
+        (receiver.numRebuiltPQ != FEC_TEST_NUM_BLOCKS / FEC_TEST_GROUP_SIZE) ||
+        (receiver.numUnchecked != 0) || (receiver.numBad != 0)) {
+        printf("FEC: after the dropped datagram, %d, first PARITY is for %d, %d groups rebuilt from P,"
+               " %d from P and Q, %d unchecked, %d bad.\n", droppedSequenceNumber,
+               receiver.firstParitySequenceNumber, receiver.numRebuiltP, receiver.numRebuiltPQ,
+               receiver.numUnchecked, receiver.numBad);
+        success = false;
+    }
+
+    // A group cut short by the end gets no parity either
+    numParity = receiver.numParity;
+    fecCodeBlocks(&urtp, &receiver, &block, FEC_TEST_GROUP_SIZE - 1, &seed);
+    if (receiver.numParity != numParity) {
+        printf("FEC: PARITY sent for an incomplete group.\n");
+        success = false;
+    }
+
+    printf("FEC: group of %d, %d lost datagrams rebuilt from P and %d pairs from P and Q, %u PARITY skipped, %s.\n",
+           FEC_TEST_GROUP_SIZE, FEC_TEST_NUM_BLOCKS * 2, (FEC_TEST_NUM_BLOCKS * 2 / FEC_TEST_GROUP_SIZE) *
+           (FEC_TEST_GROUP_SIZE * (FEC_TEST_GROUP_SIZE - 1) / 2), urtp.getNumFecSkipped(),
+           success ? "OK" : "FAILED");
+
+    return success;
+}
+
+// Get the timestamp from a datagram.
+static long long int timestamp(const char *pDatagram)
+{
+    long long int value = 0;
+
+    for (int x = 4; x < 12; x++) {
+        value = (value << 8) | (unsigned char) pDatagram[x];
+    }
+
+    return value;
+}
+
+// Code the synthetic audio, with stretches of silence, with an
+// audio coding scheme, with redundancy and discontinuous
+// transmission, and take the REDUNDANT datagrams apart again,
+// checking the lengths, that the primary payload is what the
+// coding scheme gives alone and that the copy of the previous
+// block is there when it should be and decodes to that block.
+static bool redundantTest(Urtp::AudioCoding audioCoding, int primarySize)
+{
+    Urtp urtp(NULL);
+    Urtp urtpPrimary(NULL);
+    Baseline baseline;
+    int monoSamples[SAMPLES_PER_BLOCK];
+    int reference[SAMPLES_PER_BLOCK / 2];
+    int previousReference[SAMPLES_PER_BLOCK / 2];
+    int samples[SAMPLES_PER_BLOCK / 2];
+    int shifts[UNICAM_BLOCKS_PER_BLOCK / 2];
+    const unsigned char *pBody;
+    const unsigned char *pPrimary;
+    const char *pDatagram;
+    const char *pDatagramPrimary;
+    int previousSequenceNumber = -1;
+    long long int previousTimestamp = 0;
+    bool previousSent = false;
+    int payloadLength;
+    int primaryLength;
+    int copyLength;
+    int error;
+    int maxError = 0;
+    int numCopies = 0;
+    int numSilence = 0;
+    int numBad = 0;
+    uint32_t seed = 1;
+
+    urtp.init(gDatagramStorage);
+    urtp.setAudioCoding(audioCoding);
+    urtp.setRedundancy(true);
+    urtp.setDtx(true);
+    urtpPrimary.init(gSecondDatagramStorage);
+    urtpPrimary.setAudioCoding(audioCoding);
+    urtpPrimary.setDtx(true);
+    baselineInit(&baseline);
+    for (int block = 0; block < CODING_TEST_NUM_BLOCKS; block++) {
+        if (block % 100 >= 100 - REDUNDANT_TEST_NUM_SILENT_BLOCKS) {
+            memset(gSamples, 0, sizeof(gSamples));
+            makeRawBlock();
+        } else {
+            makeBlock(block, &seed);
+        }
+        urtp.codeAudioBlock(gRawStereoS32);
+        urtpPrimary.codeAudioBlock(gRawStereoS32);
+
+        // The copy is of the samples with gain applied, scaled
+        // down to 16 bits and decimated by two
+        for (int x = 0; x < SAMPLES_PER_BLOCK; x++) {
+            monoSamples[x] = baselineProcessAudio(&baseline, gSamples[x]) >> (32 - UNICAM_MAX_DECODED_SAMPLE_SIZE_BITS);
+        }
+        for (int x = 0; x < SAMPLES_PER_BLOCK / 2; x++) {
+            reference[x] = (monoSamples[x * 2] + monoSamples[(x * 2) + 1]) >> 1;
+        }
+
+        pDatagram = urtp.getUrtpDatagram();
+        pDatagramPrimary = urtpPrimary.getUrtpDatagram();
+        if ((pDatagram == NULL) || (pDatagramPrimary == NULL)) {
+            numBad++;
+            continue;
+        }
+        pBody = (const unsigned char *) pDatagram + URTP_HEADER_SIZE;
+        payloadLength = Urtp::getDatagramSize(pDatagram) - URTP_HEADER_SIZE;
+        if ((pDatagram[1] & 0x0F) == Urtp::SILENCE) {
+            if ((pDatagramPrimary[1] & 0x0F) != Urtp::SILENCE) {
+                numBad++;
+            }
+            numSilence++;
+            previousSent = false;
+        } else if (((pDatagram[1] & 0x0F) != Urtp::REDUNDANT) || (payloadLength < 3) ||
+                   (pBody[0] != audioCoding)) {
+            numBad++;
+            previousSent = false;
+        } else {
+            // First the primary block: its coding and length, then
+            // the payload, which must be what the coding alone gives
+            primaryLength = (pBody[1] << 8) | pBody[2];
+            pPrimary = pBody + 3;
+            if ((primaryLength != primarySize) ||
+                (Urtp::getDatagramSize(pDatagramPrimary) != URTP_HEADER_SIZE + primaryLength) ||
+                (memcmp(pPrimary, pDatagramPrimary + URTP_HEADER_SIZE, primaryLength) != 0)) {
+                numBad++;
+            }
+
+            // Then the copy of the previous block, which runs to the
+            // end of the payload: there only if the previous datagram,
+            // one block earlier, was sent and wasn't SILENCE
+            copyLength = payloadLength - 3 - primaryLength;
+            if (previousSent && (previousSequenceNumber == ((sequenceNumber(pDatagram) - 1) & 0xFFFF)) &&
+                (previousTimestamp <= timestamp(pDatagram))) {
+                if ((copyLength != URTP_REDUNDANT_COPY_SIZE) ||
+                    (unpackUnicamBlocks((const char *) pPrimary + primaryLength, UNICAM_BLOCKS_PER_BLOCK / 2,
+                                        URTP_REDUNDANT_CODED_SAMPLE_SIZE_BITS, samples, shifts) != copyLength)) {
+                    numBad++;
+                } else {
+                    for (int x = 0; x < SAMPLES_PER_BLOCK / 2; x++) {
+                        error = previousReference[x] - samples[x];
+                        if ((error < 0) || (error >= (1 << shifts[x / SAMPLES_PER_UNICAM_BLOCK]))) {
+                            numBad++;
+                        }
+                        if (error > maxError) {
+                            maxError = error;
+                        }
+                    }
+                    numCopies++;
+                }
+            } else if (copyLength != 0) {
+                numBad++;
+            }
+
+            // PCM_SIGNED_16_BIT carries the samples the copy is made
+            // from, so check that against the primary payload
+            if (audioCoding == Urtp::PCM_SIGNED_16_BIT) {
+                for (int x = 0; x < SAMPLES_PER_BLOCK / 2; x++) {
+                    if ((((int16_t) ((pPrimary[x * 4] << 8) | pPrimary[(x * 4) + 1]) +
+                          (int16_t) ((pPrimary[(x * 4) + 2] << 8) | pPrimary[(x * 4) + 3])) >> 1) != reference[x]) {
+                        numBad++;
+                    }
+                }
+            }
+            previousSent = true;
+        }
+        previousSequenceNumber = sequenceNumber(pDatagram);
+        previousTimestamp = timestamp(pDatagram);
+        memcpy(previousReference, reference, sizeof(previousReference));
+        urtp.setUrtpDatagramAsRead(pDatagram);
+        urtpPrimary.setUrtpDatagramAsRead(pDatagramPrimary);
+    }
+
+    printf("%s + redundancy: taken apart, %d copies, largest error %d, %d SILENCE, %d bad.\n",
+           Urtp::getAudioCodingName(audioCoding), numCopies, maxError, numSilence, numBad);
+
+    return (numBad == 0) && (numCopies > 0) && (numSilence > 0);
+}
+
+// Take apart the REDUNDANT datagrams of PCM and UNICAM.
+static bool redundantTests()
+{
+    bool success = redundantTest(Urtp::PCM_SIGNED_16_BIT, URTP_PCM_BODY_SIZE);
+
+    if (!redundantTest(Urtp::UNICAM_COMPRESSED_8_BIT, URTP_UNICAM_BODY_SIZE)) {
+        success = false;
+    }
+
+    return success;
+}
+
+// Run each coding scheme, with and without redundancy, with
+// forward error correction and a datagram store sized for only
+// that, checking that every datagram fits.
+static bool storeTest()
+{
+    bool success = true;
+    const char *pName;
+    unsigned int audioCodings;
+    const char *pDatagram;
+    int stride;
+    int size;
+    int maxSize;
+    uint32_t seed = 1;
+
+    if (Urtp::getDatagramStoreSize() != URTP_DATAGRAM_STORE_SIZE) {
+        printf("Datagram store with everything allowed is %d bytes, expected %d.\n",
+               Urtp::getDatagramStoreSize(), URTP_DATAGRAM_STORE_SIZE);
+        success = false;
+    }
+
+    for (int x = 0; x < Urtp::MAX_NUM_AUDIO_CODINGS; x++) {
+        for (int redundancy = 0; redundancy < 2; redundancy++) {
+            pName = Urtp::getAudioCodingName((Urtp::AudioCoding) x);
+            if (pName != NULL) {
+                Urtp urtp(NULL);
+                audioCodings = URTP_AUDIO_CODING_BIT(x);
+                stride = Urtp::getDatagramStoreSize(audioCodings, redundancy, true) / MAX_NUM_DATAGRAMS;
+                maxSize = 0;
+                if (!urtp.init(gDatagramStorage, AUDIO_MAX_SHIFT_BITS, audioCodings, redundancy, true) ||
+                    (urtp.getAudioCoding() != x) || !urtp.setRedundancy(redundancy) ||
+                    !urtp.setFec(2, URTP_FEC_MAX_NUM_PARITY)) {
+                    printf("%s%s: unable to start URTP.\n", pName, redundancy ? " + redundancy" : "");
+                    success = false;
+                }
+                // Nothing else may be switched on
+                if (urtp.setAudioCoding((Urtp::AudioCoding) ((x == Urtp::PCM_SIGNED_16_BIT) ?
+                                                             Urtp::UNICAM_COMPRESSED_8_BIT :
+                                                             Urtp::PCM_SIGNED_16_BIT)) ||
+                    (!redundancy && urtp.setRedundancy(true))) {
+                    printf("%s%s: could switch on something not allowed for.\n",
+                           pName, redundancy ? " + redundancy" : "");
+                    success = false;
+                }
+                for (int block = 0; block < CODING_TEST_NUM_BLOCKS; block++) {
+                    makeBlock(block, &seed);
+                    urtp.codeAudioBlock(gRawStereoS32);
+                    while ((pDatagram = urtp.getUrtpDatagram()) != NULL) {
+                        size = Urtp::getDatagramSize(pDatagram);
+                        if (size > maxSize) {
+                            maxSize = size;
+                        }
+                        urtp.setUrtpDatagramAsRead(pDatagram);
+                    }
+                }
+                printf("%s%s + FEC: datagram store %d bytes, largest datagram %d of %d bytes.\n",
+                       pName, redundancy ? " + redundancy" : "", stride * MAX_NUM_DATAGRAMS, maxSize, stride);
+                if (maxSize > stride) {
+                    printf("%s%s + FEC: datagram larger than the store has room for.\n",
+                           pName, redundancy ? " + redundancy" : "");
+                    success = false;
+                }
+            }
+        }
+    }
+
+    return success;
+}
+
+// Overflow stop callback for the ring tests.
+static void ringOverflowStopCb(int numOverflows)
+{
+    gRingNumOverflows += numOverflows;
+}
+
+// Take the datagram ring round and round in one thread, checking
+// what comes out, and the counts, against a model of it.
+static bool ringTest()
+{
+    Urtp urtp(NULL, NULL, ringOverflowStopCb);
+    struct iovec iov[MAX_NUM_DATAGRAMS];
+    const char *pDatagram;
+    int nextSequenceNumber = 0;
+    int frontSequenceNumber = 0;
+    int numStored = 0;
+    int numOverflows = 0;
+    int numDatagrams;
+    int numToWrite;
+    int numToFree;
+    int maxNumDatagrams = 1;
+    int numLostAtEnd = 0;
+    bool wrapped = false;
+    bool success = true;
+
+    gRingNumOverflows = 0;
+    if (!urtp.init(gDatagramStorage, AUDIO_MAX_SHIFT_BITS, URTP_AUDIO_CODING_BIT(Urtp::PCM_SIGNED_16_BIT), false, false)) {
+        printf("Ring: unable to start URTP.\n");
+        return false;
+    }
+    memset(gRawStereoS32, 0, sizeof(gRawStereoS32));
+
+    for (int lap = 0; (lap < RING_TEST_NUM_LAPS) && success; lap++) {
+        // Sometimes fill it part way, sometimes overfill it
+        numToWrite = lap % MAX_NUM_DATAGRAMS;
+        if (lap % 3 == 0) {
+            numToWrite = MAX_NUM_DATAGRAMS + (lap % 7);
+        }
+        for (int x = 0; x < numToWrite; x++) {
+            urtp.codeAudioBlock(gRawStereoS32);
+            if (numStored == MAX_NUM_DATAGRAMS) {
+                frontSequenceNumber = (frontSequenceNumber + 1) & 0xFFFF;
+                numOverflows++;
+            } else {
+                numStored++;
+            }
+            nextSequenceNumber = (nextSequenceNumber + 1) & 0xFFFF;
+            if (nextSequenceNumber == 0) {
+                wrapped = true;
+            }
+        }
+        if ((urtp.getUrtpDatagramsAvailable() != numStored) ||
+            (urtp.getUrtpDatagramsFree() != MAX_NUM_DATAGRAMS - numStored)) {
+            printf("Ring: lap %d, %d datagrams available and %d free, expected %d and %d.\n",
+                   lap, urtp.getUrtpDatagramsAvailable(), urtp.getUrtpDatagramsFree(),
+                   numStored, MAX_NUM_DATAGRAMS - numStored);
+            success = false;
+        }
+
+        // When full, hold the oldest: the next block must be
+        // thrown away rather than overwrite it
+        if ((lap % 5 == 0) && (numStored == MAX_NUM_DATAGRAMS)) {
+            pDatagram = urtp.getUrtpDatagram();
+            urtp.codeAudioBlock(gRawStereoS32);
+            nextSequenceNumber = (nextSequenceNumber + 1) & 0xFFFF;
+            numOverflows++;
+            if ((pDatagram == NULL) || (sequenceNumber(pDatagram) != frontSequenceNumber) ||
+                (urtp.getUrtpDatagramsAvailable() != MAX_NUM_DATAGRAMS)) {
+                printf("Ring: lap %d, held datagram overwritten.\n", lap);
+                success = false;
+            }
+            urtp.setUrtpDatagramAsRead(pDatagram);
+            frontSequenceNumber = (frontSequenceNumber + 1) & 0xFFFF;
+            numStored--;
+            numLostAtEnd = 1;
+        }
+
+        // Read them all back in batches of various sizes,
+        // freeing only some of each batch; the rest must
+        // come back first next time
+        while ((numDatagrams = urtp.getUrtpDatagrams(iov, maxNumDatagrams)) > 0) {
+            for (int x = 0; x < numDatagrams; x++) {
+                if (sequenceNumber((const char *) iov[x].iov_base) != ((frontSequenceNumber + x) & 0xFFFF)) {
+                    printf("Ring: lap %d, datagram %d of batch is sequence number %d, expected %d.\n", lap, x,
+                           sequenceNumber((const char *) iov[x].iov_base), (frontSequenceNumber + x) & 0xFFFF);
+                    success = false;
+                }
+            }
+            numToFree = (numDatagrams + 1) / 2;
+            urtp.setUrtpDatagramsAsRead(numToFree);
+            frontSequenceNumber = (frontSequenceNumber + numToFree) & 0xFFFF;
+            numStored -= numToFree;
+            maxNumDatagrams = (maxNumDatagrams % 17) + 1;
+        }
+        // The block thrown away above leaves a gap at the end
+        if ((numStored != 0) || (((frontSequenceNumber + numLostAtEnd) & 0xFFFF) != nextSequenceNumber)) {
+            printf("Ring: lap %d, %d datagrams missing.\n", lap, numStored);
+            success = false;
+        }
+        frontSequenceNumber = nextSequenceNumber;
+        numLostAtEnd = 0;
+    }
+
+    // The overflow count is reported once the next datagram
+    // fits
+    urtp.codeAudioBlock(gRawStereoS32);
+    urtp.setUrtpDatagramAsRead(urtp.getUrtpDatagram());
+    if (gRingNumOverflows != numOverflows) {
+        printf("Ring: %d overflows reported, expected %d.\n", (int) gRingNumOverflows, numOverflows);
+        success = false;
+    }
+    if (!wrapped) {
+        printf("Ring: sequence number didn't wrap.\n");
+        success = false;
+    }
+
+    printf("Ring: %s.\n", success ? "OK" : "FAILED");
+
+    return success;
+}
+
+// Code blocks as fast as possible, for ringStressTest().
+static void ringStressEncode(Urtp *pUrtp, std::atomic<bool> *pDone)
+{
+    uint32_t raw[SAMPLES_PER_BLOCK * 2] = {0};
+
+    for (int x = 0; x < RING_STRESS_NUM_BLOCKS; x++) {
+        pUrtp->codeAudioBlock(raw);
+    }
+    *pDone = true;
+}
+
+// Code blocks in one thread while reading them, in all of the
+// ways that the send thread may, in another, with pauses so that
+// the ring overflows; every datagram must come out in order and
+// any missing must have been counted as overwritten or stale.
+static bool ringStressTest()
+{
+    Urtp urtp(NULL, NULL, ringOverflowStopCb);
+    struct iovec iov[MAX_NUM_DATAGRAMS];
+    std::atomic<bool> done(false);
+    std::thread *pEncodeThread;
+    const char *pDatagram = NULL;
+    int lastSequenceNumber = 0xFFFF;
+    int difference;
+    int numDatagrams;
+    int numToFree;
+    int numReceived = 0;
+    int numMissing = 0;
+    int numStale = 0;
+    bool encodeDone;
+    bool drained = false;
+    bool finished = false;
+    bool success = true;
+
+    gRingNumOverflows = 0;
+    if (!urtp.init(gDatagramStorage, AUDIO_MAX_SHIFT_BITS, URTP_AUDIO_CODING_BIT(Urtp::PCM_SIGNED_16_BIT), false, false)) {
+        printf("Ring stress: unable to start URTP.\n");
+        return false;
+    }
+
+    pEncodeThread = new std::thread(ringStressEncode, &urtp, &done);
+
+    for (unsigned int loop = 0; !finished; loop++) {
+        if (drained) {
+            // Once everything is out, one last block so that
+            // the overflow count is reported, then finish
+            // when that is out too
+            if (pEncodeThread != NULL) {
+                pEncodeThread->join();
+                delete pEncodeThread;
+                pEncodeThread = NULL;
+                urtp.codeAudioBlock(gRawStereoS32);
+            } else {
+                finished = true;
+            }
+        }
+        // Only empty once the encode thread has finished
+        encodeDone = done;
+        if (urtp.getUrtpDatagramsAvailable() > MAX_NUM_DATAGRAMS) {
+            success = false;
+        }
+        numDatagrams = 0;
+        if (loop % 3 == 0) {
+            pDatagram = urtp.getUrtpDatagram();
+            if (pDatagram != NULL) {
+                iov[0].iov_base = (void *) pDatagram;
+                numDatagrams = 1;
+            }
+        } else {
+            numDatagrams = urtp.getUrtpDatagrams(iov, (loop % 31) + 1);
+        }
+        // Free some or all of them, checking the order
+        numToFree = numDatagrams;
+        if ((loop % 4 == 0) && (numDatagrams > 1)) {
+            numToFree = numDatagrams / 2;
+        }
+        for (int x = 0; x < numToFree; x++) {
+            difference = (sequenceNumber((const char *) iov[x].iov_base) - lastSequenceNumber) & 0xFFFF;
+            if ((difference == 0) || (difference >= 0x8000)) {
+                printf("Ring stress: sequence number %d after %d.\n",
+                       sequenceNumber((const char *) iov[x].iov_base), lastSequenceNumber);
+                success = false;
+            }
+            numMissing += difference - 1;
+            lastSequenceNumber = sequenceNumber((const char *) iov[x].iov_base);
+            numReceived++;
+        }
+        if (loop % 3 == 0) {
+            if (numToFree > 0) {
+                urtp.setUrtpDatagramAsRead(pDatagram);
+            }
+        } else {
+            urtp.setUrtpDatagramsAsRead(numToFree);
+        }
+        drained = encodeDone && (numDatagrams == 0);
+        // Now and again drop what's stale, while holding
+        // nothing, or take a break so that the ring fills
+        if (numToFree == numDatagrams) {
+            if (loop % 53 == 0) {
+                numStale += urtp.dropStaleUrtpDatagrams(getUSeconds() - 100);
+            } else if (loop % 97 == 0) {
+                usleep(1000);
+            }
+        }
+    }
+
+    // Everything coded, including the final block, is accounted for
+    if ((numReceived + gRingNumOverflows + numStale != RING_STRESS_NUM_BLOCKS + 1) ||
+        (numMissing != gRingNumOverflows + numStale)) {
+        printf("Ring stress: %d received, %d missing, %d overwritten and %d stale of %d.\n",
+               numReceived, numMissing, (int) gRingNumOverflows, numStale, RING_STRESS_NUM_BLOCKS + 1);
+        success = false;
+    }
+    if (gRingNumOverflows == 0) {
+        printf("Ring stress: never overflowed.\n");
+        success = false;
+    }
+
+    // The counts vary from run to run so keep them out of
+    // the output, which is compared between builds
+    printf("Ring stress: %s.\n", success ? "OK" : "FAILED");
+
+    return success;
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+int main()
+{
+    bool success = firTest();
+
+    if (!codingTest()) {
+        success = false;
+    }
+
+    if (!baselineTest()) {
+        success = false;
+    }
+
+    if (!unicamTest()) {
+        success = false;
+    }
+
+    if (!riceTest()) {
+        success = false;
+    }
+
+    if (!lpcTest()) {
+        success = false;
+    }
+
+    if (!fecTest()) {
+        success = false;
+    }
+
+    if (!redundantTests()) {
+        success = false;
+    }
+
+    if (!storeTest()) {
+        success = false;
+    }
+
+    if (!ringTest()) {
+        success = false;
+    }
+
+    if (!ringStressTest()) {
+        success = false;
+    }
+
+    return success ? 0 : 1;
+}
+
+// End of file
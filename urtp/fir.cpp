@@ -1,52 +1,124 @@
 /* This code generated by the wonderful http://t-filter.appspot.com */
 
+#include <string.h>
 #include <fir.h>
 
-static double filterTaps[] = {-0.07951087685285016,
-                               0.01945354671754785,
-                              -0.005453575732499895,
-                              -0.04837063849132621,
-                              -0.07168597959153167,
-                              -0.16374206778816897,
-                               0.7588178512425175,
-                              -0.16374206778816897,
-                              -0.07168597959153167,
-                              -0.04837063849132621,
-                              -0.005453575732499895,
-                               0.01945354671754785,
-                              -0.07951087685285016};
+#if FIR_SAMPLING_FREQUENCY == 8000
+
+// The first half of the taps as designed, plus the centre tap,
+// in Q15 (the double precision taps are in tools/urtp-test.cpp);
+// the sum of the absolute values of all of the taps is 35581,
+// so a signed 16 bit sample times that fits in 32 bits.
+static const int32_t filterTapsQ15[FIR_TAP_NUM / 2 + 1] = {-1328,
+                                                           -1008,
+                                                           -6479,
+                                                           17951};
+
+#elif FIR_SAMPLING_FREQUENCY == 16000
+
+// The first half of the taps as designed, plus the centre tap,
+// in Q15 (the double precision taps are in tools/urtp-test.cpp);
+// the sum of the absolute values of all of the taps is 50307,
+// so a signed 16 bit sample times that fits in 32 bits.
+static const int32_t filterTapsQ15[FIR_TAP_NUM / 2 + 1] = {-2605,
+                                                             637,
+                                                            -179,
+                                                           -1585,
+                                                           -2349,
+                                                           -5366,
+                                                           24865};
+
+#elif FIR_SAMPLING_FREQUENCY == 32000
+
+// The first half of the taps as designed, plus the centre tap,
+// in Q15 (the double precision taps are in tools/urtp-test.cpp);
+// the sum of the absolute values of all of the taps is 56800,
+// so a signed 16 bit sample times that fits in 32 bits.
+static const int32_t filterTapsQ15[FIR_TAP_NUM / 2 + 1] = { -853,
+                                                            -413,
+                                                             -48,
+                                                              38,
+                                                            -213,
+                                                            -645,
+                                                            -973,
+                                                           -1122,
+                                                           -1307,
+                                                           -1868,
+                                                           -2834,
+                                                           -3817,
+                                                           28538};
+
+#elif FIR_SAMPLING_FREQUENCY == 48000
+
+// The first half of the taps as designed, plus the centre tap,
+// in Q15 (the double precision taps are in tools/urtp-test.cpp);
+// the sum of the absolute values of all of the taps is 59710,
+// so a signed 16 bit sample times that fits in 32 bits.
+static const int32_t filterTapsQ15[FIR_TAP_NUM / 2 + 1] = { -744,
+                                                            -420,
+                                                            -160,
+                                                               1,
+                                                              57,
+                                                              -7,
+                                                            -154,
+                                                            -350,
+                                                            -523,
+                                                            -649,
+                                                            -711,
+                                                            -765,
+                                                            -866,
+                                                           -1089,
+                                                           -1442,
+                                                           -1898,
+                                                           -2350,
+                                                           -2692,
+                                                           29954};
+
+#endif
 
 void firInit(Fir *f)
 {
-    for (int i = 0; i < sizeof(filterTaps) / sizeof(filterTaps[0]); ++i) {
-        f->history[i] = 0;
-    }
-    f->lastIndex = 0;
+    memset(f->buffer, 0, sizeof(f->buffer));
 }
 
-void firPut(Fir *f, double input)
+void firProcessBlock(Fir *f, const int32_t *in, int32_t *out, int numSamples)
 {
-    f->history[f->lastIndex] = input;
-    f->lastIndex++;
+    int32_t *x = f->buffer;
+    int32_t acc[FIR_CHUNK_SIZE];
+    int32_t tap;
+    int n;
 
-    if (f->lastIndex == sizeof(filterTaps) / sizeof(filterTaps[0])) {
-        f->lastIndex = 0;
-    }
-}
+    while (numSamples > 0) {
+        n = numSamples;
+        if (n > FIR_CHUNK_SIZE) {
+            n = FIR_CHUNK_SIZE;
+        }
+        memcpy(x + FIR_TAP_NUM - 1, in, n * sizeof(int32_t));
 
-double firGet(Fir *f)
-{
-    double acc = 0;
-    int index = f->lastIndex;
-
-    for (int i = 0; i < sizeof(filterTaps) / sizeof(filterTaps[0]); ++i) {
-        if (index != 0) {
-            index = index - 1;
-        } else {
-            index = sizeof(filterTaps) / sizeof(filterTaps[0]) - 1;
+        // Output i is the sum along x[i] to x[i + FIR_TAP_NUM - 1];
+        // going a tap at a time across all of the outputs keeps the
+        // inner loops straight and free of dependencies so that the
+        // compiler can vectorise them.  The taps being symmetric,
+        // each pair of samples the same distance from the centre
+        // shares a multiply.
+        tap = filterTapsQ15[FIR_TAP_NUM / 2];
+        for (int i = 0; i < n; i++) {
+            acc[i] = (1 << (FIR_TAP_Q - 1)) + tap * x[i + FIR_TAP_NUM / 2];
+        }
+        for (int k = 0; k < FIR_TAP_NUM / 2; k++) {
+            tap = filterTapsQ15[k];
+            for (int i = 0; i < n; i++) {
+                acc[i] += tap * (x[i + k] + x[i + FIR_TAP_NUM - 1 - k]);
+            }
+        }
+        for (int i = 0; i < n; i++) {
+            out[i] = acc[i] >> FIR_TAP_Q;
         }
-        acc += f->history[index] * filterTaps[i];
-    }
 
-    return acc;
-}
\ No newline at end of file
+        // Keep the newest samples as the overlap for next time
+        memmove(x, x + n, (FIR_TAP_NUM - 1) * sizeof(int32_t));
+        in += n;
+        out += n;
+        numSamples -= n;
+    }
+}
@@ -1,6 +1,19 @@
 #ifndef _FIR_H_
 #define _FIR_H_
 
+#include <stdint.h>
+
+/* The sampling frequency that the filter is for, which must be
+ * the same as SAMPLING_FREQUENCY in urtp.h, so set that on the
+ * command line (e.g. -DSAMPLING_FREQUENCY=48000) rather than
+ * in urtp.h; there are taps for 8000, 16000, 32000 and 48000 Hz.
+ */
+#ifdef SAMPLING_FREQUENCY
+# define FIR_SAMPLING_FREQUENCY SAMPLING_FREQUENCY
+#else
+# define FIR_SAMPLING_FREQUENCY 16000
+#endif
+
 /* FIR filter designed with http://t-filter.appspot.com
 
 sampling frequency: 16000 Hz
@@ -27,22 +40,57 @@ fixed point precision: 32 bits
   desired ripple = 5 dB
   actual ripple = n/a
 
+The taps for the other sampling frequencies were designed by
+least squares to the same bands, with the gain = 1 band running
+up to half the sampling frequency; at 8000 Hz the bands stop
+at 4000 Hz.  The number of taps goes up with the sampling
+frequency to keep the same resolution at low frequencies.
+
 */
 
-#define FIR_TAP_NUM 13
+#if FIR_SAMPLING_FREQUENCY == 8000
+# define FIR_TAP_NUM 7
+#elif FIR_SAMPLING_FREQUENCY == 16000
+# define FIR_TAP_NUM 13
+#elif FIR_SAMPLING_FREQUENCY == 32000
+# define FIR_TAP_NUM 25
+#elif FIR_SAMPLING_FREQUENCY == 48000
+# define FIR_TAP_NUM 37
+#else
+# error "No FIR taps for this sampling frequency"
+#endif
+
+/* The filter taps are symmetric so only the first
+ * FIR_TAP_NUM / 2 + 1 of them are needed; they are held
+ * as Q15 fixed point.
+ */
+#define FIR_TAP_Q 15
 
+/* The number of samples filtered in one go inside firProcessBlock();
+ * blocks longer than this are dealt with in chunks.
+ */
+#define FIR_CHUNK_SIZE 64
+
+/* The last FIR_TAP_NUM - 1 input samples are kept at the start
+ * of buffer, with the chunk being filtered copied in after them,
+ * so that every output is a straight run along buffer.
+ */
 typedef struct {
-    double history[FIR_TAP_NUM];
-    unsigned int lastIndex;
+    int32_t buffer[FIR_TAP_NUM - 1 + FIR_CHUNK_SIZE];
 } Fir;
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* Initialise a filter. */
 void firInit(Fir *f);
-void firPut(Fir *f, double input);
-double firGet(Fir *f);
+
+/* Filter numSamples samples from in into out, which may be
+ * the same buffer.  The samples must fit in 16 bits, signed,
+ * for the Q15 sums not to overflow.
+ */
+void firProcessBlock(Fir *f, const int32_t *in, int32_t *out, int numSamples);
 
 #ifdef __cplusplus
 }
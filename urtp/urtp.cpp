@@ -15,11 +15,27 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <utils.h>
 #include <time.h>
 #include <urtp.h>
 
+// Vectorise the UNICAM encoder with NEON or SSE2 where the
+// compiler says that it's there; define URTP_DISABLE_SIMD
+// to use the plain C versions instead (the output is the
+// same either way).
+#ifndef URTP_DISABLE_SIMD
+# if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  define URTP_NEON
+#  include <arm_neon.h>
+# elif defined(__SSE2__)
+#  define URTP_SSE2
+#  include <emmintrin.h>
+# endif
+#endif
+
 #ifdef ENABLE_RAMLOG
 #include <log.h>
 #else
@@ -29,7 +45,7 @@
 // For testing only: define this to write the captured
 // and gain controlled audio data to file.
 // Format is little-endian (on a Pi) signed 32-bit mono
-// @ 16000 Hz.
+// @ SAMPLING_FREQUENCY.
 //#define URTP_TEST_AUDIO_OUTPUT_FILENAME "/home/rob/audio_processed.pcm"
 
 // For testing only: define this to write the encoded
@@ -42,6 +58,66 @@
 #include <errno.h>
 #endif
 
+/**********************************************************************
+ * COMPILE-TIME MACROS
+ **********************************************************************/
+
+// The number of distinct datagram indexes: twice the number of
+// datagrams so that a full ring can be told apart from an empty one.
+#define NUM_DATAGRAM_INDEXES (MAX_NUM_DATAGRAMS * 2)
+
+#if NUM_DATAGRAM_INDEXES > 0xFFFF
+# error "MAX_NUM_DATAGRAMS is too large for a 16 bit datagram index"
+#endif
+
+// Pack a datagram index and the number of datagrams held by the
+// reader into a value for _datagramReadState.
+#define READ_STATE(index, numHeld) (((index) << 16) | (numHeld))
+
+// Get the datagram index out of a value of _datagramReadState.
+#define READ_STATE_INDEX(state) ((state) >> 16)
+
+// Get the number of datagrams held by the reader out of a value
+// of _datagramReadState.
+#define READ_STATE_NUM_HELD(state) ((state) & 0xFFFF)
+
+// The number of blocks over which the average encode duration
+// is logged: one second's worth.
+#define ENCODE_DURATION_AVERAGING_BLOCKS (1000 / BLOCK_DURATION_MS)
+
+// The audio coding scheme to start with.
+#ifdef DISABLE_UNICAM
+# define DEFAULT_AUDIO_CODING PCM_SIGNED_16_BIT
+#else
+# define DEFAULT_AUDIO_CODING UNICAM_COMPRESSED_8_BIT
+#endif
+
+#if UNICAM_CODED_SAMPLE_SIZE_BITS != 8
+# error "Only 8 bit unicam is supported"
+#endif
+
+// A UNICAM block is 1 ms, which must be a whole number of
+// samples that packs into whole bytes at 4 and 6 bits.
+#if (SAMPLING_FREQUENCY % 4000) != 0
+# error "SAMPLING_FREQUENCY must be a multiple of 4000 Hz"
+#endif
+
+// The copy of the previous block in a REDUNDANT datagram
+// must be a whole number of pairs of UNICAM blocks.
+#if (UNICAM_BLOCKS_PER_BLOCK % 4) != 0
+# error "BLOCK_DURATION_MS must be a multiple of 4 for REDUNDANT"
+#endif
+
+// The group size of forward error correction is sent in a byte
+// and the powers of 2 that weight the Q parity repeat after 255.
+#if (URTP_FEC_MAX_GROUP_SIZE < 2) || (URTP_FEC_MAX_GROUP_SIZE > 255)
+# error "URTP_FEC_MAX_GROUP_SIZE must be 2 to 255"
+#endif
+
+#if FIR_SAMPLING_FREQUENCY != SAMPLING_FREQUENCY
+# error "SAMPLING_FREQUENCY must be set on the command line so that fir.cpp is built for it too"
+#endif
+
 /**********************************************************************
  * STATIC VARIABLES
  **********************************************************************/
@@ -94,79 +170,373 @@ static FILE *urtpTestAudioOutputFile = NULL;
 static FILE *urtpTestUrtpOutputFile = NULL;
 #endif
 
+// The audio codecs, indexed by AudioCoding.
+const Urtp::Codec Urtp::_codecs[MAX_NUM_AUDIO_CODINGS] = {{"pcm", URTP_PCM_BODY_SIZE, &Urtp::codePcm},
+                                                           {"unicam", URTP_UNICAM_BODY_SIZE, &Urtp::codeUnicam},
+                                                           {"unicam6", URTP_UNICAM_6_BODY_SIZE, &Urtp::codeUnicam6},
+                                                           {"unicam4", URTP_UNICAM_4_BODY_SIZE, &Urtp::codeUnicam4},
+                                                           {"silence", 0, NULL},
+                                                           {"unicamrice", URTP_UNICAM_RICE_BODY_SIZE, &Urtp::codeUnicamRice},
+                                                           {"lpc", URTP_LPC_BODY_SIZE, &Urtp::codeLpc},
+                                                           {"parity", URTP_PARITY_BODY_SIZE, NULL},
+                                                           {"redundant", URTP_REDUNDANT_BODY_SIZE, NULL}};
+
 /**********************************************************************
- * PRIVATE METHODS
+ * STATIC FUNCTIONS
  **********************************************************************/
 
-// Take an audio sample and from it produce a signed
-// output that uses the maximum number of bits
-// in a 32 bit word.
-int Urtp::processAudio(int monoSample)
+// Return the largest absolute value in an array of samples.
+static int maxAbsSample(const int *samples, int numSamples)
 {
-    int unusedBits = 0;
-    int absSample = monoSample;
+    int maxSample = 0;
+    int absSample;
+    int x = 0;
 
-    //LOG(EVENT_STREAM_MONO_SAMPLE_DATA, monoSample);
+#if defined (URTP_NEON)
+    int32x4_t maxVector = vdupq_n_s32(0);
+    int32x2_t maxPair;
 
-    // First, determine the number of unused bits
-    // (avoiding testing the top bit since that is
-    // never unused)
-    if (absSample < 0) {
-        absSample = -absSample;
+    for (; x + 4 <= numSamples; x += 4) {
+        maxVector = vmaxq_s32(maxVector, vabsq_s32(vld1q_s32(samples + x)));
+    }
+    maxPair = vpmax_s32(vget_low_s32(maxVector), vget_high_s32(maxVector));
+    maxPair = vpmax_s32(maxPair, maxPair);
+    maxSample = vget_lane_s32(maxPair, 0);
+#elif defined (URTP_SSE2)
+    // No abs or max for 32 bit integers until SSE4, so make them
+    __m128i maxVector = _mm_setzero_si128();
+    __m128i sampleVector;
+    __m128i signVector;
+    __m128i greaterVector;
+    int maxSamples[4];
+
+    for (; x + 4 <= numSamples; x += 4) {
+        sampleVector = _mm_loadu_si128((const __m128i *) (samples + x));
+        signVector = _mm_srai_epi32(sampleVector, 31);
+        sampleVector = _mm_sub_epi32(_mm_xor_si128(sampleVector, signVector), signVector);
+        greaterVector = _mm_cmpgt_epi32(sampleVector, maxVector);
+        maxVector = _mm_or_si128(_mm_and_si128(greaterVector, sampleVector),
+                                 _mm_andnot_si128(greaterVector, maxVector));
+    }
+    _mm_storeu_si128((__m128i *) maxSamples, maxVector);
+    for (int y = 0; y < 4; y++) {
+        if (maxSamples[y] > maxSample) {
+            maxSample = maxSamples[y];
+        }
     }
+#endif
 
-    for (int x = 30; x >= 0; x--) {
-        if (absSample & (1 << x)) {
-            break;
+    for (; x < numSamples; x++) {
+        absSample = samples[x];
+        if (absSample < 0) {
+            absSample = -absSample;
+        }
+        if (absSample > maxSample) {
+            maxSample = absSample;
+        }
+    }
+
+    return maxSample;
+}
+
+// Shift an array of samples down and write the bottom
+// 8 bits of each into dest.
+static void packUnicamSamples(const int *samples, int shift, char *dest, int numSamples)
+{
+    int x = 0;
+
+#if defined (URTP_NEON)
+    int32x4_t shiftVector = vdupq_n_s32(-shift); // Negative for a right shift
+    int16x4_t lowerHalf;
+    int16x4_t upperHalf;
+
+    for (; x + 8 <= numSamples; x += 8) {
+        lowerHalf = vmovn_s32(vshlq_s32(vld1q_s32(samples + x), shiftVector));
+        upperHalf = vmovn_s32(vshlq_s32(vld1q_s32(samples + x + 4), shiftVector));
+        vst1_s8((int8_t *) (dest + x), vmovn_s16(vcombine_s16(lowerHalf, upperHalf)));
+    }
+#elif defined (URTP_SSE2)
+    // SSE2 can only narrow with saturation so sign extend the
+    // bottom 8 bits first; saturation then has nothing to do
+    __m128i shiftVector = _mm_cvtsi32_si128(shift);
+    __m128i sampleVector[4];
+
+    for (; x + 16 <= numSamples; x += 16) {
+        for (int y = 0; y < 4; y++) {
+            sampleVector[y] = _mm_sra_epi32(_mm_loadu_si128((const __m128i *) (samples + x + (y * 4))), shiftVector);
+            sampleVector[y] = _mm_srai_epi32(_mm_slli_epi32(sampleVector[y], 24), 24);
+        }
+        _mm_storeu_si128((__m128i *) (dest + x),
+                         _mm_packs_epi16(_mm_packs_epi32(sampleVector[0], sampleVector[1]),
+                                         _mm_packs_epi32(sampleVector[2], sampleVector[3])));
+    }
+#endif
+
+    for (; x < numSamples; x++) {
+        //LOG(EVENT_UNICAM_SAMPLE, samples[x]);
+        *(dest + x) = samples[x] >> shift;
+        //LOG(EVENT_UNICAM_COMPRESSED_SAMPLE, *(dest + x));
+    }
+}
+
+// Shift an array of samples down and pack the bottom
+// bits of each into dest, most significant bit first,
+// returning the number of bytes written.
+static int packUnicamBits(const int *samples, int shift, int bits, char *dest, int numSamples)
+{
+    unsigned int accumulator = 0;
+    unsigned int mask = (1 << bits) - 1;
+    int numBits = 0;
+    char *pDestOriginal = dest;
+
+    for (int x = 0; x < numSamples; x++) {
+        accumulator = (accumulator << bits) | ((unsigned int) (samples[x] >> shift) & mask);
+        numBits += bits;
+        if (numBits >= 8) {
+            numBits -= 8;
+            *dest = (char) (accumulator >> numBits);
+            dest++;
+        }
+    }
+    if (numBits > 0) {
+        *dest = (char) (accumulator << (8 - numBits));
+        dest++;
+    }
+
+    return dest - pDestOriginal;
+}
+
+// Code numBlocks UNICAM blocks of samples into dest in the
+// UNICAM_COMPRESSED_x_BIT layout: work out the shift for each
+// block, pack its samples into codedBits and put the shifts of
+// each pair of blocks into the byte between them, returning the
+// number of bytes written.
+static int packUnicamBlocks(const int *samples, int numBlocks, int codedBits, char *dest)
+{
+    const int *unicamBlock;
+    int maxSample;
+    int numBytes = 0;
+    int usedBits;
+    int shiftValueCoded;
+    bool isEvenBlock = false;
+    char *pDestOriginal = dest;
+
+    for (int x = 0; x < numBlocks; x++) {
+        unicamBlock = samples + (x * SAMPLES_PER_UNICAM_BLOCK);
+        maxSample = maxAbsSample(unicamBlock, SAMPLES_PER_UNICAM_BLOCK);
+
+        //LOG(EVENT_UNICAM_MAX_ABS_VALUE, maxSample);
+
+        // Work out the shift value to just fit the maximum value
+        // into codedBits.  First find the number of bits used, which
+        // is one more than the position of the top set bit (for
+        // the sign), minimum 1
+        usedBits = 1;
+        if (maxSample > 0) {
+            usedBits = 33 - __builtin_clz((unsigned int) maxSample);
+        }
+
+        //LOG(EVENT_UNICAM_MAX_VALUE_USED_BITS, usedBits);
+
+        // We have a block of 32 bit samples (scaled down to
+        // UNICAM_MAX_DECODED_SAMPLE_SIZE_BITS) and we know what the 
+        // maximum number of used bits per sample are in the block.  If
+        // the number of used bits is bigger than codedBits then add the
+        // shift value.  With a UNICAM_MAX_DECODED_SAMPLE_SIZE_BITS of
+        // 16 the shifValueCoded will never be greater than 16 - codedBits,
+        // which fits in a nibble.
+        shiftValueCoded = 0;
+        if (usedBits > codedBits) {
+            shiftValueCoded = usedBits - codedBits;
+        }
+        //LOG(EVENT_UNICAM_CODED_SHIFT_VALUE, shiftValueCoded);
+
+        isEvenBlock = false;
+        if ((x & 1) == 0) {
+            isEvenBlock = true;
+        }
+
+        // If we're on an odd block, the shift value goes into the
+        // upper nibble of the shift byte, which is where the dest
+        // pointer will already be pointed at, with nibble
+        // already zeroed for us
+        if (!isEvenBlock) {
+            *dest |= shiftValueCoded << 4;
+            //LOG(EVENT_UNICAM_CODED_SHIFTS_BYTE, *dest);
+            // Now move the dest pointer on to the start of the
+            // unicam data
+            dest++;
+        }
+
+        // Write into the output all the values in the block shifted down by this amount
+        if (codedBits == 8) {
+            packUnicamSamples(unicamBlock, shiftValueCoded, dest, SAMPLES_PER_UNICAM_BLOCK);
+            dest += SAMPLES_PER_UNICAM_BLOCK;
         } else {
-            unusedBits++;
+            dest += packUnicamBits(unicamBlock, shiftValueCoded, codedBits, dest, SAMPLES_PER_UNICAM_BLOCK);
+        }
+
+        // If we're on an even block number the shift value goes into
+        // the lower nibble of the shift byte that follows the unicam block
+        // and we don't increment the dest pointer so that the shift value
+        // for the next block can be written in the upper nibble
+        if (isEvenBlock) {
+            *dest = shiftValueCoded & 0x0F;
         }
     }
 
-    //LOG(EVENT_MONO_SAMPLE_UNUSED_BITS, unusedBits);
+    numBytes = dest - pDestOriginal;
+    if (isEvenBlock) {
+        numBytes++;
+    }
+
+    return numBytes;
+}
+
+// Write the bottom numBits (no more than 24) of value to
+// dest, most significant bit first, by way of an accumulator
+// holding fewer than 8 bits; returns the new dest.
+static inline char *writeBits(char *dest, unsigned int *pAccumulator, int *pNumBits,
+                              unsigned int value, int numBits)
+{
+    *pAccumulator = (*pAccumulator << numBits) | (value & ((1 << numBits) - 1));
+    *pNumBits += numBits;
+    while (*pNumBits >= 8) {
+        *pNumBits -= 8;
+        *dest = (char) (*pAccumulator >> *pNumBits);
+        dest++;
+    }
+
+    return dest;
+}
 
-    if (absSample > AUDIO_SHIFT_THRESHOLD) {
-        monoSample <<= _audioShift;
+// Rice code a UNICAM block of 8 bit samples, with its shift
+// value, into dest; returns the new dest.
+static char *riceCodeUnicamBlock(const signed char *samples, int shift, char *dest,
+                                 unsigned int *pAccumulator, int *pNumBits)
+{
+    unsigned int mapped[SAMPLES_PER_UNICAM_BLOCK];
+    int numBits;
+    int bestNumBits = SAMPLES_PER_UNICAM_BLOCK * 8;
+    int k = -1;
+    unsigned int quotient;
+
+    // Fold the sign into the bottom bit so that small
+    // negative values are small too
+    for (int x = 0; x < SAMPLES_PER_UNICAM_BLOCK; x++) {
+        mapped[x] = (samples[x] >= 0) ? (unsigned int) samples[x] << 1 : ((unsigned int) -samples[x] << 1) - 1;
     }
 
-    // Update the minimum number of unused bits
-    if (unusedBits < _audioUnusedBitsMin) {
-        _audioUnusedBitsMin = unusedBits;
+    // Work out the cost of each Rice parameter exactly, it's
+    // only a few adds, and keep the cheapest; if none beats
+    // 8 bits a sample k stays at -1.  A k of 7 is never tried
+    // since it always costs at least 8 bits a sample
+    for (int y = 0; y < 7; y++) {
+        numBits = SAMPLES_PER_UNICAM_BLOCK * (y + 1);
+        for (int x = 0; x < SAMPLES_PER_UNICAM_BLOCK; x++) {
+            numBits += mapped[x] >> y;
+        }
+        if (numBits < bestNumBits) {
+            bestNumBits = numBits;
+            k = y;
+        }
     }
-    _audioShiftSampleCount++;
-    // If we've had a block's worth of data, work out how much gain we may be
-    // able to apply for the next period
-    if (_audioShiftSampleCount >= SAMPLING_FREQUENCY / (1000 / BLOCK_DURATION_MS)) {
-        _audioShiftSampleCount = 0;
-        //LOG(EVENT_MONO_SAMPLE_UNUSED_BITS_MIN, _audioUnusedBitsMin);
-        if (_audioShift > _audioUnusedBitsMin) {
-            _audioShift = _audioUnusedBitsMin;
-        }
-        if ((_audioUnusedBitsMin - _audioShift > (AUDIO_DESIRED_UNUSED_BITS + AUDIO_SHIFT_HYSTERESIS_BITS)) && (_audioShift < _audioShiftMax)) {
-            // An increase in gain is noted here but not applied immediately in order to do
-            // some smoothing.  Instead a note is kept of the last N audio shifts and
-            // only if it persists is the gain increased.
-            _audioUpShiftCount++;
-            if (_audioUpShiftCount > AUDIO_NUM_UP_SHIFTS_FOR_A_SHIFT) {
-                _audioShift++;
-                _audioUpShiftCount = 0;
-                LOG(EVENT_MONO_SAMPLE_AUDIO_SHIFT, _audioShift);
+
+    if (k < 0) {
+        dest = writeBits(dest, pAccumulator, pNumBits, (shift << 4) | 0x0F, 8);
+        for (int x = 0; x < SAMPLES_PER_UNICAM_BLOCK; x++) {
+            dest = writeBits(dest, pAccumulator, pNumBits, (unsigned char) samples[x], 8);
+        }
+    } else {
+        dest = writeBits(dest, pAccumulator, pNumBits, (shift << 4) | k, 8);
+        for (int x = 0; x < SAMPLES_PER_UNICAM_BLOCK; x++) {
+            quotient = mapped[x] >> k;
+            while (quotient >= 16) {
+                dest = writeBits(dest, pAccumulator, pNumBits, 0xFFFF, 16);
+                quotient -= 16;
             }
-        } else if ((_audioUnusedBitsMin - _audioShift < AUDIO_DESIRED_UNUSED_BITS) && (_audioShift > 0)) {
-            // A reduction in gain must happen immediately to avoid clipping
-            _audioShift--;
-            _audioUpShiftCount = 0;
-            LOG(EVENT_MONO_SAMPLE_AUDIO_SHIFT, _audioShift);
+            // quotient ones, a zero, then the remainder
+            dest = writeBits(dest, pAccumulator, pNumBits,
+                             (((1 << quotient) - 1) << (k + 1)) | (mapped[x] & ((1 << k) - 1)),
+                             quotient + 1 + k);
         }
+    }
 
-        // Increment the minimum number of unused bits in the period
-        // to let the number "relax"
-        _audioUnusedBitsMin++;
+    return dest;
+}
+
+// Multiply a byte by 2 in GF(2^8) with the polynomial 0x11D.
+static inline unsigned char gfMultiplyBy2(unsigned char value)
+{
+    return (unsigned char) ((value << 1) ^ ((value & 0x80) ? 0x1D : 0));
+}
+
+/**********************************************************************
+ * PRIVATE METHODS
+ **********************************************************************/
+
+// Take a block of audio samples and from them produce signed
+// output that uses the maximum number of bits in a 32 bit word.
+void Urtp::processAudioBlock(int *monoSamples)
+{
+    unsigned int usedBitsMask = 1;
+    int absSample;
+    int signMask;
+    int unusedBitsMin;
+
+    for (unsigned int x = 0; x < SAMPLES_PER_BLOCK; x++) {
+        //LOG(EVENT_STREAM_MONO_SAMPLE_DATA, monoSamples[x]);
+
+        // The number of unused bits in a sample is the number of
+        // leading zeros below the top bit (which is never unused);
+        // the smallest over the block is that of all of the samples
+        // OR'ed together, which is left for a single clz at the end
+        signMask = monoSamples[x] >> 31;
+        absSample = (monoSamples[x] ^ signMask) - signMask;
+        usedBitsMask |= (unsigned int) absSample << 1;
+
+        if (absSample > AUDIO_SHIFT_THRESHOLD) {
+            monoSamples[x] <<= _audioShift;
+        }
+
+        //LOG(EVENT_STREAM_MONO_SAMPLE_PROCESSED_DATA, monoSamples[x]);
     }
 
-    //LOG(EVENT_STREAM_MONO_SAMPLE_PROCESSED_DATA, monoSample);
+    // Update the minimum number of unused bits; the
+    // remainder is the size of the peak, for DTX
+    unusedBitsMin = __builtin_clz(usedBitsMask);
+    _audioPeakBits = 32 - unusedBitsMin;
+    //LOG(EVENT_MONO_SAMPLE_UNUSED_BITS, unusedBitsMin);
+    if (unusedBitsMin < _audioUnusedBitsMin) {
+        _audioUnusedBitsMin = unusedBitsMin;
+    }
 
-    return monoSample;
+    // Having had a block's worth of data, work out how much gain we may be
+    // able to apply for the next period
+    //LOG(EVENT_MONO_SAMPLE_UNUSED_BITS_MIN, _audioUnusedBitsMin);
+    if (_audioShift > _audioUnusedBitsMin) {
+        _audioShift = _audioUnusedBitsMin;
+    }
+    if ((_audioUnusedBitsMin - _audioShift > (AUDIO_DESIRED_UNUSED_BITS + AUDIO_SHIFT_HYSTERESIS_BITS)) && (_audioShift < _audioShiftMax)) {
+        // An increase in gain is noted here but not applied immediately in order to do
+        // some smoothing.  Instead a note is kept of the last N audio shifts and
+        // only if it persists is the gain increased.
+        _audioUpShiftCount++;
+        if (_audioUpShiftCount > AUDIO_NUM_UP_SHIFTS_FOR_A_SHIFT) {
+            _audioShift++;
+            _audioUpShiftCount = 0;
+            LOG(EVENT_MONO_SAMPLE_AUDIO_SHIFT, _audioShift);
+        }
+    } else if ((_audioUnusedBitsMin - _audioShift < AUDIO_DESIRED_UNUSED_BITS) && (_audioShift > 0)) {
+        // A reduction in gain must happen immediately to avoid clipping
+        _audioShift--;
+        _audioUpShiftCount = 0;
+        LOG(EVENT_MONO_SAMPLE_AUDIO_SHIFT, _audioShift);
+    }
+
+    // Increment the minimum number of unused bits in the period
+    // to let the number "relax"
+    _audioUnusedBitsMin++;
 }
 
 // Take a stereo sample in our usual form
@@ -176,92 +546,106 @@ int Urtp::processAudio(int monoSample)
 // treated as an int for maths purposes.
 inline int Urtp::getMonoSample(const uint32_t *stereoSample)
 {
-    const char * pByte = (const char *) stereoSample;
+    return getPackedSample((const unsigned char *) stereoSample + 1);
+}
+
+// Take a packed 3-byte little-endian sample
+// and return it sign extended.
+inline int Urtp::getPackedSample(const unsigned char *sample)
+{
     unsigned int retValue = 0;
 
     // LSB
-    retValue = (unsigned int) *(pByte + 1);
+    retValue = (unsigned int) *sample;
     // Middle byte
-    retValue += ((unsigned int) *(pByte + 2)) << 8;
+    retValue += ((unsigned int) *(sample + 1)) << 8;
     // MSB
-    retValue += ((unsigned int) *(pByte + 3)) << 16;
+    retValue += ((unsigned int) *(sample + 2)) << 16;
     // Sign extend
     if (retValue & 0x800000) {
         retValue |= 0xFF000000;
     }
 
-#ifdef ENABLE_STREAM_FIXED_TONE
-    retValue = pcm400HzSigned24Bit[toneIndex];
-    toneIndex++;
-    if (toneIndex >= sizeof (pcm400HzSigned24Bit) / sizeof (pcm400HzSigned24Bit[0])) {
-        toneIndex = 0;
-    }
-#endif
-
     return (int) retValue;
 }
 
-// Encode UNICAM_COMPRESSED_x_BIT.
-int Urtp::codeUnicam(const uint32_t *rawAudio, char *dest)
+// Take a block of samples in the given format and
+// return the mono samples from it.
+inline void Urtp::getMonoSamples(const void *rawAudio, RawAudioFormat format,
+                                 int *monoSamples)
 {
-    int monoSample;
-    int absSample;
-    int maxSample = 0;
-    int numBytes = 0;
-    int numBlocks = 0;
-    unsigned int i = 0;
-    int usedBits;
-    int shiftValueCoded;
-    bool isEvenBlock = false;
-    char *pDestOriginal = dest;
-
-    for (const uint32_t *stereoSample = rawAudio; stereoSample < rawAudio + (SAMPLES_PER_BLOCK * 2); stereoSample += 2) {
-
-        //LOG(EVENT_RAW_AUDIO_DATA_0, *stereoSample);
-        //LOG(EVENT_RAW_AUDIO_DATA_1, *(stereoSample + 1));
-
-        monoSample = getMonoSample(stereoSample);
-        monoSample = processAudio(monoSample);
-
-#ifdef ENABLE_RAMP_TEST
-        monoSample = (int) testValue;
+    const uint32_t *words = (const uint32_t *) rawAudio;
+    const unsigned char *bytes = (const unsigned char *) rawAudio;
+    unsigned int x = 0;
+
+    switch (format) {
+        case RAW_AUDIO_STEREO_S32_LE:
+            // The left channel is the upper 24 bits of the even words
+#if defined (URTP_NEON)
+            for (; x + 4 <= SAMPLES_PER_BLOCK; x += 4) {
+                vst1q_s32(monoSamples + x, vshrq_n_s32(vld2q_s32((const int32_t *) (words + (x * 2))).val[0], 8));
+            }
+#elif defined (URTP_SSE2)
+            __m128i stereoSamples0;
+            __m128i stereoSamples1;
+
+            for (; x + 4 <= SAMPLES_PER_BLOCK; x += 4) {
+                stereoSamples0 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) (words + (x * 2))), _MM_SHUFFLE(3, 1, 2, 0));
+                stereoSamples1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) (words + (x * 2) + 4)), _MM_SHUFFLE(3, 1, 2, 0));
+                _mm_storeu_si128((__m128i *) (monoSamples + x),
+                                 _mm_srai_epi32(_mm_unpacklo_epi64(stereoSamples0, stereoSamples1), 8));
+            }
 #endif
-        // Scale the sample down to the maximum size we want the
-        // decoder to derive
-        monoSample >>= (32 - UNICAM_MAX_DECODED_SAMPLE_SIZE_BITS);
+            for (; x < SAMPLES_PER_BLOCK; x++) {
+                monoSamples[x] = getMonoSample(words + (x * 2));
+            }
+        break;
+        case RAW_AUDIO_MONO_S32_LE:
+            // Every word is a sample, again in the upper 24 bits;
+            // simple enough for the compiler to vectorise
+            for (; x < SAMPLES_PER_BLOCK; x++) {
+                monoSamples[x] = ((int32_t) words[x]) >> 8;
+            }
+        break;
+        case RAW_AUDIO_STEREO_S24_3LE:
+            for (; x < SAMPLES_PER_BLOCK; x++) {
+                monoSamples[x] = getPackedSample(bytes + (x * 6));
+            }
+        break;
+        case RAW_AUDIO_MONO_S24_3LE:
+            for (; x < SAMPLES_PER_BLOCK; x++) {
+                monoSamples[x] = getPackedSample(bytes + (x * 3));
+            }
+        break;
+        default:
+            assert(false);
+        break;
+    }
 
-        // Add the _preemphasis
-        firPut(&_preemphasis, (double) monoSample);
-        monoSample = (int) firGet(&_preemphasis);
-        
-#ifdef URTP_TEST_AUDIO_OUTPUT_FILENAME
-        if (urtpTestAudioOutputFile != NULL) {
-            fwrite(&monoSample, sizeof(monoSample), 1, urtpTestAudioOutputFile);
+#ifdef ENABLE_STREAM_FIXED_TONE
+    for (x = 0; x < SAMPLES_PER_BLOCK; x++) {
+        monoSamples[x] = pcm400HzSigned24Bit[toneIndex];
+        toneIndex++;
+        if (toneIndex >= sizeof (pcm400HzSigned24Bit) / sizeof (pcm400HzSigned24Bit[0])) {
+            toneIndex = 0;
         }
+    }
 #endif
-        // Track the max abs value
-        absSample = monoSample;
-        if (absSample < 0) {
-            absSample = -absSample;
-        }
-        if (absSample > maxSample) {
-            maxSample = absSample;
-        }
-
-        // Put the sample into the unicam buffer
-        _unicamBuffer[i] = monoSample;
-        i++;
+}
 
-        // Check if we have a unicam block's worth ready to go
-        if (i >= sizeof (_unicamBuffer) / sizeof (_unicamBuffer[0])) {
-            i = 0;
-            shiftValueCoded = 0;
-            usedBits = 32;
+// Apply gain, scaling and pre-emphasis to a block of
+// mono samples, ready for one of the UNICAM-style codings.
+void Urtp::preemphasiseBlock(int *monoSamples, int *filteredSamples)
+{
+    processAudioBlock(monoSamples);
 
+    for (unsigned int x = 0; x < SAMPLES_PER_BLOCK; x++) {
 #ifdef ENABLE_RAMP_TEST
-            // Only increment once per unicam block during
-            // ramp testing as the increment value can be too
-            // large for it to cope
+        monoSamples[x] = (int) testValue;
+        // Only increment once per unicam block during
+        // ramp testing as the increment value can be too
+        // large for it to cope
+        if ((x + 1) % SAMPLES_PER_UNICAM_BLOCK == 0) {
             testValue += testIncrement;
             if (testValue >= TEST_MODULO) {
                 testIncrement = -TEST_INCREMENT;
@@ -272,97 +656,242 @@ int Urtp::codeUnicam(const uint32_t *rawAudio, char *dest)
                 testValue += testIncrement;
                 testValue++;    // Add a little wiggle to avoid repeats
             }
+        }
 #endif
+        // Scale the sample down to the maximum size we want the
+        // decoder to derive
+        monoSamples[x] >>= (32 - UNICAM_MAX_DECODED_SAMPLE_SIZE_BITS);
+    }
 
-            //LOG(EVENT_UNICAM_MAX_ABS_VALUE, maxSample);
-
-            // Once we have a buffer full, work out the shift value
-            // to just fit the maximum value into 8 bits.  First
-            // find the number of bits used (avoid testing the top
-            // bit since that is always used)
-            for (int x = 30; x >= 0; x--) {
-                if ((maxSample & (1 << x)) != 0) {
-                    break;
-                } else {
-                    usedBits--;
-                }
+    // Add the _preemphasis to the whole block in one go
+    firProcessBlock(&_preemphasis, monoSamples, filteredSamples, SAMPLES_PER_BLOCK);
+
+#ifdef URTP_TEST_AUDIO_OUTPUT_FILENAME
+    if (urtpTestAudioOutputFile != NULL) {
+        fwrite(filteredSamples, sizeof(int) * SAMPLES_PER_BLOCK, 1, urtpTestAudioOutputFile);
+    }
+#endif
+}
+
+// Encode UNICAM_COMPRESSED_x_BIT.
+// This is done in stages over the whole block so that the
+// stages which don't carry state from one sample to the
+// next can be vectorised.
+int Urtp::codeUnicamBits(int *monoSamples, char *dest, int codedBits)
+{
+    int filteredSamples[SAMPLES_PER_BLOCK];
+    int numBytes;
+
+    preemphasiseBlock(monoSamples, filteredSamples);
+
+    numBytes = packUnicamBlocks(filteredSamples, UNICAM_BLOCKS_PER_BLOCK, codedBits, dest);
+
+    //LOG(EVENT_UNICAM_BLOCKS_CODED, UNICAM_BLOCKS_PER_BLOCK);
+    //LOG(EVENT_UNICAM_BYTES_CODED, numBytes);
+
+    return numBytes;
+}
+
+// Encode UNICAM_COMPRESSED_8_BIT.
+int Urtp::codeUnicam(int *monoSamples, char *dest)
+{
+    return codeUnicamBits(monoSamples, dest, UNICAM_CODED_SAMPLE_SIZE_BITS);
+}
+
+// Encode UNICAM_COMPRESSED_6_BIT.
+int Urtp::codeUnicam6(int *monoSamples, char *dest)
+{
+    return codeUnicamBits(monoSamples, dest, 6);
+}
+
+// Encode UNICAM_COMPRESSED_4_BIT.
+int Urtp::codeUnicam4(int *monoSamples, char *dest)
+{
+    return codeUnicamBits(monoSamples, dest, 4);
+}
+
+// Encode UNICAM_RICE_8_BIT.
+int Urtp::codeUnicamRice(int *monoSamples, char *dest)
+{
+    char unicam[URTP_UNICAM_BODY_SIZE];
+    const char *pUnicam = unicam;
+    unsigned int accumulator = 0;
+    int numBits = 0;
+    int shifts = 0;
+    char *pDestOriginal = dest;
+
+    codeUnicam(monoSamples, unicam);
+
+    // Unpick the UNICAM payload: an even block, the shifts
+    // byte, then an odd block
+    for (int numBlocks = 0; numBlocks < UNICAM_BLOCKS_PER_BLOCK; numBlocks += 2) {
+        shifts = *(pUnicam + SAMPLES_PER_UNICAM_BLOCK);
+        dest = riceCodeUnicamBlock((const signed char *) pUnicam, shifts & 0x0F, dest,
+                                   &accumulator, &numBits);
+        pUnicam += SAMPLES_PER_UNICAM_BLOCK + 1;
+        dest = riceCodeUnicamBlock((const signed char *) pUnicam, (shifts >> 4) & 0x0F, dest,
+                                   &accumulator, &numBits);
+        pUnicam += SAMPLES_PER_UNICAM_BLOCK;
+    }
+    if (numBits > 0) {
+        *dest = (char) (accumulator << (8 - numBits));
+        dest++;
+    }
+
+    return dest - pDestOriginal;
+}
+
+// Return the prediction of the next sample from the
+// previous two with one of the fixed predictors.
+static inline int lpcPredict(int order, int previous1, int previous2)
+{
+    int prediction = 0;
+
+    if (order == 1) {
+        prediction = previous1;
+    } else if (order == 2) {
+        prediction = (previous1 << 1) - previous2;
+    }
+
+    return prediction;
+}
+
+// Encode LPC_RESIDUAL_6_BIT.
+int Urtp::codeLpc(int *monoSamples, char *dest)
+{
+    int filteredSamples[SAMPLES_PER_BLOCK];
+    int residuals[SAMPLES_PER_UNICAM_BLOCK];
+    int *unicamBlock;
+    int errorSum[URTP_LPC_MAX_ORDER + 1] = {0};
+    int previous1 = _lpcHistory[1];
+    int previous2 = _lpcHistory[0];
+    int prediction;
+    int residual;
+    int maxResidual;
+    int usedBits;
+    int shiftValueCoded;
+    int order = 0;
+    int minResidual = -(1 << (URTP_LPC_CODED_SAMPLE_SIZE_BITS - 1));
+    int maxResidualCoded = (1 << (URTP_LPC_CODED_SAMPLE_SIZE_BITS - 1)) - 1;
+    char *shiftByte = NULL;
+    char *pDestOriginal = dest;
+
+    preemphasiseBlock(monoSamples, filteredSamples);
+
+    // Choose the predictor for this datagram: the one which,
+    // run over the input, gives the smallest residual
+    for (unsigned int x = 0; x < SAMPLES_PER_BLOCK; x++) {
+        for (int y = 0; y <= URTP_LPC_MAX_ORDER; y++) {
+            errorSum[y] += abs(filteredSamples[x] - lpcPredict(y, previous1, previous2));
+        }
+        previous2 = previous1;
+        previous1 = filteredSamples[x];
+    }
+    for (int y = 1; y <= URTP_LPC_MAX_ORDER; y++) {
+        if (errorSum[y] < errorSum[order]) {
+            order = y;
+        }
+    }
+
+    // The predictor and the history it starts from, so that
+    // each datagram can be decoded on its own
+    *dest = (char) order;
+    dest++;
+    for (int y = 0; y < 2; y++) {
+        *dest = (char) (_lpcHistory[y] >> 8);
+        dest++;
+        *dest = (char) _lpcHistory[y];
+        dest++;
+    }
+
+    previous1 = _lpcHistory[1];
+    previous2 = _lpcHistory[0];
+    for (int numBlocks = 0; numBlocks < UNICAM_BLOCKS_PER_BLOCK; numBlocks++) {
+        unicamBlock = filteredSamples + (numBlocks * SAMPLES_PER_UNICAM_BLOCK);
+
+        // Work out the shift from the residual of the input; the
+        // residual actually coded, below, is from what the decoder
+        // will have reconstructed and so may differ slightly, hence
+        // it is clamped
+        maxResidual = abs(unicamBlock[0] - lpcPredict(order, previous1, previous2));
+        if (order > 0) {
+            residual = abs(unicamBlock[1] - lpcPredict(order, unicamBlock[0], previous1));
+            if (residual > maxResidual) {
+                maxResidual = residual;
             }
-            maxSample = 0;
-
-           //LOG(EVENT_UNICAM_MAX_VALUE_USED_BITS, usedBits);
-
-            // We have a block of 32 bit samples (scaled down to
-            // UNICAM_MAX_DECODED_SAMPLE_SIZE_BITS) and we know what the 
-            // maximum number of used bits per sample are in the block.  If
-            // the number of used bits is bigger than 8 bits then add the
-            // shift value.  With a UNICAM_MAX_DECODED_SAMPLE_SIZE_BITS of
-            // 16 the shifValueCoded will never be greater than 8.
-            if (usedBits > UNICAM_CODED_SAMPLE_SIZE_BITS) {
-                shiftValueCoded = usedBits - UNICAM_CODED_SAMPLE_SIZE_BITS;
+            for (int x = 2; x < SAMPLES_PER_UNICAM_BLOCK; x++) {
+                residual = abs(unicamBlock[x] - lpcPredict(order, unicamBlock[x - 1], unicamBlock[x - 2]));
+                if (residual > maxResidual) {
+                    maxResidual = residual;
+                }
             }
-            //LOG(EVENT_UNICAM_CODED_SHIFT_VALUE, shiftValueCoded);
-
-            isEvenBlock = false;
-            if ((numBlocks & 1) == 0) {
-                isEvenBlock = true;
+        } else {
+            maxResidual = maxAbsSample(unicamBlock, SAMPLES_PER_UNICAM_BLOCK);
+        }
+        usedBits = 1;
+        if (maxResidual > 0) {
+            usedBits = 33 - __builtin_clz((unsigned int) maxResidual);
+        }
+        shiftValueCoded = 0;
+        if (usedBits > URTP_LPC_CODED_SAMPLE_SIZE_BITS) {
+            shiftValueCoded = usedBits - URTP_LPC_CODED_SAMPLE_SIZE_BITS;
+            if (shiftValueCoded > 15) {
+                shiftValueCoded = 15;
             }
+        }
 
-            // If we're on an odd block, the shift value goes into the
-            // upper nibble of the shift byte, which is where the dest
-            // pointer will already be pointed at, with nibble
-            // already zeroed for us
-            if (!isEvenBlock) {
-                *dest |= shiftValueCoded << 4;
-                //LOG(EVENT_UNICAM_CODED_SHIFTS_BYTE, *dest);
-                // Now move the dest pointer on to the start of the
-                // unicam data
-                dest++;
+        // Quantise the residuals against the decoder's
+        // reconstruction so that the errors don't build up
+        for (int x = 0; x < SAMPLES_PER_UNICAM_BLOCK; x++) {
+            prediction = lpcPredict(order, previous1, previous2);
+            residual = unicamBlock[x] - prediction;
+            if (shiftValueCoded > 0) {
+                residual = (residual + (1 << (shiftValueCoded - 1))) >> shiftValueCoded;
             }
-
-            // Write into the output all the values in the buffer shifted down by this amount
-            for (unsigned int x = 0; x < sizeof (_unicamBuffer) / sizeof (_unicamBuffer[0]); x++) {
-                //LOG(EVENT_UNICAM_SAMPLE, _unicamBuffer[x]);
-                *dest = _unicamBuffer[x] >> shiftValueCoded;
-                //LOG(EVENT_UNICAM_COMPRESSED_SAMPLE, *dest);
-                dest++;
+            if (residual < minResidual) {
+                residual = minResidual;
+            } else if (residual > maxResidualCoded) {
+                residual = maxResidualCoded;
             }
-
-            // If we're on an even block number the shift value goes into
-            // the lower nibble of the shift byte that follows the unicam block
-            // and we don't increment the dest pointer so that the shift value
-            // for the next block can be written in the upper nibble
-            if (isEvenBlock) {
-                *dest = shiftValueCoded & 0x0F;
+            residuals[x] = residual;
+            previous2 = previous1;
+            previous1 = prediction + (residual << shiftValueCoded);
+            if (previous1 > 32767) {
+                previous1 = 32767;
+            } else if (previous1 < -32768) {
+                previous1 = -32768;
             }
+        }
 
-            numBlocks++;
+        // Lay the blocks out as for UNICAM: an even block,
+        // the shift byte, then an odd block
+        if ((numBlocks & 1) == 0) {
+            dest += packUnicamBits(residuals, 0, URTP_LPC_CODED_SAMPLE_SIZE_BITS, dest, SAMPLES_PER_UNICAM_BLOCK);
+            shiftByte = dest;
+            *shiftByte = shiftValueCoded;
+            dest++;
+        } else {
+            *shiftByte |= shiftValueCoded << 4;
+            dest += packUnicamBits(residuals, 0, URTP_LPC_CODED_SAMPLE_SIZE_BITS, dest, SAMPLES_PER_UNICAM_BLOCK);
         }
     }
 
-    numBytes = dest - pDestOriginal;
-    if (isEvenBlock) {
-        numBytes++;
-    }
+    _lpcHistory[0] = previous2;
+    _lpcHistory[1] = previous1;
 
-    //LOG(EVENT_UNICAM_BLOCKS_CODED, numBlocks);
-    //LOG(EVENT_UNICAM_BYTES_CODED, numBytes);
-
-    return numBytes;
+    return dest - pDestOriginal;
 }
 
 // Encode PCM_SIGNED_16_BIT.
-int Urtp::codePcm(const uint32_t *rawAudio, char *dest)
+int Urtp::codePcm(int *monoSamples, char *dest)
 {
     int monoSample;
     int numSamples = 0;
 
-    for (const uint32_t *stereoSample = rawAudio; stereoSample < rawAudio + (SAMPLES_PER_BLOCK * 2); stereoSample += 2) {
+    processAudioBlock(monoSamples);
 
-        //LOG(EVENT_RAW_AUDIO_DATA_0, *stereoSample);
-        //LOG(EVENT_RAW_AUDIO_DATA_1, *(stereoSample + 1));
-
-        monoSample = getMonoSample(stereoSample);
-        monoSample = processAudio(monoSample);
+    for (unsigned int x = 0; x < SAMPLES_PER_BLOCK; x++) {
+        monoSample = monoSamples[x];
         numSamples++;
 
 #ifdef ENABLE_RAMP_TEST
@@ -406,33 +935,110 @@ int Urtp::codePcm(const uint32_t *rawAudio, char *dest)
     return numSamples * URTP_SAMPLE_SIZE;
 }
 
+// Make the low rate copy of a block for REDUNDANT.
+int Urtp::codeRedundantCopy(const int *monoSamples, int audioCoding, char *dest)
+{
+    int decimatedSamples[SAMPLES_PER_BLOCK / 2];
+    int shift = 0;
+
+    // The UNICAM-style codings leave the samples scaled down
+    // to UNICAM_MAX_DECODED_SAMPLE_SIZE_BITS but PCM_SIGNED_16_BIT
+    // takes the top bits of each sample itself
+    if (audioCoding == PCM_SIGNED_16_BIT) {
+        shift = 32 - UNICAM_MAX_DECODED_SAMPLE_SIZE_BITS;
+    }
+
+    // Averaging each pair of samples is crude as anti-alias
+    // filters go but good enough for a stand-in
+    for (unsigned int x = 0; x < SAMPLES_PER_BLOCK / 2; x++) {
+        decimatedSamples[x] = ((monoSamples[x * 2] >> shift) + (monoSamples[(x * 2) + 1] >> shift)) >> 1;
+    }
+
+    return packUnicamBlocks(decimatedSamples, UNICAM_BLOCKS_PER_BLOCK / 2,
+                            URTP_REDUNDANT_CODED_SAMPLE_SIZE_BITS, dest);
+}
+
 // Fill a datagram with the audio from one block.
-void Urtp::fillMonoDatagramFromBlock(const uint32_t *rawAudio)
+void Urtp::fillMonoDatagramFromBlock(const void *rawAudio, RawAudioFormat format)
 {
-    Container * container = getContainerForWriting();
-    char * datagram = (char *) container->contents;
+    char * datagram = getDatagramForWriting();
+    char * datagramStart = datagram;
     long long int timestamp = getUSeconds();
+    int audioCoding = _audioCoding.load(std::memory_order_relaxed);
+    int monoSamples[SAMPLES_PER_BLOCK];
     int numBytesAudio = 0;
+    bool redundancy = _redundancy.load(std::memory_order_relaxed);
+    bool dropped = false;
+    char *body;
+    bool silent;
+
+    if (datagram == NULL) {
+        // Nowhere to put it but code it anyway, into the
+        // scratch datagram, so that the gain, filter and
+        // predictor don't miss a block
+        datagram = _scratchDatagram;
+        dropped = true;
+    }
 
     // Copy in the body ASAP in case we're called from
     // DMA, which might catch up with us
-#ifndef DISABLE_UNICAM
-    numBytesAudio = codeUnicam (rawAudio, datagram + URTP_HEADER_SIZE);
-#else
-    numBytesAudio = codePcm (rawAudio, datagram + URTP_HEADER_SIZE);
-#endif
+    getMonoSamples(rawAudio, format, monoSamples);
+    // With redundancy the audio goes after the primary
+    // audio coding and payload length
+    body = datagram + URTP_HEADER_SIZE;
+    if (redundancy) {
+        body += 3;
+    }
+    numBytesAudio = (this->*_codecs[audioCoding].code)(monoSamples, body);
+    // The audio has been coded whatever, so that the
+    // filter and gain carry on smoothly; if it's been
+    // quiet for long enough throw it away
+    if (_audioPeakBits > URTP_DTX_SILENCE_BITS) {
+        _numQuietBlocks = 0;
+    } else if (_numQuietBlocks <= URTP_DTX_HANGOVER_BLOCKS) {
+        _numQuietBlocks++;
+    }
+    silent = (_numQuietBlocks > URTP_DTX_HANGOVER_BLOCKS) && _dtx.load(std::memory_order_relaxed);
+    if (silent != _silent) {
+        _silent = silent;
+        if (silent) {
+            LOG(EVENT_AUDIO_SILENCE_BEGINS, _sequenceNumber);
+        } else {
+            LOG(EVENT_AUDIO_SILENCE_ENDS, _sequenceNumber);
+        }
+    }
+    if (dropped) {
+        // Throw it away; keep the sequence number moving
+        // so that the gap is visible at the server and,
+        // since the datagram can't be added to it, start
+        // a new forward error correction group
+        _sequenceNumber++;
+        _fecNumDatagrams = 0;
+        _redundantCopyLength = 0;
+        return;
+    }
+    if (silent) {
+        audioCoding = SILENCE;
+        numBytesAudio = 0;
+        _redundantCopyLength = 0;
+    } else if (redundancy) {
+        // Add the copy of the previous block after the
+        // audio and keep a copy of this one for next time
+        body = datagram + URTP_HEADER_SIZE;
+        *body = (char) audioCoding;
+        *(body + 1) = (char) (numBytesAudio >> 8);
+        *(body + 2) = (char) numBytesAudio;
+        memcpy(body + 3 + numBytesAudio, _redundantCopy, _redundantCopyLength);
+        numBytesAudio += 3 + _redundantCopyLength;
+        _redundantCopyLength = codeRedundantCopy(monoSamples, audioCoding, _redundantCopy);
+        audioCoding = REDUNDANT;
+    } else {
+        _redundantCopyLength = 0;
+    }
     // Fill in the header
     *datagram = SYNC_BYTE;
     datagram++;
-#ifndef DISABLE_UNICAM
-# if UNICAM_CODED_SAMPLE_SIZE_BITS == 8
-    *datagram = UNICAM_COMPRESSED_8_BIT;
-# else
-# error "Only 8 bit unicam is supported"
-# endif
-#else
-    *datagram = PCM_SIGNED_16_BIT;
-#endif
+    *datagram = (char) ((_streamId << 4) | audioCoding);
     datagram++;
     *datagram = (char) (_sequenceNumber >> 8);
     datagram++;
@@ -460,16 +1066,103 @@ void Urtp::fillMonoDatagramFromBlock(const uint32_t *rawAudio)
     *datagram = (char) numBytesAudio;
     datagram++;
 
-    //LOG(EVENT_DATAGRAM_SIZE, datagram - (char *)container->contents + numBytesAudio);
+    //LOG(EVENT_DATAGRAM_SIZE, datagram - datagramStart + numBytesAudio);
 
 #ifdef URTP_TEST_URTP_OUTPUT_FILENAME
     if (urtpTestUrtpOutputFile != NULL) {
-        fwrite(container->contents, datagram - (char *)container->contents + numBytesAudio, 1, urtpTestUrtpOutputFile);
+        fwrite(datagramStart, datagram - datagramStart + numBytesAudio, 1, urtpTestUrtpOutputFile);
     }
 #endif
 
-    // The container is now ready to read
-    setContainerAsReadyToRead(container);
+    // The datagram is now ready to read
+    setDatagramAsWritten();
+
+    // It stays put until the ring comes round again,
+    // so the parity can be worked out from it in place
+    if (_fecGroupSize > 0) {
+        addToFecGroup(datagramStart);
+    }
+
+    // Keep an eye on how long encoding takes
+    timestamp = getUSeconds() - timestamp;
+    _encodeDurationTotal += timestamp;
+    _numEncodeDurations++;
+    if (_numEncodeDurations >= ENCODE_DURATION_AVERAGING_BLOCKS) {
+        LOG(EVENT_ENCODE_DURATION_AVERAGE, (int) (_encodeDurationTotal / _numEncodeDurations));
+        _encodeDurationTotal = 0;
+        _numEncodeDurations = 0;
+    }
+    if (timestamp > _encodeDurationMax) {
+        _encodeDurationMax = (int) timestamp;
+        LOG(EVENT_NEW_PEAK_ENCODE_DURATION, _encodeDurationMax);
+    }
+}
+
+// Add a datagram to the forward error correction group,
+// writing the PARITY datagrams once the group is complete.
+void Urtp::addToFecGroup(const char *datagram)
+{
+    const unsigned char *bytes = (const unsigned char *) datagram + 1;
+    int length = getDatagramSize(datagram) - 1;
+    unsigned char *parity;
+    char *dest;
+    int numBytes;
+
+    if (_fecNumDatagrams == 0) {
+        memcpy(_fecHeader, datagram, sizeof(_fecHeader));
+        memset(_fecParity, 0, sizeof(_fecParity));
+        _fecLength = 0;
+    }
+
+    // Q is built up Horner-fashion, multiplying what is there
+    // already by 2 before each datagram is added, so that datagram
+    // i of N ends up multiplied by 2 to the power N - 1 - i; beyond
+    // _fecLength Q is still zero, so there's no need to go further
+    if (_fecNumParity > 1) {
+        parity = _fecParity[1];
+        for (int x = 0; x < _fecLength; x++) {
+            parity[x] = gfMultiplyBy2(parity[x]);
+        }
+        for (int x = 0; x < length; x++) {
+            parity[x] ^= bytes[x];
+        }
+    }
+    parity = _fecParity[0];
+    for (int x = 0; x < length; x++) {
+        parity[x] ^= bytes[x];
+    }
+    if (length > _fecLength) {
+        _fecLength = length;
+    }
+    _fecNumDatagrams++;
+
+    if (_fecNumDatagrams >= _fecGroupSize) {
+        for (int y = 0; y < _fecNumParity; y++) {
+            // Parity must never push out audio, so if the store
+            // is full (only this thread fills it, so it can't
+            // become full behind our back) go without
+            dest = NULL;
+            if (getUrtpDatagramsFree() > 0) {
+                dest = getDatagramForWriting();
+            }
+            if (dest == NULL) {
+                _numFecSkipped.fetch_add(1, std::memory_order_relaxed);
+            } else {
+                numBytes = 2 + _fecLength;
+                // Same header as the first datagram of the group,
+                // apart from the coding and the length
+                memcpy(dest, _fecHeader, sizeof(_fecHeader));
+                dest[1] = (char) ((_streamId << 4) | PARITY);
+                dest[URTP_HEADER_SIZE - 2] = (char) (numBytes >> 8);
+                dest[URTP_HEADER_SIZE - 1] = (char) numBytes;
+                dest[URTP_HEADER_SIZE] = (char) _fecGroupSize;
+                dest[URTP_HEADER_SIZE + 1] = (char) y;
+                memcpy(dest + URTP_HEADER_SIZE + 2, _fecParity[y], _fecLength);
+                setDatagramAsWritten();
+            }
+        }
+        _fecNumDatagrams = 0;
+    }
 }
 
 // Test that right shift is an arithmetic operation
@@ -479,112 +1172,143 @@ bool Urtp::unicamTest()
     return (negative >> 1) < 0;
 }
 
-// Get the next container for writing.
-inline Urtp::Container * Urtp::getContainerForWriting()
+// Work out the largest datagram that a session may produce.
+int Urtp::getDatagramStride(unsigned int audioCodings, bool redundancy, bool fec)
 {
-    Container * container = _containerNextForWriting;
+    int bodySize = -1;
+    int stride = 0;
 
-    // In normal circumstances one would hope that the next container
-    // for writing is empty.  However, it may be that the read
-    // routine is running behind, in which case it could be in state
-    // READY_TO_READ or, worse, state READING.  If it is in state
-    // READY_TO_READ, then it can simply be overwritten with new data,
-    // but if it is in state READING we must leave it alone and move
-    // on or we will could corrupt the callers work.  There should
-    // only ever be one container in state READING, so the for() loop
-    // isn't strictly necessary, it is simply there to be safe.
-    for (unsigned int x = 0; (container->state == CONTAINER_STATE_READING) &&
-                             (x < sizeof (_container) / sizeof (_container[0])); x++) {
-        _containerNextForWriting = container->next;
+    for (int x = 0; x < MAX_NUM_AUDIO_CODINGS; x++) {
+        if ((audioCodings & URTP_AUDIO_CODING_BIT(x)) && (_codecs[x].code != NULL) &&
+            (_codecs[x].maxBodySize > bodySize)) {
+            bodySize = _codecs[x].maxBodySize;
+        }
     }
 
-    // Move the write pointer on
-    _containerNextForWriting = container->next;
-
-    if (container->state == CONTAINER_STATE_EMPTY) {
-        _numDatagramsFree--;
-        //LOG(EVENT_NUM_DATAGRAMS_FREE, _numDatagramsFree);
-        if (_numDatagramsFree < _minNumDatagramsFree) {
-            _minNumDatagramsFree = _numDatagramsFree;
-        }
-        if (_numDatagramOverflows > 0) {
-            LOG(EVENT_DATAGRAM_NUM_OVERFLOWS, _numDatagramOverflows);
-            _numDatagramOverflows = 0;
-            if (_datagramOverflowStopCb) {
-                _datagramOverflowStopCb(_numDatagramOverflows);
-            }
+    if (bodySize >= 0) {
+        // REDUNDANT carries the primary audio coding and
+        // payload length, the audio, then the copy
+        if (redundancy) {
+            bodySize += 3 + URTP_REDUNDANT_COPY_SIZE;
         }
-    } else {
-        // If the container we're about to use is not empty, we're overwriting
-        // old data.  To avoid the read pointer wrapping the write pointer,
-        // nudge the read pointer on by one
-        _containerNextForReading = _containerNextForReading->next;
-        if (_numDatagramOverflows == 0) {
-            LOG(EVENT_DATAGRAM_OVERFLOW_BEGINS, (int) container);
-            if (_datagramOverflowStartCb) {
-                _datagramOverflowStartCb();
-            }
+        stride = URTP_HEADER_SIZE + bodySize;
+        // PARITY carries the group size and parity index,
+        // then the parity over all but the sync byte of the
+        // largest datagram
+        if (fec) {
+            stride = URTP_HEADER_SIZE + 2 + stride - 1;
         }
-        _numDatagramOverflows++;
     }
-    container->state = CONTAINER_STATE_WRITING;
-    //LOG(EVENT_CONTAINER_STATE_WRITING, (int) container);
 
-    return container;
+    return stride;
 }
 
-// Set the given container as ready to read.
-// Must have been writing to this container for it to be now ready to read.
-inline void Urtp::setContainerAsReadyToRead(Urtp::Container * container)
+// Move a datagram index on by one.
+inline unsigned int Urtp::nextDatagramIndex(unsigned int index)
 {
-    assert(container->state == CONTAINER_STATE_WRITING);
-    container->state = CONTAINER_STATE_READY_TO_READ;
-    //LOG(EVENT_CONTAINER_STATE_READY_TO_READ, (int) container);
-
-    // Tell the callback that the contents are ready for reading
-    if (_datagramReadyCb) {
-        _datagramReadyCb((const char *) container->contents);
+    index++;
+    if (index >= NUM_DATAGRAM_INDEXES) {
+        index = 0;
     }
+
+    return index;
 }
 
-// Get the next container for reading.
-// Only if the next container for reading is ready to read, or
-// is already being read, can it be returned, otherwise
-// NULL is returned
-inline Urtp::Container * Urtp::getContainerForReading()
+// The number of datagrams between two datagram indexes.
+inline unsigned int Urtp::numDatagramsBetween(unsigned int writeIndex, unsigned int readIndex)
 {
-    Container * container = _containerNextForReading;
+    if (writeIndex < readIndex) {
+        writeIndex += NUM_DATAGRAM_INDEXES;
+    }
 
-    if ((container->state == CONTAINER_STATE_READY_TO_READ) ||
-        (container->state == CONTAINER_STATE_READING)) {
-        container->state = CONTAINER_STATE_READING;
-        //LOG(EVENT_CONTAINER_STATE_READING, (int) container);
-    } else {
-        container = NULL;
+    return writeIndex - readIndex;
+}
+
+// Get a pointer to the datagram storage for a datagram index.
+inline char * Urtp::datagramAtIndex(unsigned int index)
+{
+    if (index >= MAX_NUM_DATAGRAMS) {
+        index -= MAX_NUM_DATAGRAMS;
     }
 
-    return container;
+    return _datagramMemory + (index * _datagramStride);
 }
 
-// Set the given container as read.
-// Must have been reading this container to mark it as read.  Once
-// this container is marked as read the read pointer can be moved on
-// and the container freed up.
-inline void Urtp::setContainerAsRead(Urtp::Container * container)
+// Get the next datagram for writing.
+inline char * Urtp::getDatagramForWriting()
 {
-    assert(container->state == CONTAINER_STATE_READING);
-    _containerNextForReading = container->next;
-    //LOG(EVENT_CONTAINER_STATE_READ, (int) container);
-    setContainerAsEmpty(container);
+    unsigned int writeIndex = _datagramWriteIndex.load(std::memory_order_relaxed);
+    unsigned int readState = _datagramReadState.load(std::memory_order_acquire);
+    unsigned int readIndex;
+    unsigned int numDatagramsFree;
+    bool overflowed = false;
+    bool full = true;
+
+    while (full) {
+        readIndex = READ_STATE_INDEX(readState);
+        if (numDatagramsBetween(writeIndex, readIndex) < MAX_NUM_DATAGRAMS) {
+            full = false;
+        } else if (READ_STATE_NUM_HELD(readState) > 0) {
+            // The slot we would overwrite is the oldest datagram
+            // and the send thread is sending it: give up, losing
+            // this block
+            overflowed = true;
+            break;
+        } else if (_datagramReadState.compare_exchange_weak(readState,
+                                                            READ_STATE(nextDatagramIndex(readIndex), 0),
+                                                            std::memory_order_acq_rel,
+                                                            std::memory_order_acquire)) {
+            // Dropped the oldest datagram; if the exchange fails
+            // the send thread got there first (and may have made
+            // room) and readState is updated for another go, so
+            // only count an overflow once something is lost
+            overflowed = true;
+            readState = READ_STATE(nextDatagramIndex(readIndex), 0);
+        }
+    }
+
+    if (overflowed) {
+        if (_numDatagramOverflows == 0) {
+            LOG(EVENT_DATAGRAM_OVERFLOW_BEGINS, writeIndex);
+            if (_datagramOverflowStartCb) {
+                _datagramOverflowStartCb();
+            }
+        }
+        _numDatagramOverflows++;
+    } else if (_numDatagramOverflows > 0) {
+        LOG(EVENT_DATAGRAM_NUM_OVERFLOWS, _numDatagramOverflows);
+        if (_datagramOverflowStopCb) {
+            _datagramOverflowStopCb(_numDatagramOverflows);
+        }
+        _numDatagramOverflows = 0;
+    }
+
+    if (full) {
+        return NULL;
+    }
+
+    numDatagramsFree = MAX_NUM_DATAGRAMS - numDatagramsBetween(writeIndex, readIndex) - 1;
+    //LOG(EVENT_NUM_DATAGRAMS_FREE, numDatagramsFree);
+    if (numDatagramsFree < _minNumDatagramsFree) {
+        _minNumDatagramsFree = numDatagramsFree;
+    }
+
+    return datagramAtIndex(writeIndex);
 }
 
-// Set the given container as empty.
-inline void Urtp::setContainerAsEmpty(Urtp::Container * container)
+// Publish the datagram that has just been written.
+inline void Urtp::setDatagramAsWritten()
 {
-    container->state = CONTAINER_STATE_EMPTY;
-    _numDatagramsFree++;
-    //LOG(EVENT_CONTAINER_STATE_EMPTY, (int) container);
-    //LOG(EVENT_NUM_DATAGRAMS_FREE, _numDatagramsFree);
+    unsigned int writeIndex = _datagramWriteIndex.load(std::memory_order_relaxed);
+
+    // Release, so that the contents of the datagram are
+    // visible to the send thread before the index moves
+    _datagramWriteIndex.store(nextDatagramIndex(writeIndex), std::memory_order_release);
+
+    // Tell the callback that the contents are ready for reading
+    if (_datagramReadyCb) {
+        _datagramReadyCb((const char *) datagramAtIndex(writeIndex));
+    }
 }
 
 /**********************************************************************
@@ -600,17 +1324,37 @@ Urtp::Urtp(void(*datagramReadyCb)(const char *),
     _datagramOverflowStartCb = datagramOverflowStartCb;
     _datagramOverflowStopCb = datagramOverflowStopCb;
     _datagramMemory = NULL;
-    _containerNextForWriting = _container;
-    _containerNextForReading = _container;
-    _audioShiftSampleCount = 0;
+    _datagramStride = URTP_DATAGRAM_SIZE;
+    _datagramWriteIndex = 0;
+    _datagramReadState = READ_STATE(0, 0);
     _audioUnusedBitsMin = 0x7FFFFFFF;
     _audioShift = AUIDIO_SHIFT_DEFAULT;
     _audioUpShiftCount = 0;
     _audioShiftMax = AUDIO_MAX_SHIFT_BITS;
     _sequenceNumber = 0;
     _numDatagramOverflows = 0;
-    _numDatagramsFree = 0;
     _minNumDatagramsFree = 0;
+    _encodeDurationMax = 0;
+    _encodeDurationTotal = 0;
+    _numEncodeDurations = 0;
+    _audioCoding = DEFAULT_AUDIO_CODING;
+    _audioCodings = URTP_ALL_AUDIO_CODINGS;
+    _redundancyAllowed = true;
+    _fecAllowed = true;
+    _streamId = 0;
+    _dtx = false;
+    _audioPeakBits = 0;
+    _numQuietBlocks = 0;
+    _silent = false;
+    _lpcHistory[0] = 0;
+    _lpcHistory[1] = 0;
+    _redundancy = false;
+    _redundantCopyLength = 0;
+    _fecGroupSize = 0;
+    _fecNumParity = 1;
+    _fecNumDatagrams = 0;
+    _fecLength = 0;
+    _numFecSkipped = 0;
 }
 
 // Destructor
@@ -631,45 +1375,48 @@ Urtp::~Urtp()
 }
 
 // Initialise ourselves.
-bool Urtp::init(void *datagramStorage, int audioShiftMax)
+bool Urtp::init(void *datagramStorage, int audioShiftMax,
+                unsigned int audioCodings, bool redundancy, bool fec)
 {
     bool success = false;
-    int x = 0;
-    Container *tmp = NULL;
 
     _audioShiftMax = audioShiftMax;
+    _datagramStride = getDatagramStride(audioCodings, redundancy, fec);
+    _audioCodings = audioCodings;
+    _redundancyAllowed = redundancy;
+    _fecAllowed = fec;
+
+    // Don't keep anything that wasn't allowed for: start with
+    // the first allowed audio coding scheme if the default
+    // isn't one of them
+    if (!(_audioCodings & URTP_AUDIO_CODING_BIT(_audioCoding.load(std::memory_order_relaxed)))) {
+        for (int x = MAX_NUM_AUDIO_CODINGS - 1; x >= 0; x--) {
+            if ((_audioCodings & URTP_AUDIO_CODING_BIT(x)) && (_codecs[x].code != NULL)) {
+                _audioCoding.store(x, std::memory_order_relaxed);
+            }
+        }
+    }
+    if (!_redundancyAllowed) {
+        _redundancy.store(false, std::memory_order_relaxed);
+    }
+    if (!_fecAllowed) {
+        _fecGroupSize = 0;
+    }
 
     firInit(&_preemphasis);
 
-#ifdef DISABLE_UNICAM
-    {
-#else
-    if (unicamTest()) {
-#endif
+    // Any coding scheme may be switched to later, so
+    // test for all of them
+    if ((_datagramStride > 0) && unicamTest()) {
         _datagramMemory = (char *) datagramStorage;
 
         if (_datagramMemory != NULL) {
-            // Initialise the linked list
-            _numDatagramsFree = 0;
-            // This looks peculiar but it is deliberate: container is moved
-            // on in the body of the loop in order to deal with the next pointer,
-            // x is advanced as the for loop variable
-            for (Container *container = _container;
-                 container < _container + sizeof (_container) / sizeof (_container[0]);
-                 x += URTP_DATAGRAM_SIZE) {
-                container->contents = (void *) (_datagramMemory + x);
-                container->state = CONTAINER_STATE_EMPTY;
-                _numDatagramsFree++;
-                container->next = NULL;
-                tmp = container;
-                container++;
-                tmp->next = container;
-            }
-            // Handle the final next, making the list circular
-            tmp->next = _container;
-            _minNumDatagramsFree = _numDatagramsFree;
+            // Empty the datagram ring
+            _datagramWriteIndex.store(0, std::memory_order_relaxed);
+            _datagramReadState.store(READ_STATE(0, 0), std::memory_order_release);
+            _minNumDatagramsFree = MAX_NUM_DATAGRAMS;
 
-            LOG(EVENT_NUM_DATAGRAMS_FREE, _numDatagramsFree);
+            LOG(EVENT_NUM_DATAGRAMS_FREE, MAX_NUM_DATAGRAMS);
         }
 
 #ifdef ENABLE_STREAM_FIXED_TONE
@@ -696,20 +1443,45 @@ bool Urtp::init(void *datagramStorage, int audioShiftMax)
     return success;
 }
 
+// Get the amount of datagram memory that init() needs.
+int Urtp::getDatagramStoreSize(unsigned int audioCodings, bool redundancy, bool fec)
+{
+    return getDatagramStride(audioCodings, redundancy, fec) * MAX_NUM_DATAGRAMS;
+}
+
 // URTP encode an audio block.
-void Urtp::codeAudioBlock(const uint32_t *rawAudio)
+void Urtp::codeAudioBlock(const void *rawAudio, RawAudioFormat format)
 {
-    fillMonoDatagramFromBlock(rawAudio);
+    fillMonoDatagramFromBlock(rawAudio, format);
 }
 
 // Return a pointer to the next filled URTP datagram.
+// If the datagram at the read index is already held (because the
+// last attempt to send it failed) it is returned again.
 const char * Urtp::getUrtpDatagram()
 {
     const char * contents = NULL;
-    Container * container = getContainerForReading();
-
-    if (container != NULL) {
-        contents = (const char *) container->contents;
+    unsigned int readState = _datagramReadState.load(std::memory_order_acquire);
+    unsigned int readIndex;
+    bool done = false;
+
+    while (!done) {
+        readIndex = READ_STATE_INDEX(readState);
+        if (READ_STATE_NUM_HELD(readState) > 0) {
+            // Already ours, the encode thread won't touch it
+            contents = datagramAtIndex(readIndex);
+            done = true;
+        } else if (readIndex == _datagramWriteIndex.load(std::memory_order_acquire)) {
+            // Nothing to read
+            done = true;
+        } else if (_datagramReadState.compare_exchange_weak(readState,
+                                                            READ_STATE(readIndex, 1),
+                                                            std::memory_order_acq_rel,
+                                                            std::memory_order_acquire)) {
+            // Claimed it before the encode thread could drop it
+            contents = datagramAtIndex(readIndex);
+            done = true;
+        }
     }
 
     return contents;
@@ -718,29 +1490,292 @@ const char * Urtp::getUrtpDatagram()
 // Free a URTP datagram that has been read.
 void Urtp::setUrtpDatagramAsRead(const char *datagram)
 {
-    bool freedIt = false;
-    Container *container = _containerNextForReading;
+    unsigned int readState = _datagramReadState.load(std::memory_order_acquire);
+    unsigned int readIndex = READ_STATE_INDEX(readState);
+    unsigned int numHeld = READ_STATE_NUM_HELD(readState);
+
+    // The datagram being freed must be the held one at the read
+    // index.  While datagrams are held the encode thread leaves
+    // _datagramReadState alone so a plain store will do, release
+    // so that we're done with the contents before it can be reused
+    if ((numHeld > 0) && (datagramAtIndex(readIndex) == datagram)) {
+        _datagramReadState.store(READ_STATE(nextDatagramIndex(readIndex), numHeld - 1),
+                                 std::memory_order_release);
+    }
+}
 
-    // This looks pretty inefficient but the datagram being freed will
-    // always be _containerNextForReading, so it should be found immediately
-    for (unsigned int x = 0; (x < sizeof (_container) / sizeof (_container[0])) && !freedIt; x++) {
-        if ((const char *) container->contents == datagram) {
-            setContainerAsRead(container);
-            freedIt = true;
+// Return all of the filled URTP datagrams, up to a limit.
+int Urtp::getUrtpDatagrams(struct iovec *iov, int maxNumDatagrams, int maxNumBytes)
+{
+    unsigned int readState = _datagramReadState.load(std::memory_order_acquire);
+    unsigned int readIndex;
+    unsigned int index;
+    unsigned int numDatagrams = 0;
+    int numBytes;
+    bool done = false;
+
+    while (!done && (maxNumDatagrams > 0)) {
+        readIndex = READ_STATE_INDEX(readState);
+        numDatagrams = READ_STATE_NUM_HELD(readState);
+        if (numDatagrams > 0) {
+            // Still holding some from last time, return those
+            done = true;
+        } else {
+            numDatagrams = numDatagramsBetween(_datagramWriteIndex.load(std::memory_order_acquire),
+                                               readIndex);
+            if (numDatagrams > (unsigned int) maxNumDatagrams) {
+                numDatagrams = maxNumDatagrams;
+            }
+            // Take only as many as fit in maxNumBytes; if one
+            // of these is dropped while they're being measured
+            // the claim below fails and they're measured again
+            if (maxNumBytes > 0) {
+                index = readIndex;
+                numBytes = 0;
+                for (unsigned int x = 0; x < numDatagrams; x++) {
+                    numBytes += getDatagramSize(datagramAtIndex(index));
+                    if ((numBytes > maxNumBytes) && (x > 0)) {
+                        numDatagrams = x;
+                    }
+                    index = nextDatagramIndex(index);
+                }
+            }
+            // Claim them all in one go; if the encode thread dropped
+            // the oldest in the meantime readState is updated and we
+            // go around again
+            if ((numDatagrams == 0) ||
+                _datagramReadState.compare_exchange_weak(readState,
+                                                         READ_STATE(readIndex, numDatagrams),
+                                                         std::memory_order_acq_rel,
+                                                         std::memory_order_acquire)) {
+                done = true;
+            }
         }
     }
+
+    if (numDatagrams > (unsigned int) maxNumDatagrams) {
+        numDatagrams = maxNumDatagrams;
+    }
+    for (unsigned int x = 0; x < numDatagrams; x++) {
+        iov[x].iov_base = datagramAtIndex(readIndex);
+        iov[x].iov_len = getDatagramSize(datagramAtIndex(readIndex));
+        readIndex = nextDatagramIndex(readIndex);
+    }
+
+    return numDatagrams;
+}
+
+// Free a number of held URTP datagrams.
+void Urtp::setUrtpDatagramsAsRead(int numDatagrams)
+{
+    unsigned int readState = _datagramReadState.load(std::memory_order_acquire);
+    unsigned int readIndex = READ_STATE_INDEX(readState);
+    unsigned int numHeld = READ_STATE_NUM_HELD(readState);
+
+    if (numDatagrams > (int) numHeld) {
+        numDatagrams = numHeld;
+    }
+    for (int x = 0; x < numDatagrams; x++) {
+        readIndex = nextDatagramIndex(readIndex);
+    }
+
+    // As for setUrtpDatagramAsRead(), the encode thread leaves
+    // _datagramReadState alone while we hold datagrams
+    if (numDatagrams > 0) {
+        _datagramReadState.store(READ_STATE(readIndex, numHeld - numDatagrams),
+                                 std::memory_order_release);
+    }
+}
+
+// Drop the URTP datagrams at the front of the queue that
+// are older than oldestTimestamp.
+int Urtp::dropStaleUrtpDatagrams(long long int oldestTimestamp)
+{
+    unsigned int readState = _datagramReadState.load(std::memory_order_acquire);
+    unsigned int readIndex;
+    unsigned int numHeld;
+    unsigned int numDatagrams;
+    unsigned int numStale = 0;
+    const unsigned char *header;
+    long long int timestamp;
+    bool done = false;
+
+    while (!done) {
+        readIndex = READ_STATE_INDEX(readState);
+        numHeld = READ_STATE_NUM_HELD(readState);
+        numDatagrams = numDatagramsBetween(_datagramWriteIndex.load(std::memory_order_acquire),
+                                           readIndex);
+        // The datagrams are in timestamp order, near enough,
+        // so stop at the first one that is new enough
+        numStale = 0;
+        while ((numStale < numDatagrams) && (numStale < MAX_NUM_DATAGRAMS)) {
+            header = (const unsigned char *) datagramAtIndex(readIndex) + 4;
+            timestamp = 0;
+            for (int x = 0; x < 8; x++) {
+                timestamp = (timestamp << 8) | *(header + x);
+            }
+            if (timestamp >= oldestTimestamp) {
+                break;
+            }
+            readIndex = nextDatagramIndex(readIndex);
+            numStale++;
+        }
+        if (numHeld > numStale) {
+            numHeld -= numStale;
+        } else {
+            numHeld = 0;
+        }
+        // Move the read index past them all at once; if the
+        // encode thread dropped the oldest datagram in the
+        // meantime, what we read may have been overwritten, so
+        // readState is updated and we go around again
+        if ((numStale == 0) ||
+            _datagramReadState.compare_exchange_weak(readState,
+                                                     READ_STATE(readIndex, numHeld),
+                                                     std::memory_order_acq_rel,
+                                                     std::memory_order_acquire)) {
+            done = true;
+        }
+    }
+
+    return numStale;
+}
+
+// Set the audio coding scheme.
+bool Urtp::setAudioCoding(AudioCoding audioCoding)
+{
+    bool success = false;
+
+    if ((audioCoding >= 0) && (audioCoding < MAX_NUM_AUDIO_CODINGS) &&
+        (_codecs[audioCoding].code != NULL) &&
+        (_audioCodings & URTP_AUDIO_CODING_BIT(audioCoding))) {
+        _audioCoding.store(audioCoding, std::memory_order_relaxed);
+        success = true;
+    }
+
+    return success;
+}
+
+// Get the audio coding scheme in use.
+Urtp::AudioCoding Urtp::getAudioCoding()
+{
+    return (AudioCoding) _audioCoding.load(std::memory_order_relaxed);
+}
+
+// Get the name of an audio coding scheme.
+const char *Urtp::getAudioCodingName(AudioCoding audioCoding)
+{
+    const char *pName = NULL;
+
+    if ((audioCoding >= 0) && (audioCoding < MAX_NUM_AUDIO_CODINGS) &&
+        (_codecs[audioCoding].code != NULL)) {
+        pName = _codecs[audioCoding].pName;
+    }
+
+    return pName;
+}
+
+// Get the maximum size of a datagram for an audio coding scheme.
+int Urtp::getMaxDatagramSize(AudioCoding audioCoding)
+{
+    int size = -1;
+
+    if ((audioCoding >= 0) && (audioCoding < MAX_NUM_AUDIO_CODINGS)) {
+        size = URTP_HEADER_SIZE + _codecs[audioCoding].maxBodySize;
+    }
+
+    return size;
+}
+
+// Switch discontinuous transmission on or off.
+void Urtp::setDtx(bool enable)
+{
+    _dtx.store(enable, std::memory_order_relaxed);
+}
+
+// Switch redundancy on or off.
+bool Urtp::setRedundancy(bool enable)
+{
+    bool success = false;
+
+    if (!enable || _redundancyAllowed) {
+        _redundancy.store(enable, std::memory_order_relaxed);
+        success = true;
+    }
+
+    return success;
+}
+
+// Set the stream ID.
+bool Urtp::setStreamId(int streamId)
+{
+    bool success = false;
+
+    if ((streamId >= 0) && (streamId < URTP_MAX_NUM_STREAMS)) {
+        _streamId = streamId;
+        success = true;
+    }
+
+    return success;
+}
+
+// Get the stream ID.
+int Urtp::getStreamId()
+{
+    return _streamId;
+}
+
+// Switch forward error correction on or off.
+bool Urtp::setFec(int groupSize, int numParity)
+{
+    bool success = false;
+
+    if (((groupSize == 0) || ((groupSize >= 2) && (groupSize <= URTP_FEC_MAX_GROUP_SIZE) && _fecAllowed)) &&
+        (numParity >= 1) && (numParity <= URTP_FEC_MAX_NUM_PARITY)) {
+        _fecGroupSize = groupSize;
+        _fecNumParity = numParity;
+        _fecNumDatagrams = 0;
+        success = true;
+    }
+
+    return success;
+}
+
+// Get the number of PARITY datagrams not written.
+unsigned int Urtp::getNumFecSkipped()
+{
+    return _numFecSkipped.load(std::memory_order_relaxed);
+}
+
+// Get the size of a datagram from its header.
+int Urtp::getDatagramSize(const char *datagram)
+{
+    return URTP_HEADER_SIZE + ((((int) (unsigned char) datagram[URTP_HEADER_SIZE - 2]) << 8) |
+                               (unsigned char) datagram[URTP_HEADER_SIZE - 1]);
 }
 
 // The number of datagrams available
 int Urtp::getUrtpDatagramsAvailable()
 {
-    return sizeof (_container) / sizeof (_container[0]) - _numDatagramsFree;
+    // Read state first: the read index can never overtake a
+    // write index that is loaded afterwards
+    unsigned int readState = _datagramReadState.load(std::memory_order_acquire);
+    unsigned int numDatagrams = numDatagramsBetween(_datagramWriteIndex.load(std::memory_order_acquire),
+                                                    READ_STATE_INDEX(readState));
+
+    // The encode thread may have dropped and replaced datagrams
+    // between the two loads
+    if (numDatagrams > MAX_NUM_DATAGRAMS) {
+        numDatagrams = MAX_NUM_DATAGRAMS;
+    }
+
+    return numDatagrams;
 }
 
 // The number of datagrams free
 int Urtp::getUrtpDatagramsFree()
 {
-    return _numDatagramsFree;
+    return MAX_NUM_DATAGRAMS - getUrtpDatagramsAvailable();
 }
 
 // The minimum number of datagrams free
@@ -25,6 +25,8 @@
 #ifndef _URTP_
 #define _URTP_
 
+#include <atomic>
+#include <sys/uio.h>
 #include <fir.h>
 
 /** Urtp class.
@@ -40,7 +42,7 @@
  * Byte  |  0  |  1  |  2  |  3  |  4  |  5  |  6  |  7  |
  * --------------------------------------------------------
  *  0    |               Sync byte = 0x5A                |
- *  1    |              Audio coding scheme              |
+ *  1    |     Stream ID       | Audio coding scheme     |
  *  2    |              Sequence number MSB              |
  *  3    |              Sequence number LSB              |
  *  4    |                Timestamp MSB                  |
@@ -58,9 +60,20 @@
  *
  * - Sync byte is always 0x5A, used to sync a frame over a
  *   streamed connection (e.g. TCP).
+ * - Stream ID is 0 unless several streams (e.g. both channels
+ *   of a stereo microphone pair) are being sent over the same
+ *   connection, in which case it tells them apart (see
+ *   setStreamId()); each stream has its own sequence numbers.
  * - Audio coding scheme is one of:
  *   - PCM_SIGNED_16_BIT (0)
  *   - UNICAM_COMPRESSED_8_BIT (1)
+ *   - UNICAM_COMPRESSED_6_BIT (2)
+ *   - UNICAM_COMPRESSED_4_BIT (3)
+ *   - SILENCE (4)
+ *   - UNICAM_RICE_8_BIT (5)
+ *   - LPC_RESIDUAL_6_BIT (6)
+ *   - PARITY (7)
+ *   - REDUNDANT (8)
  * - Sequence number is a 16 bit sequence number, incremented
  *   on sending of each datagram.
  * - Timestamp is a uSecond timestamp representing the moment
@@ -68,9 +81,12 @@
  * - Number of bytes to follow is the size of the audio payload
  *   the follows in this datagram.
  *
- * There are two audio coding schemes.  The default, and most
- * efficient, is 8 bit UNICAM compression.  If UNICAM is not
- * used, 16 bit RAW PCM is used.
+ * The default audio coding scheme is 8 bit UNICAM compression.
+ * If UNICAM is not used, 16 bit RAW PCM is used.  Where the link
+ * is poor, 6 or 4 bit UNICAM compression can be used for lower
+ * rates, at the expense of quality.  The coding scheme can be
+ * changed between datagrams (see setAudioCoding()) so each
+ * datagram is only as long as the header says it is.
  *
  * When the audio coding scheme is PCM_SIGNED_16_BIT,
  * the payload is as follows:
@@ -133,6 +149,129 @@
  * bytes in total, plus a 14 byte header gives an overall data
  * rate of 132 kbits/s.
  *
+ * When the audio coding scheme is UNICAM_COMPRESSED_6_BIT or
+ * UNICAM_COMPRESSED_4_BIT the payload is laid out in the same way,
+ * with a shift byte after every second block, but the samples of
+ * each block are bit-packed, most significant bit first, into 12
+ * bytes (6 bit) or 8 bytes (4 bit).  For instance, with 6 bit
+ * samples:
+ *
+ * Byte  |  0  |  1  |  2  |  3  |  4  |  5  |  6  |  7  |
+ *--------------------------------------------------------
+ *  14   |          Block 0, Sample 0        | B0 S1 hi  |
+ *  15   |       B0 S1 lo        |     B0 S2 hi          |
+ *  16   | B0 S2 lo  |          Block 0, Sample 3        |
+ *       |                     ...                       |
+ *  25   | B0 S14 lo |          Block 0, Sample 15       |
+ *  26   |     Block 0 shift   |     Block 1 shift       |
+ *  27   |          Block 1, Sample 0        | B1 S1 hi  |
+ *       |                     ...                       |
+ *
+ * ...giving 250 bytes, 105.6 kbits/s with the header, while 4 bit
+ * samples, two to a byte with the first in the upper nibble, give
+ * 170 bytes, 73.6 kbits/s with the header.  The shift values are
+ * still those that take the [16 bit] decoded sample down to the
+ * coded sample size.
+ *
+ * When discontinuous transmission is switched on (see setDtx())
+ * and the audio has been quiet for a while, datagrams are sent with
+ * the audio coding scheme SILENCE and no payload, 14 bytes in all;
+ * the sequence number and timestamp carry on as normal so the
+ * receiving end can fill the gap with silence or comfort noise.
+ *
+ * When the audio coding scheme is UNICAM_RICE_8_BIT the payload
+ * is a lossless recoding of a UNICAM_COMPRESSED_8_BIT payload, one
+ * UNICAM block after another, bit-packed most significant bit first
+ * and padded with zeroes to a whole byte at the end:
+ *
+ * Bits  | 4          | 4          | variable                        |
+ * -------------------------------------------------------------------
+ *       | Block shift| Parameter  | Block samples 0 to 15           |
+ *
+ * ...where, if the parameter is 15, each sample is simply 8 bits,
+ * otherwise the parameter is the Rice parameter k (0 to 6) and each
+ * sample s is mapped to u = 2s (s >= 0) or -2s - 1 (s < 0) and then
+ * coded as u >> k one bits, a zero bit, then the bottom k bits of u.
+ * The payload is at most 340 bytes, but usually much less, hence the
+ * payload length in the header must be used to find its end.
+ *
+ * When the audio coding scheme is LPC_RESIDUAL_6_BIT the payload
+ * is as follows:
+ *
+ * Byte  |  0  |  1  |  2  |  3  |  4  |  5  |  6  |  7  |
+ *--------------------------------------------------------
+ *  14   |                Predictor order                |
+ *  15   |               History sample 0 MSB            |
+ *  16   |               History sample 0 LSB            |
+ *  17   |               History sample 1 MSB            |
+ *  18   |               History sample 1 LSB            |
+ *  19   |  Residual blocks as UNICAM_COMPRESSED_6_BIT    |
+ *       |                     ...                       |
+ *
+ * ...where the history samples are the last two [big-endian, signed
+ * 16 bit] decoded samples that came before this datagram, oldest
+ * first, and the residual blocks are laid out exactly as the sample
+ * blocks of UNICAM_COMPRESSED_6_BIT, 255 bytes in all, 107.6 kbits/s
+ * with the header.  Each decoded sample is the prediction p from the
+ * previous two decoded samples s1 (the most recent) and s2 plus the
+ * 6 bit residual shifted up by the block shift, limited to 16 bits,
+ * where p is 0 for predictor order 0, s1 for order 1 and 2 * s1 - s2
+ * for order 2.  Since the residual of a good prediction is smaller
+ * than the sample, this gives quality close to that of
+ * UNICAM_COMPRESSED_8_BIT at the rate of UNICAM_COMPRESSED_6_BIT.
+ *
+ * When redundancy is switched on (see setRedundancy()) each datagram,
+ * other than a SILENCE one, carries a low rate copy of the audio of
+ * the datagram before it, in the style of RFC 2198, so that the
+ * receiving end can conceal the loss of a single datagram.  The audio
+ * coding scheme is then REDUNDANT and the payload is as follows:
+ *
+ * Byte  |  0  |  1  |  2  |  3  |  4  |  5  |  6  |  7  |
+ *--------------------------------------------------------
+ *  14   |             Primary audio coding              |
+ *  15   |           Primary payload length MSB          |
+ *  16   |           Primary payload length LSB          |
+ *  17   |    Primary payload, as for its audio coding   |
+ *       |                     ...                       |
+ *  N    |  Copy of the previous block, may be absent    |
+ *       |                     ...                       |
+ *
+ * ...where the copy is the previous block, gain applied but not
+ * pre-emphasised, decimated by two (each sample is the mean of two)
+ * and coded as UNICAM_COMPRESSED_4_BIT would code it, but with half
+ * the number of UNICAM blocks, each of them covering 2 ms, so 85 bytes.
+ * The copy is absent (the payload ends with the primary payload) if
+ * the previous datagram was SILENCE or could not be sent.  Over
+ * UNICAM_COMPRESSED_8_BIT this adds 88 bytes, 35.2 kbits/s, a quarter.
+ *
+ * When forward error correction is switched on (see setFec()), after
+ * every group of N datagrams of a stream one or two datagrams with
+ * the audio coding scheme PARITY are sent.  These carry the sequence
+ * number and timestamp of the first datagram of the group (the
+ * sequence number is not incremented for them) and the payload is
+ * as follows:
+ *
+ * Byte  |  0  |  1  |  2  |  3  |  4  |  5  |  6  |  7  |
+ *--------------------------------------------------------
+ *  14   |             Group size N (2 to 32)            |
+ *  15   |              Parity index (0 or 1)            |
+ *  16   |                 Parity byte 0                 |
+ *       |                     ...                       |
+ *  N    |                 Parity byte M                 |
+ *
+ * ...where the parity is worked out over bytes 1 onwards of each
+ * datagram of the group, header included (so the audio coding scheme,
+ * sequence number, timestamp and payload length of a lost datagram
+ * come back with it), each datagram padded with zeroes to the length
+ * of the longest one.  With parity index 0 (P) each parity byte is
+ * the exclusive-or of the bytes of the N datagrams, which is enough
+ * to reconstruct any one lost datagram of the group; with parity
+ * index 1 (Q) it is the sum, in GF(2^8) with the polynomial
+ * x^8 + x^4 + x^3 + x^2 + 1 (0x11D), of the byte of datagram i
+ * multiplied by 2 to the power N - 1 - i, so that with P and Q
+ * together any two lost datagrams of the group can be reconstructed,
+ * as with RAID 6.  The overhead is one or two datagrams in N.
+ *
  * The receiving end should be able to reconstruct an audio
  * stream from this.
  */
@@ -141,7 +280,14 @@ class Urtp {
 public:
 
     /** The audio sampling frequency in Hz.
-     * This is the frequency of the WS signal on the I2S interface
+     * This is the frequency of the WS signal on the I2S interface.
+     * 8000, 16000, 32000 and 48000 are supported; since everything
+     * that depends on it is worked out at compile time, and fir.cpp
+     * has to be built for the same value, set it on the command line
+     * (e.g. make SAMPLING_FREQUENCY=48000) rather than changing it
+     * here.  The sizes and data rates given above are for 16000 Hz.
+     * There is no run-time choice of rate: URTP doesn't tell the
+     * receiver the rate, so both ends must be built for the same one.
      */
 #   ifndef SAMPLING_FREQUENCY
 #    define SAMPLING_FREQUENCY 16000
@@ -153,11 +299,27 @@ public:
 #    define BLOCK_DURATION_MS 20
 #   endif
 
-    /** The number of bits that a sample is coded into for UNICAM.
-     * Only 8 is supported.
+    /** The number of bits that a sample is coded into for
+     * UNICAM_COMPRESSED_8_BIT.  Only 8 is supported; the
+     * other sizes have their own audio coding schemes.
      */
 #   ifndef UNICAM_CODED_SAMPLE_SIZE_BITS
 #    define UNICAM_CODED_SAMPLE_SIZE_BITS 8
+#   endif
+
+    /** The number of bits that a residual is coded into for
+     * LPC_RESIDUAL_6_BIT.
+     */
+#   ifndef URTP_LPC_CODED_SAMPLE_SIZE_BITS
+#    define URTP_LPC_CODED_SAMPLE_SIZE_BITS 6
+#   endif
+
+    /** The highest order of fixed predictor that LPC_RESIDUAL_6_BIT
+     * will choose from for each datagram, 0 to 2; higher orders cost
+     * a little more encode time.
+     */
+#   ifndef URTP_LPC_MAX_ORDER
+#    define URTP_LPC_MAX_ORDER 2
 #   endif
 
     /** The maximum number of URTP datagrams that will be stored
@@ -166,6 +328,51 @@ public:
      */
 #   ifndef MAX_NUM_DATAGRAMS
 #    define MAX_NUM_DATAGRAMS 250
+#   endif
+
+    /** Discontinuous transmission: a block is quiet if its peak,
+     * before any gain is applied, needs no more than this many
+     * bits (including the sign) of the 24 bit input sample;
+     * 12 is around -66 dBFS.
+     */
+#   ifndef URTP_DTX_SILENCE_BITS
+#    define URTP_DTX_SILENCE_BITS 12
+#   endif
+
+    /** Discontinuous transmission: the number of quiet blocks
+     * that are still sent as audio before SILENCE datagrams
+     * begin, so that the tails of words aren't cut off.
+     */
+#   ifndef URTP_DTX_HANGOVER_BLOCKS
+#    define URTP_DTX_HANGOVER_BLOCKS (200 / BLOCK_DURATION_MS)
+#   endif
+
+    /** The number of bits that a sample of the copy of the
+     * previous block in a REDUNDANT datagram is coded into,
+     * 4 or 6.
+     */
+#   ifndef URTP_REDUNDANT_CODED_SAMPLE_SIZE_BITS
+#    define URTP_REDUNDANT_CODED_SAMPLE_SIZE_BITS 4
+#   endif
+
+    /** Forward error correction: the largest number of
+     * datagrams that may be protected as one group.
+     */
+#   ifndef URTP_FEC_MAX_GROUP_SIZE
+#    define URTP_FEC_MAX_GROUP_SIZE 32
+#   endif
+
+    /** Forward error correction: the largest number of parity
+     * datagrams that may be sent for each group (P and Q).
+     */
+#   define URTP_FEC_MAX_NUM_PARITY 2
+
+    /** The size of a cache line in bytes; the datagram read and
+     * write indexes are kept this far apart so that the encode and
+     * send threads don't fight over the same cache line.
+     */
+#   ifndef URTP_CACHE_LINE_SIZE
+#    define URTP_CACHE_LINE_SIZE 64
 #   endif
 
     /** The desired number of unused bits to keep in the audio processing
@@ -224,10 +431,15 @@ public:
      */
 #   define UNICAM_BLOCKS_PER_BLOCK       (SAMPLES_PER_BLOCK / SAMPLES_PER_UNICAM_BLOCK)
 
-    /** UNICAM parameters: the size of two UNICAM blocks (has to be a two since
-     * the shift nibble for two blocks are encoded into one byte).
+    /** UNICAM parameters: the size of two UNICAM blocks of a given coded
+     * sample size (has to be a two since the shift nibble for two blocks
+     * are encoded into one byte).
      */
-#   define TWO_UNICAM_BLOCKS_SIZE        (((SAMPLES_PER_UNICAM_BLOCK * UNICAM_CODED_SAMPLE_SIZE_BITS) / 8) * 2 + 1)
+#   define TWO_UNICAM_BLOCKS_SIZE_BITS(bits) (((SAMPLES_PER_UNICAM_BLOCK * (bits)) / 8) * 2 + 1)
+
+    /** UNICAM parameters: the size of two UNICAM blocks.
+     */
+#   define TWO_UNICAM_BLOCKS_SIZE        TWO_UNICAM_BLOCKS_SIZE_BITS(UNICAM_CODED_SAMPLE_SIZE_BITS)
 
     /** The maximum size that we want a decoded unicam sample to end up.
      */
@@ -242,29 +454,129 @@ public:
      */
 #   define URTP_SAMPLE_SIZE        2
 
-#   ifndef DISABLE_UNICAM
-    /** URTP parameters: the maximum size of the payload.
+    /** URTP parameters: the maximum size of a PCM_SIGNED_16_BIT
+     * payload.
      */
-#    define URTP_BODY_SIZE         ((UNICAM_BLOCKS_PER_BLOCK / 2) * TWO_UNICAM_BLOCKS_SIZE)
-#   else
-    /** URTP parameters: the maximum size of the payload.
+#   define URTP_PCM_BODY_SIZE      (URTP_SAMPLE_SIZE * SAMPLES_PER_BLOCK)
+
+    /** URTP parameters: the maximum size of a UNICAM_COMPRESSED_8_BIT
+     * payload.
      */
-#    define URTP_BODY_SIZE         (URTP_SAMPLE_SIZE * SAMPLES_PER_BLOCK)
-#   endif
+#   define URTP_UNICAM_BODY_SIZE   ((UNICAM_BLOCKS_PER_BLOCK / 2) * TWO_UNICAM_BLOCKS_SIZE)
 
-    /** URTP parameters: the size of a URTP datagram.
+    /** URTP parameters: the maximum size of a UNICAM_COMPRESSED_6_BIT
+     * payload.
+     */
+#   define URTP_UNICAM_6_BODY_SIZE ((UNICAM_BLOCKS_PER_BLOCK / 2) * TWO_UNICAM_BLOCKS_SIZE_BITS(6))
+
+    /** URTP parameters: the maximum size of a UNICAM_COMPRESSED_4_BIT
+     * payload.
+     */
+#   define URTP_UNICAM_4_BODY_SIZE ((UNICAM_BLOCKS_PER_BLOCK / 2) * TWO_UNICAM_BLOCKS_SIZE_BITS(4))
+
+    /** URTP parameters: the maximum size of a UNICAM_RICE_8_BIT
+     * payload, which is when every block has to be sent verbatim.
+     */
+#   define URTP_UNICAM_RICE_BODY_SIZE (UNICAM_BLOCKS_PER_BLOCK * (SAMPLES_PER_UNICAM_BLOCK + 1))
+
+    /** URTP parameters: the maximum size of a LPC_RESIDUAL_6_BIT
+     * payload: the predictor order and two history samples, then
+     * the residual blocks.
+     */
+#   define URTP_LPC_BODY_SIZE      (5 + ((UNICAM_BLOCKS_PER_BLOCK / 2) * TWO_UNICAM_BLOCKS_SIZE_BITS(URTP_LPC_CODED_SAMPLE_SIZE_BITS)))
+
+    /** URTP parameters: the size of the copy of the previous block
+     * in a REDUNDANT payload, which is decimated by two and so needs
+     * only half the number of UNICAM blocks.
+     */
+#   define URTP_REDUNDANT_COPY_SIZE ((UNICAM_BLOCKS_PER_BLOCK / 4) * TWO_UNICAM_BLOCKS_SIZE_BITS(URTP_REDUNDANT_CODED_SAMPLE_SIZE_BITS))
+
+    /** URTP parameters: the maximum size of a REDUNDANT payload: the
+     * primary audio coding and payload length, the largest primary
+     * payload, which is PCM_SIGNED_16_BIT, then the copy.
+     */
+#   define URTP_REDUNDANT_BODY_SIZE (3 + URTP_PCM_BODY_SIZE + URTP_REDUNDANT_COPY_SIZE)
+
+    /** URTP parameters: the number of bytes of a datagram that
+     * PARITY protects: all but the sync byte of the largest,
+     * which is REDUNDANT.
+     */
+#   define URTP_FEC_PROTECTED_SIZE (URTP_HEADER_SIZE - 1 + URTP_REDUNDANT_BODY_SIZE)
+
+    /** URTP parameters: the maximum size of a PARITY payload:
+     * the group size and parity index, then the parity.
+     */
+#   define URTP_PARITY_BODY_SIZE   (2 + URTP_FEC_PROTECTED_SIZE)
+
+    /** URTP parameters: the maximum size of the payload of any of
+     * the audio coding schemes; this is PARITY, which is a little
+     * larger than the largest of the audio payloads, REDUNDANT.
+     */
+#   define URTP_BODY_SIZE          URTP_PARITY_BODY_SIZE
+
+    /** URTP parameters: the maximum size of a URTP datagram with
+     * everything switched on; the datagrams in the store are
+     * usually smaller, see getDatagramStoreSize().
      */
 #   define URTP_DATAGRAM_SIZE       (URTP_HEADER_SIZE + URTP_BODY_SIZE)
 
-    /** The amount of datagram memory which must be supplied for URTP
-     * to operate.
+    /** The amount of datagram memory which is enough for URTP to
+     * operate whatever it is asked to do, i.e. what init() needs
+     * with its defaults.
      */
 #   define URTP_DATAGRAM_STORE_SIZE (URTP_DATAGRAM_SIZE * MAX_NUM_DATAGRAMS)
 
+    /** The bit for an audio coding scheme in the audioCodings
+     * parameter of init().
+     */
+#   define URTP_AUDIO_CODING_BIT(audioCoding) (1U << (audioCoding))
+
+    /** A value for the audioCodings parameter of init() that
+     * allows every audio coding scheme.
+     */
+#   define URTP_ALL_AUDIO_CODINGS  0xFFFFFFFFU
+
     /** URTP parameters: the sync byte.
      */
 #   define SYNC_BYTE               0x5a
 
+    /** The number of streams that can be told apart by the
+     * stream ID in the header.
+     */
+#   define URTP_MAX_NUM_STREAMS    16
+
+    /** The layouts of raw audio that codeAudioBlock() accepts.
+     * In all cases the sample is 24 bits, little endian; for
+     * the stereo layouts only the left channel is used.
+     */
+    typedef enum {
+        RAW_AUDIO_STEREO_S32_LE = 0, //!< two uint32_t's per frame, the
+                                     //!< sample in the upper 24 bits
+                                     //!< (Philips I2S 24-bit format).
+        RAW_AUDIO_MONO_S32_LE = 1,   //!< one uint32_t per frame, the
+                                     //!< sample in the upper 24 bits.
+        RAW_AUDIO_STEREO_S24_3LE = 2,//!< two packed 3-byte samples per frame.
+        RAW_AUDIO_MONO_S24_3LE = 3   //!< one packed 3-byte sample per frame.
+    } RawAudioFormat;
+
+    /** The audio coding schemes, the value of which goes into
+     * the lower nibble of the second byte of the header of each
+     * datagram, hence there can be no more than 16 of them.
+     */
+    typedef enum {
+        PCM_SIGNED_16_BIT = 0,
+        UNICAM_COMPRESSED_8_BIT = 1,
+        UNICAM_COMPRESSED_6_BIT = 2,
+        UNICAM_COMPRESSED_4_BIT = 3,
+        SILENCE = 4,             //!< sent in place of quiet audio, never selected.
+        UNICAM_RICE_8_BIT = 5,
+        LPC_RESIDUAL_6_BIT = 6,
+        PARITY = 7,              //!< forward error correction, never selected.
+        REDUNDANT = 8,           //!< audio plus a copy of the previous block,
+                                 //!< never selected.
+        MAX_NUM_AUDIO_CODINGS
+    } AudioCoding;
+
     /** Constructor.
      *
      * @param datagramReadyCb          Callback to be invoked once a URTP datagram
@@ -288,20 +600,47 @@ public:
      */
     ~Urtp();
 
-    /** Initialise URTP.
+    /** Initialise URTP.  Each datagram in the store has room for
+     * the largest datagram that the session may produce, so say
+     * here what may be used: setAudioCoding(), setRedundancy()
+     * and setFec() will then refuse anything else.
      *
-     * @param datagramStorage  a pointer to URTP_DATAGRAM_STORE_SIZE of
-     *                         memory for datagram buffers.
+     * @param datagramStorage  a pointer to getDatagramStoreSize()
+     *                         of memory for datagram buffers, given
+     *                         the same audioCodings, redundancy and
+     *                         fec.
      * @param audioShiftMax    the maximum audio shift, default is
      *                         AUDIO_MAX_SHIFT_BITS, lower numbers will
      *                         lower the maximum gain.
+     * @param audioCodings     the audio coding schemes that may be
+     *                         selected, URTP_AUDIO_CODING_BIT()s
+     *                         OR'ed together; the default is all
+     *                         of them.
+     * @param redundancy       true if redundancy may be switched on.
+     * @param fec              true if forward error correction may
+     *                         be switched on.
      * @return                 true if successful, otherwise false.
      */
-    bool init(void *datagramStorage, int audioShiftMax = AUDIO_MAX_SHIFT_BITS);
+    bool init(void *datagramStorage, int audioShiftMax = AUDIO_MAX_SHIFT_BITS,
+              unsigned int audioCodings = URTP_ALL_AUDIO_CODINGS,
+              bool redundancy = true, bool fec = true);
+
+    /** Get the amount of datagram memory that init() needs.
+     *
+     * @param audioCodings the audio coding schemes that may be
+     *                     selected, as passed to init().
+     * @param redundancy   true if redundancy may be switched on.
+     * @param fec          true if forward error correction may
+     *                     be switched on.
+     * @return             the size of the datagram store in bytes,
+     *                     no more than URTP_DATAGRAM_STORE_SIZE.
+     */
+    static int getDatagramStoreSize(unsigned int audioCodings = URTP_ALL_AUDIO_CODINGS,
+                                    bool redundancy = true, bool fec = true);
 
     /** URTP encode an audio block.
-     * Only the samples from the LEFT CHANNEL (i.e. the even uint32_t's) are
-     * used.
+     * For stereo formats only the samples from the LEFT CHANNEL (i.e. the
+     * even uint32_t's) are used.
      *
      * The Philips I2S protocol (24-bit frame with CPOL = 0 to read
      * the data on the rising edge) looks like this.  Each data bit
@@ -319,11 +658,18 @@ public:
      *              23  22       1   0             23  22       1   0
      *              Left channel data              Right channel data
      *
-     * @param rawAudio  a pointer to a buffer of SAMPLES_PER_BLOCK * 2 uint32_t's
-     *                  (i.e. stereo) of Philips I2S protocol data: 24-bit frame
-     *                  with CPOL = 0.
+     * A device that can deliver mono, or packed 24-bit samples, saves us
+     * reading (and the driver copying) the unused right channel; pass
+     * the matching format in that case.
+     *
+     * @param rawAudio  a pointer to a buffer of SAMPLES_PER_BLOCK frames
+     *                  of audio in the given format; by default that is
+     *                  SAMPLES_PER_BLOCK * 2 uint32_t's (i.e. stereo) of
+     *                  Philips I2S protocol data: 24-bit frame with CPOL = 0.
+     * @param format    the layout of rawAudio.
      */
-    void codeAudioBlock(const uint32_t *rawAudio);
+    void codeAudioBlock(const void *rawAudio,
+                        RawAudioFormat format = RAW_AUDIO_STEREO_S32_LE);
 
     /** Call this to obtain a pointer to a URTP datagram that has been
      * prepared.
@@ -340,6 +686,49 @@ public:
      */
     void setUrtpDatagramAsRead(const char *datagram);
 
+    /** Call this to obtain all of the URTP datagrams that are ready,
+     * oldest first, so that they can be sent with a single
+     * writev()/sendmsg().  The datagrams are held for the caller
+     * until they are freed with setUrtpDatagramsAsRead(); if some
+     * are still held from a previous call then those same datagrams
+     * are returned again (and no others).
+     *
+     * @param iov             an array of at least maxNumDatagrams
+     *                        entries; one entry is filled in per
+     *                        datagram.
+     * @param maxNumDatagrams the maximum number of datagrams to return.
+     * @param maxNumBytes     if not 0, the maximum total size of the
+     *                        datagrams to return, e.g. the size of the
+     *                        socket buffer; at least one datagram is
+     *                        returned however large it is.
+     * @return                the number of entries of iov filled in,
+     *                        0 if there are no datagrams ready.
+     */
+    int getUrtpDatagrams(struct iovec *iov, int maxNumDatagrams, int maxNumBytes = 0);
+
+    /** Call this to free URTP datagrams obtained with getUrtpDatagrams(),
+     * oldest first, moving the read pointer on.
+     *
+     * @param numDatagrams  the number of datagrams to free; must be no
+     *                      more than were returned by getUrtpDatagrams().
+     */
+    void setUrtpDatagramsAsRead(int numDatagrams);
+
+    /** Call this to drop, in one go, the URTP datagrams at the
+     * front of the queue that are too old to be worth sending,
+     * i.e. those with a timestamp earlier than oldestTimestamp,
+     * whether or not they are held after getUrtpDatagrams();
+     * the caller must not be part way through sending the first
+     * held datagram, since the rest of it would never be sent.
+     * Send thread only.
+     *
+     * @param oldestTimestamp the timestamp, in microseconds on the
+     *                        same clock as the datagram timestamps,
+     *                        of the oldest datagram to keep.
+     * @return                the number of datagrams dropped.
+     */
+    int dropStaleUrtpDatagrams(long long int oldestTimestamp);
+
     /** Call this to get the number of URTP datagrams available.
      *
      * @return   the number of datagrams available.
@@ -365,6 +754,115 @@ public:
      */
     int getUrtpSequenceNumber();
 
+    /** Set the audio coding scheme; this may be called at any
+     * time, from any thread, and takes effect from the next
+     * datagram that is encoded.
+     *
+     * @param audioCoding the audio coding scheme to use.
+     * @return            true if successful, false if
+     *                    audioCoding is not a scheme that
+     *                    can be selected or was not allowed
+     *                    for at init().
+     */
+    bool setAudioCoding(AudioCoding audioCoding);
+
+    /** Get the audio coding scheme in use.
+     *
+     * @return the audio coding scheme in use.
+     */
+    AudioCoding getAudioCoding();
+
+    /** Get the name of an audio coding scheme.
+     *
+     * @param audioCoding the audio coding scheme.
+     * @return            the name of the audio coding scheme,
+     *                    NULL if there is no such scheme or
+     *                    it cannot be selected.
+     */
+    static const char *getAudioCodingName(AudioCoding audioCoding);
+
+    /** Get the maximum size of a datagram coded with a given
+     * audio coding scheme.
+     *
+     * @param audioCoding the audio coding scheme.
+     * @return            the maximum size of a datagram in
+     *                    bytes, header included, -1 if there
+     *                    is no such scheme.
+     */
+    static int getMaxDatagramSize(AudioCoding audioCoding);
+
+    /** Get the size of a datagram from its header.
+     *
+     * @param datagram a pointer to a URTP datagram.
+     * @return         the size of the datagram in bytes,
+     *                 header included.
+     */
+    static int getDatagramSize(const char *datagram);
+
+    /** Switch discontinuous transmission on or off; this may be
+     * called at any time, from any thread.  When it is on, once
+     * URTP_DTX_HANGOVER_BLOCKS quiet blocks have been sent
+     * any further quiet blocks are sent as SILENCE datagrams.
+     *
+     * @param enable true to switch discontinuous transmission on.
+     */
+    void setDtx(bool enable);
+
+    /** Switch redundancy on or off; this may be called at
+     * any time, from any thread.  When it is on each datagram
+     * is sent as REDUNDANT, carrying a low rate copy of the
+     * previous block of audio as well as its own.
+     *
+     * @param enable true to switch redundancy on.
+     * @return       true if successful, false if redundancy
+     *               was not allowed for at init().
+     */
+    bool setRedundancy(bool enable);
+
+    /** Set the stream ID that goes into the header of each
+     * datagram; call this before audio is coded.
+     *
+     * @param streamId the stream ID, 0 to URTP_MAX_NUM_STREAMS - 1.
+     * @return         true if successful, else false.
+     */
+    bool setStreamId(int streamId);
+
+    /** Get the stream ID that goes into the header of each
+     * datagram.
+     *
+     * @return the stream ID.
+     */
+    int getStreamId();
+
+    /** Switch forward error correction on or off; call this
+     * before audio is coded.  When it is on, after every
+     * groupSize datagrams numParity PARITY datagrams are sent
+     * from which the server can reconstruct up to numParity
+     * datagrams of the group that were lost.  A group in which
+     * a datagram had to be dropped here, because the store was
+     * full, is abandoned.
+     *
+     * @param groupSize the number of datagrams in a group,
+     *                  2 to URTP_FEC_MAX_GROUP_SIZE, or 0
+     *                  to switch forward error correction off.
+     * @param numParity the number of PARITY datagrams to send
+     *                  for each group, 1 to
+     *                  URTP_FEC_MAX_NUM_PARITY.
+     * @return          true if successful, false if the
+     *                  parameters are out of range or forward
+     *                  error correction was not allowed for at
+     *                  init().
+     */
+    bool setFec(int groupSize, int numParity = 1);
+
+    /** Get the total number of PARITY datagrams that were not
+     * written because the store was full: parity never takes
+     * the place of audio.  This may be called from any thread.
+     *
+     * @return the number of PARITY datagrams skipped.
+     */
+    unsigned int getNumFecSkipped();
+
 protected:
     /** The number of valid bytes in each mono sample of audio received
      * on the I2S stream (the number of bytes received may be larger
@@ -372,39 +870,120 @@ protected:
      */
 #   define MONO_INPUT_SAMPLE_SIZE  3
 
-    /** The audio coding schemes.
+    /** An audio codec: an entry in the table of audio coding
+     * schemes, indexed by AudioCoding.
      */
-    typedef enum {
-        PCM_SIGNED_16_BIT = 0,
-        UNICAM_COMPRESSED_8_BIT = 1
-    } AudioCoding;
+    typedef struct {
+        const char *pName;                          //!< the name of the scheme.
+        int maxBodySize;                            //!< the most payload the coder
+                                                    //!< can produce from one block.
+        int (Urtp::*code)(int *monoSamples, char *dest); //!< the coder, taking a
+                                                         //!< block of mono samples;
+                                                         //!< NULL if the scheme
+                                                         //!< cannot be selected.
+    } Codec;
 
-    /** The possible states for a container.
-     *
-     * The normal life cycle for a container is:
-     *
-     * EMPTY
-     * WRITING
-     * READY_TO_READ
-     * READING
-     * EMPTY
+    /** The audio codecs, indexed by AudioCoding.
      */
-    typedef enum {
-        CONTAINER_STATE_EMPTY,
-        CONTAINER_STATE_WRITING,
-        CONTAINER_STATE_READY_TO_READ,
-        CONTAINER_STATE_READING,
-        MAX_NUM_CONTAINER_STATES
-    } ContainerState;
-
-    /** A linked list container, used to manage datagrams
-     * as a FIFO.
-     */
-    typedef struct ContainerTag {
-        ContainerState state;
-        void *contents;
-        ContainerTag *next;
-    } Container;
+    static const Codec _codecs[MAX_NUM_AUDIO_CODINGS];
+
+    /** The audio coding scheme in use.
+     */
+    std::atomic<int> _audioCoding;
+
+    /** The audio coding schemes allowed for at init(), as
+     * URTP_AUDIO_CODING_BIT()s.
+     */
+    unsigned int _audioCodings;
+
+    /** True if redundancy was allowed for at init().
+     */
+    bool _redundancyAllowed;
+
+    /** True if forward error correction was allowed for
+     * at init().
+     */
+    bool _fecAllowed;
+
+    /** The stream ID, see setStreamId().
+     */
+    int _streamId;
+
+    /** True if discontinuous transmission is on.
+     */
+    std::atomic<bool> _dtx;
+
+    /** The number of bits (including the sign) needed by the
+     * peak of the last block of audio, before gain was applied.
+     */
+    int _audioPeakBits;
+
+    /** The number of quiet blocks in a row, counting
+     * no further than URTP_DTX_HANGOVER_BLOCKS + 1.
+     */
+    int _numQuietBlocks;
+
+    /** True while SILENCE datagrams are being sent.
+     */
+    bool _silent;
+
+    /** The last two samples decoded from LPC_RESIDUAL_6_BIT,
+     * oldest first, which the next datagram predicts from.
+     */
+    int _lpcHistory[2];
+
+    /** True if redundancy is on.
+     */
+    std::atomic<bool> _redundancy;
+
+    /** The copy of the last block to go into the next
+     * REDUNDANT datagram.
+     */
+    char _redundantCopy[URTP_REDUNDANT_COPY_SIZE];
+
+    /** The number of bytes in _redundantCopy, 0 if
+     * there is no copy to send.
+     */
+    int _redundantCopyLength;
+
+    /** Somewhere to code a block of audio into when there
+     * is no room for it in the datagram store, so that the
+     * coding state carries on as if it had been sent.
+     */
+    char _scratchDatagram[URTP_DATAGRAM_SIZE];
+
+    /** Forward error correction: the group size, 0 if off.
+     */
+    int _fecGroupSize;
+
+    /** Forward error correction: the number of PARITY datagrams
+     * to send for each group.
+     */
+    int _fecNumParity;
+
+    /** Forward error correction: the number of datagrams so far
+     * added to the group.
+     */
+    int _fecNumDatagrams;
+
+    /** Forward error correction: the length of the longest
+     * datagram of the group so far, less the sync byte.
+     */
+    int _fecLength;
+
+    /** Forward error correction: the header of the first
+     * datagram of the group.
+     */
+    char _fecHeader[URTP_HEADER_SIZE];
+
+    /** Forward error correction: the parity so far, P then Q.
+     */
+    unsigned char _fecParity[URTP_FEC_MAX_NUM_PARITY][URTP_FEC_PROTECTED_SIZE];
+
+    /** Forward error correction: the total number of PARITY
+     * datagrams skipped, see getNumFecSkipped().
+     */
+    std::atomic<unsigned int> _numFecSkipped;
 
     /** Callback to be called when a datagram has been populated.
      * The parameter is a pointer to the datagram.
@@ -421,11 +1000,6 @@ protected:
      */
     void(*_datagramOverflowStopCb)(int);
 
-    /** The number of samples that have been used so far in
-     * evaluation the audio bit-shift
-     */
-    int _audioShiftSampleCount;
-
     /** The minimum value of the number of unused bits
      */
     int _audioUnusedBitsMin;
@@ -443,10 +1017,6 @@ protected:
      */
     int _audioShiftMax;
 
-    /** Buffer for UNICAM coding.
-     */
-    int _unicamBuffer[SAMPLES_PER_UNICAM_BLOCK];
-
     /** The FIR pre-emphasis filter for unicam encoding
      */
     Fir _preemphasis;
@@ -455,52 +1025,86 @@ protected:
      */
     char *_datagramMemory;
 
-    /** A linked list to manage the datagrams, must have the same
-     * number of elements as gDatagram.
+    /** The distance between datagrams in _datagramMemory: the
+     * largest datagram that the session may produce.
      */
-    Container _container[MAX_NUM_DATAGRAMS];
+    int _datagramStride;
 
     /** A sequence number for the URTP datagrams.
      */
     int _sequenceNumber;
 
-    /** Pointer to the next container to write to.
+    /** The datagram store is managed as a single-producer
+     * single-consumer ring: the encode thread is the only
+     * writer of _datagramWriteIndex and the send thread is the
+     * only thread that claims and releases datagrams through
+     * _datagramReadState.  Indexes run from 0 to
+     * (MAX_NUM_DATAGRAMS * 2) - 1 so that a full ring can be
+     * told apart from an empty one.
+     *
+     * Padding keeps the write index, which changes every
+     * BLOCK_DURATION_MS, off the cache line of the read state.
      */
-    Container *_containerNextForWriting;
+    char _padBeforeWriteIndex[URTP_CACHE_LINE_SIZE];
 
-    /** Pointer to the first filled container for reading.
+    /** Index of the next datagram to be written (encode thread
+     * only, published with release semantics).
      */
-    Container *_containerNextForReading;
+    std::atomic<unsigned int> _datagramWriteIndex;
+
+    char _padBeforeReadState[URTP_CACHE_LINE_SIZE - sizeof(std::atomic<unsigned int>)];
+
+    /** The index of the oldest datagram that has not been freed
+     * in the upper 16 bits and the number of datagrams from
+     * there that the send thread is holding (i.e. is in the middle
+     * of sending) in the lower 16 bits.  Keeping the two together
+     * allows the encode thread to drop the oldest datagram, when
+     * overflowing, with a single compare-and-swap that can never
+     * succeed if the send thread has claimed that datagram.
+     */
+    std::atomic<unsigned int> _datagramReadState;
+
+    char _padAfterReadState[URTP_CACHE_LINE_SIZE - sizeof(std::atomic<unsigned int>)];
 
     /** Diagnostics: a count of the number of consecutive datagram
      * overflows that have occurred.
      */
     int _numDatagramOverflows;
 
-    /** Diagnostics: The current number of datagrams free.
+    /** Diagnostics: The minimum number of datagrams free
+     * (encode thread only).
      */
-    unsigned int _numDatagramsFree;
+    unsigned int _minNumDatagramsFree;
 
-    /** Diagnostics: The minimum number of datagrams free.
+    /** Diagnostics: the longest time taken to encode a block
+     * in microseconds.
      */
-    unsigned int _minNumDatagramsFree;
+    int _encodeDurationMax;
+
+    /** Diagnostics: the total time taken to encode the last
+     * _numEncodeDurations blocks in microseconds.
+     */
+    long long int _encodeDurationTotal;
 
-    /** Take an audio sample and from it produce a signed
-     * output that uses the maximum number of bits
-     * in a 32 bit word (hopefully) without clipping.
-     * The algorithm is as follows:
+    /** Diagnostics: the number of blocks in _encodeDurationTotal.
+     */
+    int _numEncodeDurations;
+
+    /** Take a block of audio samples and from them produce signed
+     * output that uses the maximum number of bits in a 32 bit word
+     * (hopefully) without clipping.  The algorithm is as follows:
      *
-     * Calculate how many of bits of the input value are unused.
-     * Add this to a rolling average of unused bits of length
-     * AUDIO_AVERAGING_INTERVAL_MILLISECONDS, which starts off at 0.
-     * Every AUDIO_AVERAGING_INTERVAL_MILLISECONDS work out whether.
-     * the average number of unused is too large and, if it is,
-     * increase the gain, or if it is too small, decrease the gain.
+     * Apply the current gain (shift) to every sample in the block
+     * while working out the smallest number of bits that are unused
+     * in any sample.  Then, once per block, work out whether that
+     * number is too large and, if it is, increase the gain (only once
+     * it has been too large for AUDIO_NUM_UP_SHIFTS_FOR_A_SHIFT
+     * blocks), or if it is too small, decrease the gain straight away.
      *
-     * @param monoSample a mono audio sample.
-     * @return           the output mono audio sample.
+     * @param monoSamples a pointer to SAMPLES_PER_BLOCK mono audio
+     *                    samples, which are processed in place.
      */
-     int processAudio(int monoSample);
+    void processAudioBlock(int *monoSamples);
 
     /** Take a stereo sample and return an int
      * containing a sample that will fit within
@@ -515,54 +1119,176 @@ protected:
      */
     inline int getMonoSample(const uint32_t *stereoSample);
 
-    /** Take a buffer of rawAudio and code the samples from
-     *  the left channel (i.e. the even uint32_t's) into dest.
+    /** Take a packed 3-byte little-endian sample and
+     * return it sign extended, as getMonoSample() would.
+     *
+     * @param sample a pointer to the 3 bytes of the sample.
+     * @return       the output mono audio sample.
+     */
+    inline int getPackedSample(const unsigned char *sample);
+
+    /** Take a block of samples and return the mono
+     * samples from it, as getMonoSample() would, using
+     * vector instructions where possible.
+     *
+     * @param rawAudio    a pointer to a buffer of
+     *                    SAMPLES_PER_BLOCK frames in the
+     *                    given format.
+     * @param format      the layout of rawAudio.
+     * @param monoSamples a pointer to SAMPLES_PER_BLOCK ints
+     *                    to put the mono samples in.
+     */
+    inline void getMonoSamples(const void *rawAudio, RawAudioFormat format,
+                               int *monoSamples);
+
+    /** Take a block of mono samples and get them ready for
+     * one of the UNICAM-style codings: processAudioBlock(), then
+     * scale them down to UNICAM_MAX_DECODED_SAMPLE_SIZE_BITS and
+     * apply the pre-emphasis filter.
+     *
+     * @param monoSamples     a pointer to SAMPLES_PER_BLOCK
+     *                        mono samples, as returned by
+     *                        getMonoSamples(); they are
+     *                        modified in place.
+     * @param filteredSamples a pointer to SAMPLES_PER_BLOCK
+     *                        ints to put the result in.
+     */
+    void preemphasiseBlock(int *monoSamples, int *filteredSamples);
+
+    /** Take a block of mono samples and code them into dest.
      *
      * Here we use the principles of NICAM coding, see
      * http:www.doc.ic.ac.uk/~nd/surprise_97/journal/vol2/aps2/
      * We take 1 ms of audio data, so 16 samples (SAMPLES_PER_UNICAM_BLOCK),
      * and work out the peak.  Then we shift all the samples in the
-     * block down so that they fit in just UNICAM_CODED_SAMPLE_SIZE_BITS.
+     * block down so that they fit in just codedBits.
      * Then we put the shift value in the lower four bits of the next
      * byte. In order to pack things neatly, the shift value for the
      * following block is encoded into the upper four bits, followed by
      * the shifted samples for that block, etc.
      *
+     * @param monoSamples a pointer to SAMPLES_PER_BLOCK
+     *                    mono samples, as returned by
+     *                    getMonoSamples(); they are
+     *                    modified in place.
+     * @param dest        a pointer to an empty datagram.
+     * @param codedBits   the number of bits to code each
+     *                    sample into, 1 to 8.
+     * @return            the number of bytes written to dest.
+      */
+    int codeUnicamBits(int *monoSamples, char *dest, int codedBits);
+
+    /** Code a block of mono samples with codeUnicamBits() into
+     * UNICAM_CODED_SAMPLE_SIZE_BITS.
+     *
      * This represents UNICAM_COMPRESSED_8_BIT.
      *
-     * @param rawAudio  a pointer to a buffer of
-     *                  SAMPLES_PER_BLOCK * 2 uint32_t's
-     *                  (i.e. stereo), each in Philips I2S
-     *                  24-bit format.
-     * @param dest      a pointer to an empty datagram.
-      */
-    int codeUnicam(const uint32_t *rawAudio, char *dest);
+     * @param monoSamples a pointer to SAMPLES_PER_BLOCK
+     *                    mono samples, modified in place.
+     * @param dest        a pointer to an empty datagram.
+     * @return            the number of bytes written to dest.
+     */
+    int codeUnicam(int *monoSamples, char *dest);
+
+    /** Code a block of mono samples with codeUnicamBits() into
+     * 6 bits.
+     *
+     * This represents UNICAM_COMPRESSED_6_BIT.
+     *
+     * @param monoSamples a pointer to SAMPLES_PER_BLOCK
+     *                    mono samples, modified in place.
+     * @param dest        a pointer to an empty datagram.
+     * @return            the number of bytes written to dest.
+     */
+    int codeUnicam6(int *monoSamples, char *dest);
+
+    /** Code a block of mono samples with codeUnicamBits() into
+     * 4 bits.
+     *
+     * This represents UNICAM_COMPRESSED_4_BIT.
+     *
+     * @param monoSamples a pointer to SAMPLES_PER_BLOCK
+     *                    mono samples, modified in place.
+     * @param dest        a pointer to an empty datagram.
+     * @return            the number of bytes written to dest.
+     */
+    int codeUnicam4(int *monoSamples, char *dest);
+
+    /** Code a block of mono samples with codeUnicam() and
+     * then recode the result losslessly, choosing for each
+     * UNICAM block the Rice parameter that gives the fewest
+     * bits or, if none is better than that, 8 bits a sample.
+     *
+     * This represents UNICAM_RICE_8_BIT.
+     *
+     * @param monoSamples a pointer to SAMPLES_PER_BLOCK
+     *                    mono samples, modified in place.
+     * @param dest        a pointer to an empty datagram.
+     * @return            the number of bytes written to dest.
+     */
+    int codeUnicamRice(int *monoSamples, char *dest);
+
+    /** Take a block of mono samples, as for codeUnicamBits(),
+     * and code the residual from a fixed low order predictor,
+     * the one of order 0 to URTP_LPC_MAX_ORDER that does best
+     * over the block, in place of the samples themselves.  The
+     * prediction is made from the samples as the decoder will
+     * reconstruct them so that coding errors do not accumulate.
+     *
+     * This represents LPC_RESIDUAL_6_BIT.
+     *
+     * @param monoSamples a pointer to SAMPLES_PER_BLOCK
+     *                    mono samples, modified in place.
+     * @param dest        a pointer to an empty datagram.
+     * @return            the number of bytes written to dest.
+     */
+    int codeLpc(int *monoSamples, char *dest);
 
-    /** Take a buffer of rawAudio and copy the samples from
-     * the left channel (i.e. the even uint32_t's) into dest.
-     * Each byte is passed through processAudio() before it
+    /** Take a block of mono samples and copy them into dest.
+     * Each sample is passed through processAudioBlock() before it
      * is coded.
      *
      * This represents PCM_SIGNED_16_BIT.
      *
-     * @param rawAudio  a pointer to a buffer of
-     *                  SAMPLES_PER_BLOCK * 2 uint32_t's
-     *                  (i.e. stereo), each in Philips I2S
-     *                  24-bit format.
-     * @param dest      a pointer to an empty datagram.
+     * @param monoSamples a pointer to SAMPLES_PER_BLOCK
+     *                    mono samples, as returned by
+     *                    getMonoSamples(); they are
+     *                    modified in place.
+     * @param dest        a pointer to an empty datagram.
+     */
+    int codePcm(int *monoSamples, char *dest);
+
+    /** Make the low rate copy of a block that goes into the next
+     * REDUNDANT datagram.
+     *
+     * @param monoSamples a pointer to SAMPLES_PER_BLOCK mono
+     *                    samples, as left by the coder.
+     * @param audioCoding the audio coding scheme that coded
+     *                    them.
+     * @param dest        a pointer to URTP_REDUNDANT_COPY_SIZE
+     *                    bytes to put the copy in.
+     * @return            the number of bytes written to dest.
      */
-    int codePcm(const uint32_t *rawAudio, char *dest);
+    int codeRedundantCopy(const int *monoSamples, int audioCoding, char *dest);
 
     /** Fill a datagram with the audio from one block.
-     * Only the samples from the left channel
-     * (i.e. the even uint32_t's) are used.
+     * For stereo formats only the samples from the
+     * left channel are used.
      *
      * @param rawAudio  a pointer to a buffer of
-     *                  SAMPLES_PER_BLOCK * 2 uint32_t's
-     *                  (i.e. stereo), each in Philips I2S
-     *                  24-bit format.
+     *                  SAMPLES_PER_BLOCK frames in the
+     *                  given format.
+     * @param format    the layout of rawAudio.
      */
-    void fillMonoDatagramFromBlock(const uint32_t *rawAudio);
+    void fillMonoDatagramFromBlock(const void *rawAudio, RawAudioFormat format);
+
+    /** Add a datagram that has just been written to the forward
+     * error correction group and, if that completes the group,
+     * write the PARITY datagrams for it.
+     *
+     * @param datagram  a pointer to the datagram.
+     */
+    void addToFecGroup(const char *datagram);
 
     /** For the UNICAM compression scheme, we need
      * the right shift operation to be arithmetic
@@ -574,39 +1300,58 @@ protected:
      */
     bool unicamTest();
 
-    /** Get the next container for writing.  Always returns
-     * something, even if it is necessary to overwrite old data.
-     * The container will be marked as WRITING.
+    /** Work out the largest datagram that a session may produce,
+     * which is the distance between datagrams in the store.
+     *
+     * @param audioCodings the audio coding schemes that may be
+     *                     selected, as passed to init().
+     * @param redundancy   true if redundancy may be switched on.
+     * @param fec          true if forward error correction may
+     *                     be switched on.
+     * @return             the largest datagram size in bytes,
+     *                     0 if no audio coding scheme that can
+     *                     be selected is allowed.
+     */
+    static int getDatagramStride(unsigned int audioCodings, bool redundancy, bool fec);
+
+    /** Move a datagram index on by one, wrapping as necessary.
      *
-     * @return a pointer to the container.
+     * @param index  a datagram index.
+     * @return       the next datagram index.
      */
-    inline Urtp::Container * getContainerForWriting();
+    inline unsigned int nextDatagramIndex(unsigned int index);
 
-    /** Set the given container as ready to read.
+    /** The number of datagrams between two datagram indexes.
      *
-     * @param container  a pointer to the container.
+     * @param writeIndex  the write index.
+     * @param readIndex   the read index.
+     * @return            the number of datagrams from readIndex up
+     *                    to but not including writeIndex.
      */
-    inline void setContainerAsReadyToRead(Urtp::Container * container);
+    inline unsigned int numDatagramsBetween(unsigned int writeIndex, unsigned int readIndex);
 
-    /** Get the next container for reading.  If there is a container,
-     * that can be read, it will be marked READING.  If there are no
-     * containers for reading, NULL will be returned.
+    /** Get a pointer to the datagram storage for a datagram index.
      *
-     * @return a pointer to the container, may be NULL.
+     * @param index  a datagram index.
+     * @return       a pointer to the datagram.
      */
-    inline Urtp::Container * getContainerForReading();
+    inline char * datagramAtIndex(unsigned int index);
 
-    /** Set the given container as read.
+    /** Get the next datagram for writing.  If the store is full
+     * the oldest datagram is dropped to make room, unless the send
+     * thread is in the middle of sending that datagram, in which
+     * case NULL is returned and the caller must discard its audio
+     * (overwriting a datagram that is on the wire would corrupt
+     * the stream).  Encode thread only.
      *
-     * @param container  a pointer to the container.
+     * @return a pointer to the datagram, may be NULL.
      */
-    inline void setContainerAsRead(Urtp::Container * container);
+    inline char * getDatagramForWriting();
 
-    /** Set the given container as empty.
-     *
-     * @param container  a pointer to the container.
+    /** Publish the datagram obtained from getDatagramForWriting()
+     * to the send thread.  Encode thread only.
      */
-    inline void setContainerAsEmpty(Urtp::Container * container);
+    inline void setDatagramAsWritten();
 
 };
 
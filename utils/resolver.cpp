@@ -0,0 +1,268 @@
+/* Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <utils.h>
+#include <log.h>
+#include <resolver.h>
+
+/* This file contains a DNS resolver which does its lookups in
+ * a background task, so that a slow lookup (e.g. over a cellular
+ * link) only holds up those that choose to wait for it, and keeps
+ * the addresses it finds so that reconnecting to a server doesn't
+ * need a lookup at all.
+ */
+
+/* ----------------------------------------------------------------
+ * TYPES
+ * -------------------------------------------------------------- */
+
+/** An entry in the address cache.
+ */
+typedef struct {
+    char url[RESOLVER_MAX_LEN_URL];  //!< the URL, empty if the entry is free.
+    struct sockaddr_storage address; //!< the address of the URL.
+    socklen_t addressLength;         //!< the length of address, 0 if
+                                     //!< it has not been found yet.
+    long long int lookupUSeconds;    //!< when address was found.
+    bool lookupWanted;               //!< true if a lookup has been asked for.
+    unsigned int numLookups;         //!< the number of lookups done, so
+                                     //!< that a waiter can tell when one
+                                     //!< has finished, whatever the outcome.
+} ResolverEntry;
+
+/* ----------------------------------------------------------------
+ * VARIABLES
+ * -------------------------------------------------------------- */
+
+// The address cache.
+static ResolverEntry gResolverCache[RESOLVER_MAX_NUM_ENTRIES];
+
+// Mutex protecting everything here.
+static std::mutex gResolverMutex;
+
+// Signalled when a lookup is asked for, when one
+// finishes and when the resolver task is to stop.
+static std::condition_variable gResolverCondition;
+
+// The task that does the lookups.
+static std::thread *gpResolverTask = NULL;
+
+// Flag to stop the resolver task.
+static bool gResolverStop = false;
+
+/* ----------------------------------------------------------------
+ * STATIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+// Look up the address of a URL; this blocks.
+static bool lookUpUrl(const char *pUrl, struct sockaddr_storage *pAddress,
+                      socklen_t *pAddressLength)
+{
+    bool success = false;
+    char host[RESOLVER_MAX_LEN_URL];
+    char service[16];
+    struct addrinfo hints;
+    struct addrinfo *pResult = NULL;
+    int port = 0;
+    int x;
+
+    getAddressFromUrl(pUrl, host, sizeof(host));
+    getPortFromUrl(pUrl, &port);
+    snprintf(service, sizeof(service), "%d", port);
+
+    // Any address family, but only those that this machine
+    // has an address for; the socket type is only there to
+    // stop each address coming back once per type
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG | AI_NUMERICSERV;
+
+    LOG(EVENT_DNS_LOOKUP, 0);
+    x = getaddrinfo(host, service, &hints, &pResult);
+    // getaddrinfo() sorts the addresses into the order
+    // they should be tried in, so take the first
+    if ((x == 0) && (pResult != NULL) && (pResult->ai_addrlen <= sizeof(*pAddress))) {
+        memcpy(pAddress, pResult->ai_addr, pResult->ai_addrlen);
+        *pAddressLength = pResult->ai_addrlen;
+        success = true;
+    } else {
+        LOG(EVENT_DNS_LOOKUP_FAILURE, x);
+    }
+    if (pResult != NULL) {
+        freeaddrinfo(pResult);
+    }
+
+    return success;
+}
+
+// The task that does the lookups.
+static void resolverTask()
+{
+    std::unique_lock<std::mutex> lock(gResolverMutex);
+    ResolverEntry *pEntry;
+    char url[RESOLVER_MAX_LEN_URL];
+    struct sockaddr_storage address;
+    socklen_t addressLength = 0;
+    bool success;
+
+    while (!gResolverStop) {
+        pEntry = NULL;
+        for (int x = 0; (pEntry == NULL) && (x < RESOLVER_MAX_NUM_ENTRIES); x++) {
+            if (gResolverCache[x].lookupWanted) {
+                pEntry = &(gResolverCache[x]);
+            }
+        }
+        if (pEntry != NULL) {
+            // Let go of the mutex while the lookup is done;
+            // the entry is left alone while lookupWanted is set
+            strcpy(url, pEntry->url);
+            lock.unlock();
+            success = lookUpUrl(url, &address, &addressLength);
+            lock.lock();
+            // A failed lookup leaves the old address in place
+            if (success) {
+                memcpy(&(pEntry->address), &address, addressLength);
+                pEntry->addressLength = addressLength;
+                pEntry->lookupUSeconds = getUSeconds();
+            }
+            pEntry->lookupWanted = false;
+            pEntry->numLookups++;
+            gResolverCondition.notify_all();
+        } else {
+            gResolverCondition.wait(lock);
+        }
+    }
+}
+
+/* ----------------------------------------------------------------
+ * PUBLIC FUNCTIONS
+ * -------------------------------------------------------------- */
+
+// Initialise the resolver.
+bool initResolver()
+{
+    std::unique_lock<std::mutex> lock(gResolverMutex);
+
+    if (gpResolverTask == NULL) {
+        gResolverStop = false;
+        gpResolverTask = new std::thread(resolverTask);
+    }
+
+    return (gpResolverTask != NULL);
+}
+
+// Deinitialise the resolver.
+void deinitResolver()
+{
+    std::unique_lock<std::mutex> lock(gResolverMutex);
+
+    if (gpResolverTask != NULL) {
+        gResolverStop = true;
+        gResolverCondition.notify_all();
+        lock.unlock();
+        gpResolverTask->join();
+        lock.lock();
+        delete gpResolverTask;
+        gpResolverTask = NULL;
+    }
+    memset(gResolverCache, 0, sizeof(gResolverCache));
+}
+
+// Get the address of the server in a URL.
+bool resolveUrl(const char *pUrl, struct sockaddr_storage *pAddress,
+                socklen_t *pAddressLength, int waitMs)
+{
+    std::unique_lock<std::mutex> lock(gResolverMutex);
+    std::chrono::steady_clock::time_point waitEnd = std::chrono::steady_clock::now() +
+                                                    std::chrono::milliseconds(waitMs);
+    ResolverEntry *pEntry = NULL;
+    ResolverEntry *pCandidate;
+    ResolverEntry *pOldest = NULL;
+    unsigned int numLookups;
+    bool success = false;
+
+    if ((gpResolverTask != NULL) && (strlen(pUrl) < RESOLVER_MAX_LEN_URL)) {
+        // Find the URL in the cache or, failing that, the oldest
+        // entry that isn't being looked up to put it in (a free
+        // entry has a lookupUSeconds of 0, so is the oldest)
+        for (int x = 0; (pEntry == NULL) && (x < RESOLVER_MAX_NUM_ENTRIES); x++) {
+            pCandidate = &(gResolverCache[x]);
+            if (strcmp(pCandidate->url, pUrl) == 0) {
+                pEntry = pCandidate;
+            } else if (!pCandidate->lookupWanted &&
+                       ((pOldest == NULL) || (pCandidate->lookupUSeconds < pOldest->lookupUSeconds))) {
+                pOldest = pCandidate;
+            }
+        }
+        if ((pEntry == NULL) && (pOldest != NULL)) {
+            pEntry = pOldest;
+            memset(pEntry, 0, sizeof(*pEntry));
+            strcpy(pEntry->url, pUrl);
+        }
+
+        if (pEntry != NULL) {
+            if ((pEntry->addressLength == 0) ||
+                (getUSeconds() - pEntry->lookupUSeconds > (long long int) RESOLVER_CACHE_LIFETIME_S * 1000000)) {
+                pEntry->lookupWanted = true;
+                gResolverCondition.notify_all();
+            }
+            // Only wait if there's nothing to be going on with
+            if ((pEntry->addressLength == 0) && (waitMs > 0)) {
+                numLookups = pEntry->numLookups;
+                while ((pEntry->numLookups == numLookups) && !gResolverStop &&
+                       (gResolverCondition.wait_until(lock, waitEnd) != std::cv_status::timeout)) {
+                }
+            }
+            if (pEntry->addressLength > 0) {
+                memcpy(pAddress, &(pEntry->address), pEntry->addressLength);
+                *pAddressLength = pEntry->addressLength;
+                success = true;
+            }
+        }
+    }
+
+    return success;
+}
+
+// Get the string form of an address.
+const char *getAddressString(const struct sockaddr_storage *pAddress,
+                             socklen_t addressLength, char *pBuf)
+{
+    char host[RESOLVER_ADDRESS_STRING_LENGTH - 16];
+    char service[8];
+
+    if (getnameinfo((const struct sockaddr *) pAddress, addressLength, host, sizeof(host),
+                    service, sizeof(service), NI_NUMERICHOST | NI_NUMERICSERV) == 0) {
+        if (pAddress->ss_family == AF_INET6) {
+            snprintf(pBuf, RESOLVER_ADDRESS_STRING_LENGTH, "[%s]:%s", host, service);
+        } else {
+            snprintf(pBuf, RESOLVER_ADDRESS_STRING_LENGTH, "%s:%s", host, service);
+        }
+    } else {
+        strcpy(pBuf, "?");
+    }
+
+    return pBuf;
+}
+
+// End of file
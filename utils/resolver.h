@@ -0,0 +1,99 @@
+/* Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RESOLVER_
+#define _RESOLVER_
+
+#include <sys/socket.h>
+
+/* ----------------------------------------------------------------
+ * COMPILE-TIME MACROS
+ * -------------------------------------------------------------- */
+
+/** The maximum length of a URL that can be resolved, including
+ * the terminator.
+ */
+#ifndef RESOLVER_MAX_LEN_URL
+# define RESOLVER_MAX_LEN_URL 128
+#endif
+
+/** The number of URLs whose addresses are cached.
+ */
+#ifndef RESOLVER_MAX_NUM_ENTRIES
+# define RESOLVER_MAX_NUM_ENTRIES 4
+#endif
+
+/** How long a cached address is used before it is looked up
+ * again in seconds; getaddrinfo() doesn't tell us the TTL of
+ * the DNS record so this stands in for it.  While the new
+ * lookup is in progress, or if it fails, the old address
+ * carries on being used.
+ */
+#ifndef RESOLVER_CACHE_LIFETIME_S
+# define RESOLVER_CACHE_LIFETIME_S 300
+#endif
+
+/** The length of a buffer big enough for the string form
+ * of any address, see getAddressString().
+ */
+#define RESOLVER_ADDRESS_STRING_LENGTH 64
+
+/* ----------------------------------------------------------------
+ * FUNCTION PROTOTYPES
+ * -------------------------------------------------------------- */
+
+/** Initialise the resolver, starting the background task
+ * that does the lookups.
+ * @return true on success, otherwise false.
+ */
+bool initResolver();
+
+/** Deinitialise the resolver; this waits for any lookup in
+ * progress to finish.
+ */
+void deinitResolver();
+
+/** Get the address of the server in a URL of the form host:port,
+ * where host may be a name, an IPv4 address or an IPv6 address in
+ * square brackets (e.g. [2001:db8::1]:1297).  If the address is
+ * in the cache it is returned straight away, a new lookup being
+ * started in the background if it is more than
+ * RESOLVER_CACHE_LIFETIME_S old; if not a lookup is started and
+ * this waits up to waitMs for it to finish.  May be called from
+ * any thread.
+ * @param pUrl           the URL.
+ * @param pAddress       a place to put the address, including
+ *                       the port number.
+ * @param pAddressLength a place to put the length of the address.
+ * @param waitMs         how long to wait for a lookup, 0 to not
+ *                       wait at all.
+ * @return               true if the address was written to pAddress,
+ *                       false if it isn't known (yet).
+ */
+bool resolveUrl(const char *pUrl, struct sockaddr_storage *pAddress,
+                socklen_t *pAddressLength, int waitMs);
+
+/** Get the string form of an address, e.g. 192.168.1.1:1297
+ * or [2001:db8::1]:1297, for printing.
+ * @param pAddress      the address.
+ * @param addressLength the length of the address.
+ * @param pBuf          a buffer of at least
+ *                      RESOLVER_ADDRESS_STRING_LENGTH characters.
+ * @return              pBuf.
+ */
+const char *getAddressString(const struct sockaddr_storage *pAddress,
+                             socklen_t addressLength, char *pBuf);
+
+#endif // _RESOLVER_
+
+// End of file
@@ -34,26 +34,38 @@ long long int getUSeconds(void)
 }
 
 // Get the address portion of a URL, leaving off the port number etc.
+// An IPv6 address must be in square brackets, which are left off too.
 void getAddressFromUrl(const char *pUrl, char * pAddressBuf, int lenBuf)
 {
     const char *pPortPos;
     int lenUrl;
 
     if (lenBuf > 0) {
-        // Check for the presence of a port number
-        pPortPos = strchr(pUrl, ':');
-        if (pPortPos != NULL) {
-            // Length wanted is up to and including the ':'
+        if ((*pUrl == '[') && (strchr(pUrl, ']') != NULL)) {
+            // Length wanted is up to and including the ']'
             // (which will be overwritten with the terminator)
+            // from after the '['
+            pPortPos = strchr(pUrl, ']');
+            pUrl++;
             if (lenBuf > pPortPos - pUrl + 1) {
                 lenBuf = pPortPos - pUrl + 1;
             }
         } else {
-            // No port number, take the whole thing
-            // including the terminator
-            lenUrl = strlen (pUrl);
-            if (lenBuf > lenUrl + 1) {
-                lenBuf = lenUrl + 1;
+            // Check for the presence of a port number
+            pPortPos = strchr(pUrl, ':');
+            if (pPortPos != NULL) {
+                // Length wanted is up to and including the ':'
+                // (which will be overwritten with the terminator)
+                if (lenBuf > pPortPos - pUrl + 1) {
+                    lenBuf = pPortPos - pUrl + 1;
+                }
+            } else {
+                // No port number, take the whole thing
+                // including the terminator
+                lenUrl = strlen (pUrl);
+                if (lenBuf > lenUrl + 1) {
+                    lenBuf = lenUrl + 1;
+                }
             }
         }
         memcpy(pAddressBuf, pUrl, lenBuf);
@@ -65,8 +77,13 @@ void getAddressFromUrl(const char *pUrl, char * pAddressBuf, int lenBuf)
 bool getPortFromUrl(const char *pUrl, int *pPort)
 {
     bool success = false;
-    const char *pPortPos = strchr(pUrl, ':');
+    const char *pPortPos;
 
+    // Skip over an IPv6 address, which has colons of its own
+    if ((*pUrl == '[') && (strchr(pUrl, ']') != NULL)) {
+        pUrl = strchr(pUrl, ']');
+    }
+    pPortPos = strchr(pUrl, ':');
     if (pPortPos != NULL) {
         *pPort = atoi(pPortPos + 1);
         success = true;
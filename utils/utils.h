@@ -24,6 +24,8 @@
 long long int getUSeconds(void);
 
 /** Get the address portion of a URL, leaving off the port number etc.
+ * An IPv6 address must be in square brackets (e.g. [2001:db8::1]:1297),
+ * which are left off too.
  * @param pUrl         the URL.
  * @param pAddressBuf  the output buffer.
  * @param lenBuf       the length of the output buffer.